@@ -0,0 +1,84 @@
+#include "bitmap.h"
+
+void bitmap_set(uint64_t *map, uint32_t bit) {
+    map[bit / 64] |= (uint64_t) 1 << (bit % 64);
+}
+
+void bitmap_clear(uint64_t *map, uint32_t bit) {
+    map[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+}
+
+int bitmap_test(const uint64_t *map, uint32_t bit) {
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+// 在 [start, end) 中查找第一个值为 value 的位，没有则返回 -1
+static int32_t find_in_range(const uint64_t *map, uint32_t start, uint32_t end, int value) {
+    if (start >= end) {
+        return -1;
+    }
+    uint64_t flip = value ? 0 : ~(uint64_t) 0;     // 查找 0 时将字取反
+    uint32_t index = start / 64;
+    // 第一个字中 start 之前的位不参与查找
+    uint64_t word = (map[index] ^ flip) & (~(uint64_t) 0 << (start % 64));
+    while (1) {
+        if (word != 0) {
+            uint32_t bit = index * 64 + __builtin_ctzll(word);
+            return bit < end ? (int32_t) bit : -1;
+        }
+        index++;
+        if (index * 64 >= end) {
+            return -1;
+        }
+        word = map[index] ^ flip;
+    }
+}
+
+static int32_t find_zero_in_range(const uint64_t *map, uint32_t start, uint32_t end) {
+    return find_in_range(map, start, end, 0);
+}
+
+int32_t bitmap_find_zero(const uint64_t *map, uint32_t nbits, uint32_t start) {
+    if (start >= nbits) {
+        start = 0;
+    }
+    int32_t bit = find_zero_in_range(map, start, nbits);
+    if (bit == -1 && start > 0) {
+        bit = find_zero_in_range(map, 0, start);
+    }
+    return bit;
+}
+
+int bitmap_next_zero_run(const uint64_t *map, uint32_t nbits, uint32_t pos, uint32_t *start, uint32_t *len) {
+    int32_t zero = find_zero_in_range(map, pos, nbits);
+    if (zero == -1) {
+        return 0;
+    }
+    int32_t one = find_in_range(map, zero, nbits, 1);
+    *start = zero;
+    *len = (one == -1 ? nbits : (uint32_t) one) - zero;
+    return 1;
+}
+
+int32_t bitmap_find_zero_run(const uint64_t *map, uint32_t nbits, uint32_t len, uint32_t start) {
+    uint32_t run_start, run_len;
+    if (start >= nbits) {
+        start = 0;
+    }
+    // 先查找 start 之后的部分，再从头查找
+    uint32_t pos = start;
+    while (bitmap_next_zero_run(map, nbits, pos, &run_start, &run_len)) {
+        if (run_len >= len) {
+            return run_start;
+        }
+        pos = run_start + run_len;
+    }
+    pos = 0;
+    while (pos < start && bitmap_next_zero_run(map, nbits, pos, &run_start, &run_len)) {
+        if (run_len >= len) {
+            return run_start;
+        }
+        pos = run_start + run_len;
+    }
+    return -1;
+}
@@ -0,0 +1,18 @@
+#ifndef EXT2_EMULATOR_BITMAP_H
+#define EXT2_EMULATOR_BITMAP_H
+
+#include <stdint.h>
+
+// 位图以 64 位字为单位存储，第 n 位位于 map[n / 64] 的第 n % 64 位
+
+void bitmap_set(uint64_t *map, uint32_t bit);
+void bitmap_clear(uint64_t *map, uint32_t bit);
+int bitmap_test(const uint64_t *map, uint32_t bit);
+// 从 start 开始查找第一个为 0 的位，到末尾后从头继续，全满返回 -1
+int32_t bitmap_find_zero(const uint64_t *map, uint32_t nbits, uint32_t start);
+// 查找从 pos 开始的下一段连续的 0，起点和长度写入 start 和 len，没有返回 0
+int bitmap_next_zero_run(const uint64_t *map, uint32_t nbits, uint32_t pos, uint32_t *start, uint32_t *len);
+// 从 start 开始查找第一段长度不小于 len 的连续的 0，到末尾后从头继续，没有返回 -1
+int32_t bitmap_find_zero_run(const uint64_t *map, uint32_t nbits, uint32_t len, uint32_t start);
+
+#endif //EXT2_EMULATOR_BITMAP_H
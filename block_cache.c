@@ -0,0 +1,277 @@
+#include "block_cache.h"
+
+#define HASH_SIZE BLOCK_CACHE_HASH_SIZE
+#define HASH(id) ((uint32_t)(id) % HASH_SIZE)
+
+// 从磁盘读取 block 到 frame
+static void read_frame(block_cache *cache, cache_frame *frame) {
+    disk_read(cache->disk, frame->block_id * cache->block_size, frame->data, cache->block_size);
+}
+
+// 将 frame 写回磁盘
+static void write_frame(block_cache *cache, cache_frame *frame) {
+    disk_write(cache->disk, frame->block_id * cache->block_size, frame->data, cache->block_size);
+    frame->dirty = 0;
+    cache->dirty_count--;
+}
+
+// 在哈希表中查找 block 对应的 frame
+static int32_t lookup(block_cache *cache, int32_t block_id) {
+    for (int32_t i = cache->hash_head[HASH(block_id)]; i != -1; i = cache->frames[i].next) {
+        if (cache->frames[i].block_id == block_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 从哈希表中移除 frame
+static void unlink_frame(block_cache *cache, int32_t index) {
+    int32_t *p = &cache->hash_head[HASH(cache->frames[index].block_id)];
+    while (*p != index) {
+        p = &cache->frames[*p].next;
+    }
+    *p = cache->frames[index].next;
+    cache->frames[index].block_id = -1;
+    cache->frames[index].next = -1;
+}
+
+// 用 CLOCK 算法选出一个可换出的 frame，所有 frame 都被固定时返回 -1
+// hold 为 0 时即使 hold_dirty 也换出脏 block
+static int32_t try_evict(block_cache *cache, int hold) {
+    // 转两圈仍找不到说明所有 frame 都被固定
+    for (uint32_t n = 0; n < 2 * cache->frame_count; n++) {
+        int32_t i = cache->clock_hand;
+        cache->clock_hand = (cache->clock_hand + 1) % cache->frame_count;
+        cache_frame *frame = &cache->frames[i];
+        if (frame->pin_count > 0 || (hold && cache->hold_dirty && frame->dirty)) {
+            continue;
+        }
+        if (frame->block_id == -1) {
+            return i;
+        }
+        if (frame->referenced) {
+            frame->referenced = 0;      // 给第二次机会
+            continue;
+        }
+        if (frame->dirty) {
+            write_frame(cache, frame);
+        }
+        unlink_frame(cache, i);
+        return i;
+    }
+    return -1;
+}
+
+// 命令修改的 block 数有上限，正常总能找到可换出的 frame；
+// 万一其余 frame 都是等待日志提交的脏 block，宁可将其中一个直接写回原位置，也不终止进程；
+// 所有 frame 都被固定时等待其他线程解除固定
+static int32_t evict(block_cache *cache) {
+    while (1) {
+        int32_t index = try_evict(cache, 1);
+        if (index == -1) {
+            index = try_evict(cache, 0);
+        }
+        if (index != -1) {
+            return index;
+        }
+        pthread_cond_wait(&cache->unpinned, &cache->lock);
+    }
+}
+
+// 将空闲的 frame 分配给 block 并加入哈希表
+static void install_frame(block_cache *cache, int32_t index, int32_t block_id) {
+    cache_frame *frame = &cache->frames[index];
+    frame->block_id = block_id;
+    frame->dirty = 0;
+    frame->next = cache->hash_head[HASH(block_id)];
+    cache->hash_head[HASH(block_id)] = index;
+}
+
+void block_cache_init(block_cache *cache, disk_file *disk, uint32_t block_size, uint32_t held) {
+    cache->disk = disk;
+    cache->block_size = block_size;
+    cache->frame_count = BLOCK_CACHE_SIZE + held;
+    cache->frames = malloc(sizeof(cache_frame) * cache->frame_count);
+    cache->buffer = malloc((size_t) cache->frame_count * block_size);
+    for (int i = 0; i < HASH_SIZE; i++) {
+        cache->hash_head[i] = -1;
+    }
+    for (uint32_t i = 0; i < cache->frame_count; i++) {
+        cache->frames[i].block_id = -1;
+        cache->frames[i].dirty = 0;
+        cache->frames[i].referenced = 0;
+        cache->frames[i].pin_count = 0;
+        cache->frames[i].next = -1;
+        cache->frames[i].data = (dir_item *) (cache->buffer + (size_t) i * block_size);
+    }
+    cache->clock_hand = 0;
+    cache->hold_dirty = 0;
+    cache->dirty_count = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->unpinned, NULL);
+}
+
+void block_cache_destroy(block_cache *cache) {
+    free(cache->buffer);
+    free(cache->frames);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->unpinned);
+}
+
+dir_item *block_cache_get(block_cache *cache, int32_t block_id, int load) {
+    // mmap 方式下直接返回映射地址，不经过缓存
+    dir_item *mapped = disk_map(cache->disk, block_id * cache->block_size);
+    if (mapped != NULL) {
+        return mapped;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int32_t index = lookup(cache, block_id);
+    if (index == -1) {
+        // 未命中，换入
+        index = evict(cache);
+        install_frame(cache, index, block_id);
+        if (load) {
+            read_frame(cache, &cache->frames[index]);
+        }
+    }
+    cache->frames[index].referenced = 1;
+    cache->frames[index].pin_count++;
+    pthread_mutex_unlock(&cache->lock);
+    return cache->frames[index].data;
+}
+
+void block_cache_put(block_cache *cache, dir_item *data, int dirty) {
+    if (disk_map(cache->disk, 0) != NULL) {
+        return;
+    }
+    cache_frame *frame = &cache->frames[((uint8_t *) data - cache->buffer) / cache->block_size];
+    pthread_mutex_lock(&cache->lock);
+    if (dirty && !frame->dirty) {
+        frame->dirty = 1;
+        cache->dirty_count++;
+    }
+    frame->pin_count--;
+    if (frame->pin_count == 0) {
+        pthread_cond_signal(&cache->unpinned);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void block_cache_discard(block_cache *cache, const uint32_t *ids, int count) {
+    if (disk_map(cache->disk, 0) != NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < count; i++) {
+        int32_t index = lookup(cache, ids[i]);
+        if (index != -1 && cache->frames[index].pin_count == 0) {
+            cache->dirty_count -= cache->frames[index].dirty;
+            cache->frames[index].dirty = 0;
+            unlink_frame(cache, index);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void block_cache_readahead(block_cache *cache, const uint32_t *ids, int count) {
+    if (count > READAHEAD_BLOCKS) {
+        count = READAHEAD_BLOCKS;
+    }
+    // mmap 方式下交给内核预读
+    if (disk_map(cache->disk, 0) != NULL) {
+        for (int i = 0; i < count; i++) {
+            disk_prefetch(cache->disk, ids[i] * cache->block_size, cache->block_size);
+        }
+        return;
+    }
+
+    uint8_t buffer[READAHEAD_BLOCKS * MAX_BLOCK_SIZE];
+    int32_t indexes[READAHEAD_BLOCKS];
+    pthread_mutex_lock(&cache->lock);
+    int i = 0;
+    while (i < count) {
+        if (lookup(cache, ids[i]) != -1) {
+            i++;
+            continue;
+        }
+        // 从 i 开始 block 号连续且未缓存的一段
+        int n = 1;
+        while (i + n < count && ids[i + n] == ids[i] + n && lookup(cache, ids[i + n]) == -1) {
+            n++;
+        }
+        // 换入期间固定已分配的 frame，避免被再次选中
+        int got = 0;
+        while (got < n && (indexes[got] = try_evict(cache, 1)) != -1) {
+            install_frame(cache, indexes[got], ids[i + got]);
+            cache->frames[indexes[got]].pin_count++;
+            got++;
+        }
+        if (got > 0) {
+            disk_read(cache->disk, ids[i] * cache->block_size, buffer, got * cache->block_size);
+            for (int k = 0; k < got; k++) {
+                cache_frame *frame = &cache->frames[indexes[k]];
+                memcpy(frame->data, buffer + k * cache->block_size, cache->block_size);
+                frame->referenced = 1;
+                frame->pin_count--;
+            }
+            pthread_cond_broadcast(&cache->unpinned);
+        }
+        if (got < n) {
+            break;
+        }
+        i += n;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static int compare_block_id(const void *a, const void *b) {
+    return (*(cache_frame *const *) a)->block_id - (*(cache_frame *const *) b)->block_id;
+}
+
+// 找出所有脏 frame，按 block 号排序
+static int collect_dirty(block_cache *cache, cache_frame **dirty) {
+    int count = 0;
+    for (uint32_t i = 0; i < cache->frame_count; i++) {
+        if (cache->frames[i].block_id != -1 && cache->frames[i].dirty) {
+            dirty[count++] = &cache->frames[i];
+        }
+    }
+    qsort(dirty, count, sizeof(cache_frame *), compare_block_id);
+    return count;
+}
+
+void block_cache_flush(block_cache *cache) {
+    // 按 block 号排序后写回，尽量顺序写
+    cache_frame **dirty = malloc(sizeof(cache_frame *) * cache->frame_count);
+    pthread_mutex_lock(&cache->lock);
+    int count = collect_dirty(cache, dirty);
+    for (int i = 0; i < count; i++) {
+        write_frame(cache, dirty[i]);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(dirty);
+}
+
+void block_cache_hold_dirty(block_cache *cache, int hold) {
+    cache->hold_dirty = hold;
+}
+
+int block_cache_dirty_blocks(block_cache *cache, int32_t *ids) {
+    if (ids == NULL) {
+        pthread_mutex_lock(&cache->lock);
+        int count = cache->dirty_count;
+        pthread_mutex_unlock(&cache->lock);
+        return count;
+    }
+    cache_frame **dirty = malloc(sizeof(cache_frame *) * cache->frame_count);
+    pthread_mutex_lock(&cache->lock);
+    int count = collect_dirty(cache, dirty);
+    for (int i = 0; i < count; i++) {
+        ids[i] = dirty[i]->block_id;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(dirty);
+    return count;
+}
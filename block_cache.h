@@ -0,0 +1,73 @@
+#ifndef EXT2_EMULATOR_BLOCK_CACHE_H
+#define EXT2_EMULATOR_BLOCK_CACHE_H
+
+#include "fs_operation.h"
+#include "disk.h"
+#include <pthread.h>
+
+#define BLOCK_CACHE_SIZE 64
+// 供读取的 block 数量，64 * 1KB 到 64 * 4KB；另有 held 个 frame 留给等待日志提交的脏 block，见 block_cache_init
+#define BLOCK_CACHE_HASH_SIZE 128
+#define READAHEAD_BLOCKS 8
+// 一次预读的最多 block 数
+
+typedef struct cache_frame {
+    int32_t block_id;
+    // -1 表示空闲
+    uint8_t dirty;
+    // 1 表示与磁盘内容不一致，换出或 flush 时写回
+    uint8_t referenced;
+    // CLOCK 置换算法的访问位
+    uint16_t pin_count;
+    // 大于 0 时不可换出
+    int32_t next;
+    // 哈希链表中的下一个 frame，-1 表示末尾
+    dir_item *data;
+    // block 内容，位于 block_cache 的 buffer 中
+} cache_frame;
+
+typedef struct block_cache {
+    disk_file *disk;
+    uint32_t block_size;
+    cache_frame *frames;
+    uint32_t frame_count;
+    // BLOCK_CACHE_SIZE 加上为脏 block 留出的 frame
+    uint8_t *buffer;
+    // 所有 frame 的内容，依次 block_size 字节
+    int32_t hash_head[BLOCK_CACHE_HASH_SIZE];
+    // 每个桶的第一个 frame
+    uint32_t clock_hand;
+    // CLOCK 指针
+    int hold_dirty;
+    // 是否在换出时保留脏 block
+    uint32_t dirty_count;
+    // 脏 frame 的数量
+    pthread_mutex_t lock;
+    // 保护以上所有字段，frame 中的内容由使用者所在目录的锁保护
+    pthread_cond_t unpinned;
+    // 有 frame 解除固定时通知，所有 frame 都被固定时换入需要等待
+} block_cache;
+
+// 初始化缓存，在 fs_init 打开磁盘文件、读出 block 大小后调用
+// held 为 hold_dirty 时留给脏 block 的 frame 数，脏 block 不超过它时仍有 BLOCK_CACHE_SIZE 个 frame 可以换出
+void block_cache_init(block_cache *cache, disk_file *disk, uint32_t block_size, uint32_t held);
+void block_cache_destroy(block_cache *cache);
+// 取得 block 对应的缓存并固定（pin）
+// load 为 0 时不从磁盘读取，用于整块覆盖写
+// mmap 方式下直接返回映射地址
+dir_item *block_cache_get(block_cache *cache, int32_t block_id, int load);
+// 解除固定，dirty 为 1 时标记为脏
+void block_cache_put(block_cache *cache, dir_item *data, int dirty);
+// 丢弃已释放的 block 的缓存，即使是脏的也不再写回，使删除大文件时脏 block 不会越积越多；被固定的保留
+void block_cache_discard(block_cache *cache, const uint32_t *ids, int count);
+// 预读 ids 中尚未缓存的 block 而不固定，block 号连续的一段合并为一次读取，最多预读 READAHEAD_BLOCKS 个
+// 没有可换出的 frame 时放弃剩余的预读
+void block_cache_readahead(block_cache *cache, const uint32_t *ids, int count);
+// 将所有脏 block 写回磁盘，之后需调用 disk_sync 落盘
+void block_cache_flush(block_cache *cache);
+// hold 为 1 时换出不写回脏 block，脏 block 只由 block_cache_flush 写回，用于日志
+void block_cache_hold_dirty(block_cache *cache, int hold);
+// 按 block 号从小到大写入所有脏 block 的编号，ids 为 NULL 时只计数，返回脏 block 数，至多 frame_count 个
+int block_cache_dirty_blocks(block_cache *cache, int32_t *ids);
+
+#endif //EXT2_EMULATOR_BLOCK_CACHE_H
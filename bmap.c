@@ -0,0 +1,385 @@
+#include "bmap.h"
+
+// 间接 block 中的项数随缓存的 block 大小而定
+#define PER_BLOCK(cache) POINTERS_PER_BLOCK((cache)->block_size)
+#define PER_EXTENT_BLOCK(cache) EXTENTS_PER_BLOCK((cache)->block_size)
+#define SINGLE_END(cache) (DIRECT_BLOCKS + PER_BLOCK(cache))    // 一级间接 block 之后的第一个 block
+#define DIRECT_EXTENTS(cache) (EXTENT_BLOCKS * PER_EXTENT_BLOCK(cache))  // 记在 block_point 直接指向的 extent block 中的段数
+
+// 正在访问的间接 block
+typedef struct held_block {
+    block_cache *cache;
+    uint32_t block_id;
+    uint32_t *pointers;
+    // NULL 表示没有持有
+    int dirty;
+} held_block;
+
+static void release(held_block *held) {
+    if (held->pointers != NULL) {
+        block_cache_put(held->cache, (dir_item *) held->pointers, held->dirty);
+        held->pointers = NULL;
+    }
+}
+
+// 换成持有 block_id，已经持有时直接返回；fresh 为 1 时是新分配的间接 block，不读取并清零
+static uint32_t *hold(held_block *held, uint32_t block_id, int fresh) {
+    if (held->pointers != NULL && held->block_id == block_id) {
+        return held->pointers;
+    }
+    release(held);
+    held->pointers = (uint32_t *) block_cache_get(held->cache, block_id, !fresh);
+    held->block_id = block_id;
+    held->dirty = fresh;
+    if (fresh) {
+        memset(held->pointers, 0, held->cache->block_size);
+    }
+    return held->pointers;
+}
+
+static void pointer_range(block_cache *cache, const inode *node, uint32_t index, uint32_t count, uint32_t *ids) {
+    held_block root = {cache, 0, NULL, 0}, leaf = {cache, 0, NULL, 0};
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t i = index + k;
+        if (node->size <= INODE_BLOCKS || i < DIRECT_BLOCKS) {
+            ids[k] = node->block_point[i];
+        } else if (i < SINGLE_END(cache)) {
+            ids[k] = hold(&leaf, node->block_point[INDIRECT_BLOCK], 0)[i - DIRECT_BLOCKS];
+        } else {
+            i -= SINGLE_END(cache);
+            uint32_t leaf_id = hold(&root, node->block_point[DOUBLE_INDIRECT_BLOCK], 0)[i / PER_BLOCK(cache)];
+            ids[k] = hold(&leaf, leaf_id, 0)[i % PER_BLOCK(cache)];
+        }
+    }
+    release(&leaf);
+    release(&root);
+}
+
+// 有 blocks 个 block 时需要的间接 block 数
+static uint32_t pointer_index_blocks(block_cache *cache, uint32_t blocks) {
+    if (blocks <= INODE_BLOCKS) {
+        return 0;
+    }
+    if (blocks <= SINGLE_END(cache)) {
+        return 1;
+    }
+    // 一级、二级间接 block 和二级间接 block 指向的间接 block
+    return 2 + (blocks - SINGLE_END(cache) + PER_BLOCK(cache) - 1) / PER_BLOCK(cache);
+}
+
+static void pointer_append(block_cache *cache, inode *node, const uint32_t *ids, uint32_t count,
+                           const uint32_t *index_ids) {
+    held_block root = {cache, 0, NULL, 0}, leaf = {cache, 0, NULL, 0};
+    uint32_t size = node->size;
+    uint32_t total = size + count;
+    if (size <= INODE_BLOCKS && total > INODE_BLOCKS) {
+        // 改为间接的格式，block_point[DIRECT_BLOCKS] 之后的直接指针移入一级间接 block
+        uint32_t *pointers = hold(&leaf, *index_ids, 1);
+        for (uint32_t i = DIRECT_BLOCKS; i < size; i++) {
+            pointers[i - DIRECT_BLOCKS] = node->block_point[i];
+        }
+        node->block_point[INDIRECT_BLOCK] = *index_ids++;
+        node->block_point[DOUBLE_INDIRECT_BLOCK] = 0;
+    }
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t i = size + k;
+        if (total <= INODE_BLOCKS || i < DIRECT_BLOCKS) {
+            node->block_point[i] = ids[k];
+            continue;
+        }
+        uint32_t *pointers;
+        if (i < SINGLE_END(cache)) {
+            pointers = hold(&leaf, node->block_point[INDIRECT_BLOCK], 0);
+            i -= DIRECT_BLOCKS;
+        } else {
+            i -= SINGLE_END(cache);
+            if (i == 0) {       // 第一次用到二级间接 block
+                node->block_point[DOUBLE_INDIRECT_BLOCK] = *index_ids;
+                hold(&root, *index_ids++, 1);
+            }
+            uint32_t *leaves = hold(&root, node->block_point[DOUBLE_INDIRECT_BLOCK], 0);
+            if (i % PER_BLOCK(cache) == 0) {
+                leaves[i / PER_BLOCK(cache)] = *index_ids;
+                root.dirty = 1;
+                pointers = hold(&leaf, *index_ids++, 1);
+            } else {
+                pointers = hold(&leaf, leaves[i / PER_BLOCK(cache)], 0);
+            }
+            i %= PER_BLOCK(cache);
+        }
+        pointers[i] = ids[k];
+        leaf.dirty = 1;
+    }
+    release(&leaf);
+    release(&root);
+    __atomic_store_n(&node->size, total, __ATOMIC_RELEASE);     // 查找可能不加锁地读取 size，见 fs_lookup_cached
+}
+
+static uint32_t pointer_truncate(block_cache *cache, inode *node, uint32_t blocks, uint32_t *freed) {
+    uint32_t size = node->size;
+    uint32_t count = size - blocks;
+    pointer_range(cache, node, blocks, count, freed);
+
+    held_block held = {cache, 0, NULL, 0};
+    if (size > SINGLE_END(cache)) {
+        // 不再需要的二级间接 block 和它指向的间接 block
+        uint32_t leaves = (size - SINGLE_END(cache) + PER_BLOCK(cache) - 1) / PER_BLOCK(cache);
+        uint32_t keep = blocks > SINGLE_END(cache) ? (blocks - SINGLE_END(cache) + PER_BLOCK(cache) - 1) / PER_BLOCK(cache) : 0;
+        uint32_t *pointers = hold(&held, node->block_point[DOUBLE_INDIRECT_BLOCK], 0);
+        for (uint32_t i = keep; i < leaves; i++) {
+            freed[count++] = pointers[i];
+        }
+        release(&held);
+        if (keep == 0) {
+            freed[count++] = node->block_point[DOUBLE_INDIRECT_BLOCK];
+        }
+    }
+    if (size > INODE_BLOCKS && blocks <= INODE_BLOCKS) {
+        // 回到只有直接指针的格式
+        uint32_t single = node->block_point[INDIRECT_BLOCK];
+        uint32_t *pointers = hold(&held, single, 0);
+        for (uint32_t i = DIRECT_BLOCKS; i < blocks; i++) {
+            node->block_point[i] = pointers[i - DIRECT_BLOCKS];
+        }
+        release(&held);
+        freed[count++] = single;
+    }
+    __atomic_store_n(&node->size, blocks, __ATOMIC_RELEASE);
+    return count;
+}
+
+// 段数超过 INLINE_EXTENTS 时 extent 记在 extent block 中
+static int extent_tree(const inode *node) {
+    return node->size > 0 && node->block_point[0] == 0;
+}
+
+static uint32_t extent_count(const inode *node) {
+    if (extent_tree(node)) {
+        return node->block_point[1];
+    }
+    const extent *extents = (const extent *) node->block_point;
+    uint32_t n = 0;
+    while (n < INLINE_EXTENTS && node->size > 0 && extents[n].count > 0) {
+        n++;
+    }
+    return n;
+}
+
+// 有 n 段时需要的 extent block 和间接 block 数
+static uint32_t extent_blocks(block_cache *cache, uint32_t n) {
+    if (n <= INLINE_EXTENTS) {
+        return 0;
+    }
+    return (n + PER_EXTENT_BLOCK(cache) - 1) / PER_EXTENT_BLOCK(cache) + (n > DIRECT_EXTENTS(cache));
+}
+
+// 第 k 段在 extent block 中的位置，持有它所在的 extent block，root 持有间接 block
+// index_ids 不为 NULL 时第 k 段是新增的，需要的 extent block 和间接 block 依次从中取出
+static extent *extent_slot(held_block *root, held_block *leaf, uint32_t *block_point, uint32_t k,
+                           const uint32_t **index_ids) {
+    block_cache *cache = root->cache;
+    int fresh = index_ids != NULL && k % PER_EXTENT_BLOCK(cache) == 0;
+    uint32_t *slot;
+    if (k < DIRECT_EXTENTS(cache)) {
+        slot = &block_point[2 + k / PER_EXTENT_BLOCK(cache)];
+    } else {
+        k -= DIRECT_EXTENTS(cache);
+        if (index_ids != NULL && k == 0) {      // 第一次用到间接 block
+            block_point[EXTENT_INDEX_BLOCK] = *(*index_ids)++;
+            hold(root, block_point[EXTENT_INDEX_BLOCK], 1);
+        }
+        slot = hold(root, block_point[EXTENT_INDEX_BLOCK], 0) + k / PER_EXTENT_BLOCK(cache);
+        root->dirty |= fresh;
+    }
+    if (fresh) {
+        *slot = *(*index_ids)++;
+    }
+    return (extent *) hold(leaf, *slot, fresh) + k % PER_EXTENT_BLOCK(cache);
+}
+
+// 第 k 段，extents 为 inode 中直接存放的段，NULL 表示记在 extent block 中
+static extent *extent_at(held_block *root, held_block *leaf, inode *node, extent *extents, uint32_t k) {
+    return extents != NULL ? &extents[k] : extent_slot(root, leaf, node->block_point, k, NULL);
+}
+
+static void extent_range(block_cache *cache, const inode *node, uint32_t index, uint32_t count, uint32_t *ids) {
+    held_block root = {cache, 0, NULL, 0}, leaf = {cache, 0, NULL, 0};
+    inode *cur = (inode *) node;        // 只读取
+    extent *extents = extent_tree(node) ? NULL : (extent *) cur->block_point;
+    uint32_t n = extent_count(node);
+    uint32_t first = 0;     // 当前段的第一个 block 在文件中的位置
+    for (uint32_t k = 0; k < n && count > 0; k++) {
+        extent *e = extent_at(&root, &leaf, cur, extents, k);
+        // 跳过 index 之前的段
+        for (uint32_t i = index > first ? index - first : 0; i < e->count && count > 0; i++) {
+            *ids++ = e->start + i;
+            index++;
+            count--;
+        }
+        first += e->count;
+    }
+    release(&leaf);
+    release(&root);
+}
+
+// 连续的 block 合为一段，第一个 block 接在 last 之后时并入 last
+static uint32_t count_runs(const uint32_t *ids, uint32_t count, uint32_t last) {
+    uint32_t runs = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        runs += ids[k] != last + 1;
+        last = ids[k];
+    }
+    return runs;
+}
+
+// 最后一段的最后一个 block，没有时为 0
+static uint32_t extent_last(block_cache *cache, const inode *node, uint32_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    uint32_t last;
+    extent_range(cache, node, node->size - 1, 1, &last);
+    return last;
+}
+
+static int extent_index_blocks(block_cache *cache, const inode *node, const uint32_t *ids, uint32_t count) {
+    uint32_t n = extent_count(node);
+    uint32_t total = n + count_runs(ids, count, extent_last(cache, node, n));
+    if (total > EXTENT_MAX(cache->block_size)) {
+        return -1;
+    }
+    return extent_blocks(cache, total) - extent_blocks(cache, n);
+}
+
+static void extent_append(block_cache *cache, inode *node, const uint32_t *ids, uint32_t count,
+                          const uint32_t *index_ids) {
+    held_block root = {cache, 0, NULL, 0}, leaf = {cache, 0, NULL, 0};
+    if (node->size == 0) {
+        memset(node->block_point, 0, sizeof(node->block_point));
+    }
+    uint32_t n = extent_count(node);
+    extent *extents = extent_tree(node) ? NULL : (extent *) node->block_point;
+    extent *e = n > 0 ? extent_at(&root, &leaf, node, extents, n - 1) : NULL;
+    for (uint32_t k = 0; k < count; k++) {
+        if (e != NULL && e->start + e->count == ids[k]) {
+            e->count++;
+            leaf.dirty = extents == NULL;
+            continue;
+        }
+        if (extents != NULL && n == INLINE_EXTENTS) {
+            // 改为记在 extent block 中
+            extent saved[INLINE_EXTENTS];
+            memcpy(saved, extents, sizeof(saved));
+            memset(node->block_point, 0, sizeof(node->block_point));
+            extents = NULL;
+            for (uint32_t i = 0; i < INLINE_EXTENTS; i++) {
+                *extent_slot(&root, &leaf, node->block_point, i, &index_ids) = saved[i];
+            }
+        }
+        e = extents != NULL ? &extents[n] : extent_slot(&root, &leaf, node->block_point, n, &index_ids);
+        e->start = ids[k];
+        e->count = 1;
+        leaf.dirty = extents == NULL;
+        n++;
+    }
+    release(&leaf);
+    release(&root);
+    if (extents == NULL) {
+        node->block_point[1] = n;
+    }
+    __atomic_store_n(&node->size, node->size + count, __ATOMIC_RELEASE);
+}
+
+static uint32_t extent_truncate(block_cache *cache, inode *node, uint32_t blocks, uint32_t *freed) {
+    held_block root = {cache, 0, NULL, 0}, leaf = {cache, 0, NULL, 0};
+    uint32_t old = extent_count(node);
+    extent *extents = extent_tree(node) ? NULL : (extent *) node->block_point;
+    uint32_t n = old, end = node->size, count = 0;
+    uint32_t last = old;    // 最后改动的一段，它所在的 extent block 保留时才需要写回
+    // 从最后一段向前截去，向前换到的上一个 extent block 之后的那个已经截空，随后释放，不标记为脏
+    while (end > blocks) {
+        extent *e = extent_at(&root, &leaf, node, extents, n - 1);
+        uint32_t keep = end - e->count >= blocks ? 0 : blocks - (end - e->count);
+        for (uint32_t i = keep; i < e->count; i++) {
+            freed[count++] = e->start + i;
+        }
+        end -= e->count;
+        last = n - 1;
+        if (keep > 0) {
+            e->count = keep;
+        } else {
+            *e = (extent) {0, 0};
+            n--;
+        }
+    }
+
+    if (extents == NULL) {
+        // 不再需要的 extent block 和间接 block
+        uint32_t *block_point = node->block_point;
+        uint32_t used = n <= INLINE_EXTENTS ? 0 : (n + PER_EXTENT_BLOCK(cache) - 1) / PER_EXTENT_BLOCK(cache);
+        leaf.dirty = last < old && last / PER_EXTENT_BLOCK(cache) < used;
+        uint32_t *leaves = old > DIRECT_EXTENTS(cache) ? hold(&root, block_point[EXTENT_INDEX_BLOCK], 0) : NULL;
+        extent saved[INLINE_EXTENTS];
+        if (used == 0 && n > 0) {
+            memcpy(saved, extent_slot(&root, &leaf, block_point, 0, NULL), sizeof(extent) * n);
+        }
+        release(&leaf);
+        for (uint32_t i = used; i * PER_EXTENT_BLOCK(cache) < old; i++) {
+            freed[count++] = i < EXTENT_BLOCKS ? block_point[2 + i] : leaves[i - EXTENT_BLOCKS];
+        }
+        release(&root);
+        if (old > DIRECT_EXTENTS(cache) && n <= DIRECT_EXTENTS(cache)) {
+            freed[count++] = block_point[EXTENT_INDEX_BLOCK];
+        }
+        if (used == 0) {
+            // 回到直接存放在 inode 中的格式
+            memset(block_point, 0, sizeof(node->block_point));
+            memcpy(block_point, saved, sizeof(extent) * n);
+        } else {
+            block_point[1] = n;
+        }
+    }
+    release(&leaf);
+    release(&root);
+    __atomic_store_n(&node->size, blocks, __ATOMIC_RELEASE);
+    return count;
+}
+
+uint32_t bmap_lookup(const block_mapping *map, const inode *node, uint32_t index) {
+    uint32_t block_id;
+    bmap_range(map, node, index, 1, &block_id);
+    return block_id;
+}
+
+void bmap_range(const block_mapping *map, const inode *node, uint32_t index, uint32_t count, uint32_t *ids) {
+    if (map->format == MAP_EXTENTS) {
+        extent_range(map->cache, node, index, count, ids);
+    } else {
+        pointer_range(map->cache, node, index, count, ids);
+    }
+}
+
+int bmap_index_blocks(const block_mapping *map, const inode *node, const uint32_t *ids, uint32_t count) {
+    if (map->format == MAP_EXTENTS) {
+        return extent_index_blocks(map->cache, node, ids, count);
+    }
+    return pointer_index_blocks(map->cache, node->size + count) - pointer_index_blocks(map->cache, node->size);
+}
+
+void bmap_append(const block_mapping *map, inode *node, const uint32_t *ids, uint32_t count, const uint32_t *index_ids) {
+    if (map->format == MAP_EXTENTS) {
+        extent_append(map->cache, node, ids, count, index_ids);
+    } else {
+        pointer_append(map->cache, node, ids, count, index_ids);
+    }
+}
+
+uint32_t bmap_truncate(const block_mapping *map, inode *node, uint32_t blocks, uint32_t *freed) {
+    if (blocks >= node->size) {
+        return 0;
+    }
+    if (map->format == MAP_EXTENTS) {
+        return extent_truncate(map->cache, node, blocks, freed);
+    }
+    return pointer_truncate(map->cache, node, blocks, freed);
+}
@@ -0,0 +1,59 @@
+#ifndef EXT2_EMULATOR_BMAP_H
+#define EXT2_EMULATOR_BMAP_H
+
+#include "fs_operation.h"
+#include "block_cache.h"
+
+// 文件和目录的第 i 个 block 在磁盘上的位置，即 inode 的 block_point 的用法，格式化时在两种格式中选定：
+// MAP_POINTERS：
+//  不超过 INODE_BLOCKS 个 block 时全部是直接指针，与只有直接指针时的格式相同；
+//  否则前 DIRECT_BLOCKS 个是直接指针，之后的 POINTERS_PER_BLOCK 个记在一级间接 block 中，
+//  再之后的记在二级间接 block 指向的各个间接 block 中。
+// MAP_EXTENTS：
+//  block 按顺序分成若干段连续的 block（extent），不超过 INLINE_EXTENTS 段时直接存放在 block_point 中，
+//  未用的 extent 全部为 0；
+//  否则 block_point[0] 为 0，block_point[1] 为段数，各段依次记在 EXTENT_BLOCKS 个 extent block
+//  和 block_point[EXTENT_INDEX_BLOCK] 指向的间接 block 所指向的 extent block 中。
+// 两种格式中的间接 block 和 extent block 统称为间接 block，经过 block 缓存读写，
+// 连续访问同一个间接 block 时只从缓存取一次。
+// 调用者对 inode 加锁，读取时共享，修改时独占。
+
+#define MAP_POINTERS 0
+#define MAP_EXTENTS 1
+
+// 一段连续的 block
+typedef struct extent {
+    uint32_t start;
+    uint32_t count;
+} extent;
+
+#define INLINE_EXTENTS (INODE_BLOCKS / 2)
+#define EXTENTS_PER_BLOCK(block_size) ((block_size) / sizeof(extent))
+#define EXTENT_BLOCKS 3                 // block_point[2] 到 block_point[4]
+#define EXTENT_INDEX_BLOCK 5
+#define EXTENT_MAX(block_size) ((EXTENT_BLOCKS + POINTERS_PER_BLOCK(block_size)) * EXTENTS_PER_BLOCK(block_size))
+// 一个 inode 至多有的间接 block 数，两种格式中较大的一个
+#define BMAP_MAX_INDEX_BLOCKS(block_size) (EXTENT_BLOCKS + POINTERS_PER_BLOCK(block_size) + 1)
+
+// 一个磁盘文件上的 block 映射
+typedef struct block_mapping {
+    block_cache *cache;
+    // 间接 block 的大小即缓存的 block 大小
+    int format;
+    // MAP_POINTERS 或 MAP_EXTENTS
+} block_mapping;
+
+// 第 index 个 block 的 block 号
+uint32_t bmap_lookup(const block_mapping *map, const inode *node, uint32_t index);
+// 从第 index 个开始的 count 个 block 号写入 ids
+void bmap_range(const block_mapping *map, const inode *node, uint32_t index, uint32_t count, uint32_t *ids);
+// 在末尾接上 ids 中的 count 个 block 时需要新增的间接 block 数，extent 超过 EXTENT_MAX 段时返回 -1
+int bmap_index_blocks(const block_mapping *map, const inode *node, const uint32_t *ids, uint32_t count);
+// 在末尾接上 ids 中的 count 个 block
+// index_ids 是新增的间接 block，共 bmap_index_blocks 个，由这里初始化
+void bmap_append(const block_mapping *map, inode *node, const uint32_t *ids, uint32_t count, const uint32_t *index_ids);
+// 截短到 blocks 个 block，不再使用的 block 和间接 block 写入 freed，返回个数
+// 一次截去不超过 128 个 block（1KB 的 extent block 中的段数）时，其中至多有 3 个间接 block
+uint32_t bmap_truncate(const block_mapping *map, inode *node, uint32_t blocks, uint32_t *freed);
+
+#endif //EXT2_EMULATOR_BMAP_H
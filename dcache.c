@@ -0,0 +1,192 @@
+#include "dcache.h"
+#include <sched.h>
+
+#define HASH_SIZE DCACHE_HASH_SIZE
+
+static uint32_t next_reader = 0;            // 分配给下一个新线程的读者槽
+static __thread int reader_index = -1;      // 本线程使用的读者槽
+
+// FNV-1a
+static uint32_t hash(int32_t parent_id, const char *name) {
+    uint32_t h = 2166136261u ^ (uint32_t) parent_id;
+    while (*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619u;
+    }
+    return h % HASH_SIZE;
+}
+
+static dentry *load(dentry **p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+// 发布目录项，之前对它的写入对读到这个指针的查找可见
+static void publish(dentry **p, dentry *d) {
+    __atomic_store_n(p, d, __ATOMIC_RELEASE);
+}
+
+static dcache_reader *current_reader(dcache *cache) {
+    if (reader_index == -1) {
+        reader_index = __atomic_fetch_add(&next_reader, 1, __ATOMIC_RELAXED) % DCACHE_READERS;
+    }
+    return &cache->readers[reader_index];
+}
+
+// 开始一次查找，返回计数所用的奇偶
+// 先计数再确认宽限期没有在此期间切换，否则等待宽限期的写者可能已经错过了这次计数
+static uint32_t read_lock(dcache *cache, dcache_reader *reader) {
+    while (1) {
+        uint32_t parity = __atomic_load_n(&cache->epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_fetch_add(&reader->count[parity], 1, __ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(&cache->epoch, __ATOMIC_SEQ_CST) & 1) == parity) {
+            return parity;
+        }
+        __atomic_fetch_sub(&reader->count[parity], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void read_unlock(dcache_reader *reader, uint32_t parity) {
+    __atomic_fetch_sub(&reader->count[parity], 1, __ATOMIC_RELEASE);
+}
+
+// 等待一个宽限期：切换奇偶，等按旧奇偶计数的查找全部结束，调用者持有 lock
+static void synchronize(dcache *cache) {
+    uint32_t parity = __atomic_fetch_add(&cache->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    for (int i = 0; i < DCACHE_READERS; i++) {
+        while (__atomic_load_n(&cache->readers[i].count[parity], __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+// 释放所有等待释放的目录项
+static void reclaim(dcache *cache) {
+    synchronize(cache);
+    while (cache->retired != NULL) {
+        dentry *next = cache->retired->retired_next;
+        free(cache->retired);
+        cache->retired = next;
+    }
+    cache->retired_count = 0;
+}
+
+static void retire(dcache *cache, dentry *d) {
+    d->retired_next = cache->retired;
+    cache->retired = d;
+    cache->retired_count++;
+}
+
+static dentry *find(dcache *cache, int32_t parent_id, const char *name) {
+    for (dentry *d = load(&cache->hash_head[hash(parent_id, name)]); d != NULL; d = load(&d->next)) {
+        if (d->parent_id == parent_id && strcmp(d->name, name) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// 哈希链表中指向 d 的指针
+static dentry **link_of(dcache *cache, dentry *d) {
+    dentry **p = &cache->hash_head[hash(d->parent_id, d->name)];
+    while (*p != d) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+// 用 CLOCK 算法选出一个可替换的位置，已失效的优先，原来的目录项移出哈希表并等待释放
+static int32_t evict(dcache *cache) {
+    while (1) {
+        int32_t i = cache->clock_hand;
+        cache->clock_hand = (cache->clock_hand + 1) % DCACHE_SIZE;
+        dentry *d = cache->dentries[i];
+        if (d == NULL) {
+            return i;
+        }
+        if (__atomic_load_n(&d->referenced, __ATOMIC_RELAXED)
+            && d->generation == __atomic_load_n(&cache->generation[d->parent_id], __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&d->referenced, 0, __ATOMIC_RELAXED);      // 给第二次机会
+            continue;
+        }
+        publish(link_of(cache, d), d->next);
+        cache->dentries[i] = NULL;
+        retire(cache, d);
+        return i;
+    }
+}
+
+void dcache_init(dcache *cache, uint32_t inode_count) {
+    for (int i = 0; i < HASH_SIZE; i++) {
+        cache->hash_head[i] = NULL;
+    }
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        cache->dentries[i] = NULL;
+    }
+    cache->generation = calloc(inode_count, sizeof(uint32_t));
+    memset(cache->readers, 0, sizeof(cache->readers));
+    cache->clock_hand = 0;
+    cache->retired = NULL;
+    cache->retired_count = 0;
+    cache->epoch = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+void dcache_destroy(dcache *cache) {
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        free(cache->dentries[i]);
+    }
+    reclaim(cache);
+    free(cache->generation);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+int dcache_lookup(dcache *cache, int32_t parent_id, const char *name, int32_t *inode_id, int *block, int *slot) {
+    dcache_reader *reader = current_reader(cache);
+    uint32_t parity = read_lock(cache, reader);
+    dentry *d = find(cache, parent_id, name);
+    int hit = d != NULL && d->generation == __atomic_load_n(&cache->generation[parent_id], __ATOMIC_ACQUIRE);
+    if (hit) {
+        if (!__atomic_load_n(&d->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&d->referenced, 1, __ATOMIC_RELAXED);
+        }
+        *inode_id = d->inode_id;
+        *block = d->block;
+        *slot = d->slot;
+    }
+    read_unlock(reader, parity);
+    return hit;
+}
+
+void dcache_insert(dcache *cache, int32_t parent_id, const char *name, int32_t inode_id, int block, int slot) {
+    dentry *d = malloc(sizeof(dentry));
+    d->parent_id = parent_id;
+    d->inode_id = inode_id;
+    d->block = block;
+    d->slot = slot;
+    d->generation = __atomic_load_n(&cache->generation[parent_id], __ATOMIC_ACQUIRE);
+    d->referenced = 1;
+    strcpy(d->name, name);
+
+    pthread_mutex_lock(&cache->lock);
+    dentry *old = find(cache, parent_id, name);
+    if (old != NULL) {
+        // 在原位置替换
+        d->index = old->index;
+        d->next = old->next;
+        publish(link_of(cache, old), d);
+        retire(cache, old);
+    } else {
+        d->index = evict(cache);
+        d->next = cache->hash_head[hash(parent_id, name)];
+        publish(&cache->hash_head[hash(parent_id, name)], d);
+    }
+    cache->dentries[d->index] = d;
+    if (cache->retired_count >= DCACHE_RETIRE_BATCH) {
+        reclaim(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void dcache_invalidate_dir(dcache *cache, int32_t parent_id) {
+    __atomic_fetch_add(&cache->generation[parent_id], 1, __ATOMIC_RELEASE);
+}
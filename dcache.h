@@ -0,0 +1,77 @@
+#ifndef EXT2_EMULATOR_DCACHE_H
+#define EXT2_EMULATOR_DCACHE_H
+
+#include "fs_operation.h"
+#include <pthread.h>
+
+#define DCACHE_SIZE 2048
+// 缓存的目录项数量
+#define DCACHE_HASH_SIZE 1024
+#define DCACHE_READERS 64
+// 读者计数分散到的槽数，每个线程固定使用其中一个，避免所有读者争用同一个 cache line
+#define DCACHE_RETIRE_BATCH 256
+// 被替换的目录项攒够这么多后等待一个宽限期，一起释放
+
+// 查找不加锁（类似 RCU）：目录项发布后不再修改，修改时复制一个新的替换旧的，
+// 旧的目录项等所有可能还在读它的查找结束（宽限期）后才释放
+typedef struct dentry {
+    int32_t parent_id;
+    // 所在目录的 inode_id
+    int32_t inode_id;
+    // -1 表示目录中不存在该文件（negative entry）
+    int32_t block;
+    // 目录项位于目录的第几个 block
+    int32_t slot;
+    // 目录项位于 block 中的第几项
+    uint32_t generation;
+    // 插入时所在目录的版本，与 dcache 中记录的不一致时失效
+    uint8_t referenced;
+    // CLOCK 置换算法的访问位，查找时原子地置位，是发布后唯一会修改的字段
+    int32_t index;
+    // 在 dentries 中的位置
+    struct dentry *next;
+    // 哈希链表中的下一个目录项，NULL 表示末尾；移出链表后仍保持不变，正在遍历的查找可以继续走下去
+    struct dentry *retired_next;
+    // 等待释放的链表
+    char name[121];
+} dentry;
+
+typedef struct dcache_reader {
+    uint32_t count[2];
+    // 按宽限期的奇偶分别计数的正在查找的线程数
+    char pad[56];
+    // 独占一个 cache line
+} dcache_reader;
+
+typedef struct dcache {
+    dentry *dentries[DCACHE_SIZE];
+    // 所有缓存的目录项，NULL 表示空闲
+    dentry *hash_head[DCACHE_HASH_SIZE];
+    // 每个桶的第一个目录项
+    uint32_t *generation;
+    // 每个目录的版本，inode 释放时加一，每个 inode 一项
+    uint32_t clock_hand;
+    // CLOCK 指针
+    pthread_mutex_t lock;
+    // 插入和替换目录项时加锁，查找不加锁
+    dentry *retired;
+    uint32_t retired_count;
+    // 已移出哈希表、等待释放的目录项
+    uint32_t epoch;
+    // 宽限期的序号，查找开始时按它的奇偶计数
+    dcache_reader readers[DCACHE_READERS];
+} dcache;
+
+// inode_count 为文件系统的 inode 数
+void dcache_init(dcache *cache, uint32_t inode_count);
+// 释放所有目录项，此时不能再有查找
+void dcache_destroy(dcache *cache);
+// 查找目录 parent_id 下名为 name 的文件，命中返回 1 并写入 inode_id（可能为 -1）和目录项的位置，未命中返回 0
+// 不加锁，可以与其他查找和插入并行
+int dcache_lookup(dcache *cache, int32_t parent_id, const char *name, int32_t *inode_id, int *block, int *slot);
+// 记录目录 parent_id 下名为 name 的文件的 inode_id 和目录项的位置，inode_id 为 -1 表示不存在
+void dcache_insert(dcache *cache, int32_t parent_id, const char *name, int32_t inode_id, int block, int slot);
+// inode 被释放，以它为父目录的所有目录项失效
+void dcache_invalidate_dir(dcache *cache, int32_t parent_id);
+
+#endif //EXT2_EMULATOR_DCACHE_H
@@ -0,0 +1,308 @@
+#include "dir_block.h"
+
+#define RECORD(block, pos) ((dir_record *) ((uint8_t *) (block) + (pos)))
+
+// 位于 pos 的变长目录项是否完整地在 block 中，名字以 '\0' 结尾且中间没有 '\0'
+static int valid_record(const void *block, uint32_t block_size, int pos) {
+    if (pos + sizeof(dir_record) > block_size) {
+        return 0;
+    }
+    const dir_record *record = RECORD(block, pos);
+    if (record->rec_len % 4 != 0 || record->rec_len < DIR_RECORD_LEN(record->name_len)
+        || (uint32_t) pos + record->rec_len > block_size || record->name_len > 120) {
+        return 0;
+    }
+    if (record->name_len == 0) {    // 空闲项，名字已无意义
+        return 1;
+    }
+    return record->name[record->name_len] == '\0' && memchr(record->name, '\0', record->name_len) == NULL;
+}
+
+// 填写一个变长目录项，rec_len 不变，名字之后到需要的长度为止补 0
+static void set_record(dir_record *record, const char *name, int32_t inode_id, uint8_t type) {
+    size_t length = strlen(name);
+    record->inode_id = inode_id;
+    record->name_len = length;
+    record->type = type;
+    memcpy(record->name, name, length);
+    memset(record->name + length, 0, DIR_RECORD_LEN(length) - sizeof(dir_record) - length);
+}
+
+// 填写一个定长目录项
+static void set_item(dir_item *item, const char *name, int32_t inode_id, uint16_t item_count, uint8_t type) {
+    memset(item, 0, sizeof(dir_item));
+    item->inode_id = inode_id;
+    item->item_count = item_count;
+    item->type = type;
+    strcpy(item->name, name);
+}
+
+// DIR_ITEMS 的 block 中到最后一项为止未删除的目录项数
+static int count_items(const dir_item *items, int per_block) {
+    int live = 0;
+    for (int j = 0; j < per_block; j++) {
+        if (items[j].item_count != 2) {
+            live++;
+        }
+        if (items[j].item_count == 1) {
+            break;
+        }
+    }
+    return live;
+}
+
+// DIR_RECORDS 的 block 中的目录项数
+static int count_records(const void *block, uint32_t block_size) {
+    int live = 0, pos = 0;
+    dir_entry entry;
+    while (dir_block_next(DIR_RECORDS, block, block_size, &pos, &entry) == 1) {
+        live++;
+    }
+    return live;
+}
+
+int dir_block_next(int format, const void *block, uint32_t block_size, int *pos, dir_entry *entry) {
+    if (format == DIR_ITEMS) {
+        const dir_item *items = block;
+        int per_block = DIR_ITEMS_PER_BLOCK(block_size);
+        if (*pos < 0) {
+            return -1;
+        }
+        while (*pos < per_block) {
+            int j = (*pos)++;
+            if (items[j].item_count >= 2) {     // 已删除或损坏
+                continue;
+            }
+            if (items[j].item_count == 1) {     // 最后一项，下次返回 -1
+                *pos = -1;
+            }
+            entry->inode_id = items[j].inode_id;
+            entry->type = items[j].type;
+            entry->slot = j;
+            entry->name = items[j].name;
+            return 1;
+        }
+        return 0;
+    }
+
+    while (*pos < (int) block_size) {
+        if (!valid_record(block, block_size, *pos)) {   // 损坏，跳过 block 的其余部分
+            *pos = block_size;
+            return 0;
+        }
+        const dir_record *record = RECORD(block, *pos);
+        int slot = *pos;
+        *pos += record->rec_len;
+        if (record->name_len == 0) {    // 空闲
+            continue;
+        }
+        entry->inode_id = record->inode_id;
+        entry->type = record->type;
+        entry->slot = slot;
+        entry->name = record->name;
+        return 1;
+    }
+    return 0;
+}
+
+int dir_block_check(int format, const void *block, uint32_t block_size) {
+    if (format == DIR_ITEMS) {
+        const dir_item *items = block;
+        int per_block = DIR_ITEMS_PER_BLOCK(block_size);
+        for (int j = 0; j < per_block && items[j].item_count != 1; j++) {
+            if (items[j].item_count > 2) {
+                return j;
+            }
+        }
+        return -1;
+    }
+
+    for (int pos = 0; pos < (int) block_size; pos += RECORD(block, pos)->rec_len) {
+        if (!valid_record(block, block_size, pos)) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+int dir_block_insert(int format, void *block, uint32_t block_size, const char *name, int32_t inode_id, uint8_t type) {
+    if (format == DIR_ITEMS) {
+        dir_item *items = block;
+        int per_block = DIR_ITEMS_PER_BLOCK(block_size);
+        for (int j = 0; j < per_block; j++) {
+            if (items[j].item_count == 2) {     // 已删除的位置
+                set_item(&items[j], name, inode_id, 0, type);
+                return j;
+            }
+            if (items[j].item_count == 1) {     // 最后一项，之后还有位置时追加
+                if (j == per_block - 1) {
+                    return -1;
+                }
+                items[j].item_count = 0;
+                set_item(&items[j + 1], name, inode_id, 1, type);
+                return j + 1;
+            }
+        }
+        return -1;
+    }
+
+    // 使用足够大的空闲项，或拆分多出的部分足够大的目录项
+    int need = DIR_RECORD_LEN(strlen(name));
+    for (int pos = 0; pos < (int) block_size; pos += RECORD(block, pos)->rec_len) {
+        if (!valid_record(block, block_size, pos)) {
+            return -1;
+        }
+        dir_record *record = RECORD(block, pos);
+        if (record->name_len == 0) {
+            if (record->rec_len >= need) {
+                set_record(record, name, inode_id, type);
+                return pos;
+            }
+            continue;
+        }
+        int used = DIR_RECORD_LEN(record->name_len);
+        if (record->rec_len - used >= need) {
+            dir_record *next = RECORD(block, pos + used);
+            next->rec_len = record->rec_len - used;
+            record->rec_len = used;
+            set_record(next, name, inode_id, type);
+            return pos + used;
+        }
+    }
+    return -1;
+}
+
+int dir_block_remove(int format, void *block, uint32_t block_size, int slot) {
+    if (format == DIR_ITEMS) {
+        dir_item *items = block;
+        int per_block = DIR_ITEMS_PER_BLOCK(block_size);
+        if (items[slot].item_count == 1) {
+            // 最后一项，末尾前移到上一个未删除的目录项
+            int j = slot - 1;
+            while (j >= 0 && items[j].item_count == 2) {
+                j--;
+            }
+            if (j < 0) {
+                return 0;
+            }
+            items[j].item_count = 1;
+        }
+        items[slot].item_count = 2;
+        return count_items(items, per_block);
+    }
+
+    // 并入前一项，是 block 的第一项时标记为空闲
+    int prev = -1, pos = 0;
+    while (pos < slot && valid_record(block, block_size, pos)) {
+        prev = pos;
+        pos += RECORD(block, pos)->rec_len;
+    }
+    if (pos == slot) {
+        if (prev == -1) {
+            RECORD(block, slot)->name_len = 0;
+        } else {
+            RECORD(block, prev)->rec_len += RECORD(block, slot)->rec_len;
+        }
+    }
+    return count_records(block, block_size);
+}
+
+int dir_block_continue(int format, void *block, uint32_t block_size) {
+    if (format == DIR_ITEMS) {
+        dir_item *items = block;
+        int per_block = DIR_ITEMS_PER_BLOCK(block_size);
+        for (int j = 0; j < per_block; j++) {
+            if (items[j].item_count == 1) {
+                items[j].item_count = 0;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int dir_block_end(int format, void *block, uint32_t block_size) {
+    if (format == DIR_ITEMS) {
+        dir_item *items = block;
+        for (int j = DIR_ITEMS_PER_BLOCK(block_size) - 1; j >= 0; j--) {
+            if (items[j].item_count != 2) {
+                items[j].item_count = 1;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return count_records(block, block_size) > 0;
+}
+
+int dir_block_place(int format, uint32_t block_size, int *block, int *used, const char *name) {
+    int need = format == DIR_ITEMS ? 1 : (int) DIR_RECORD_LEN(strlen(name));
+    int capacity = format == DIR_ITEMS ? (int) DIR_ITEMS_PER_BLOCK(block_size) : (int) block_size;
+    if (*used + need > capacity) {
+        (*block)++;
+        *used = 0;
+    }
+    int slot = *used;
+    *used += need;
+    return slot;
+}
+
+void dir_block_pack(int format, void *block, uint32_t block_size, const dir_entry *entries, int count, int last) {
+    memset(block, 0, block_size);
+    if (format == DIR_ITEMS) {
+        // 最后一个 block 之外，空出的位置标记为已删除
+        dir_item *items = block;
+        int per_block = DIR_ITEMS_PER_BLOCK(block_size);
+        for (int j = 0; j < per_block; j++) {
+            if (j < count) {
+                set_item(&items[j], entries[j].name, entries[j].inode_id, last && j == count - 1, entries[j].type);
+            } else if (!last) {
+                items[j].item_count = 2;
+            }
+        }
+        return;
+    }
+
+    // 最后一项延伸到 block 末尾，没有目录项时整个 block 是一个空闲项
+    int pos = 0;
+    dir_record *record = RECORD(block, 0);
+    for (int k = 0; k < count; k++) {
+        record = RECORD(block, pos);
+        set_record(record, entries[k].name, entries[k].inode_id, entries[k].type);
+        record->rec_len = DIR_RECORD_LEN(record->name_len);
+        pos += record->rec_len;
+    }
+    record->rec_len += block_size - pos;
+}
+
+int dir_block_usage(int format, const void *block, uint32_t block_size, int *used, int *live) {
+    if (format == DIR_ITEMS) {
+        const dir_item *items = block;
+        int per_block = DIR_ITEMS_PER_BLOCK(block_size);
+        for (int j = 0; j < per_block; j++) {
+            (*used)++;
+            if (items[j].item_count != 2) {
+                (*live)++;
+            }
+            if (items[j].item_count == 1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    int pos = 0;
+    dir_entry entry;
+    *used += block_size;
+    while (dir_block_next(DIR_RECORDS, block, block_size, &pos, &entry) == 1) {
+        *live += DIR_RECORD_LEN(strlen(entry.name));
+    }
+    return 0;
+}
+
+int dir_block_slack(int format, uint32_t block_size, int used, int live) {
+    if (format == DIR_ITEMS) {
+        return used - live;
+    }
+    return (used - live) / block_size * block_size;
+}
@@ -0,0 +1,74 @@
+#ifndef EXT2_EMULATOR_DIR_BLOCK_H
+#define EXT2_EMULATOR_DIR_BLOCK_H
+
+#include "fs_operation.h"
+
+// 目录的 block 中目录项的排列方式，格式化时选定，记在超级块的 dir_format 中：
+// DIR_ITEMS：
+//  每个目录项是定长 128 字节的 dir_item，item_count 为 2 表示已删除，为 1 表示整个目录的最后一项，
+//  最后一项之后的内容无意义；添加变长目录项之前格式化的磁盘文件使用这种格式。
+// DIR_RECORDS：
+//  与 ext2 相同的变长目录项 dir_record，每个 block 中的目录项首尾相接，正好占满整个 block；
+//  每项的 rec_len 可以大于它需要的长度，多出的部分留给之后加入的目录项，删除的目录项并入前一项；
+//  目录到最后一个 block 为止。
+// 目录项在 block 中的位置称为 slot，DIR_ITEMS 为第几项，DIR_RECORDS 为字节偏移，加入和删除其他目录项时不变。
+// 以下函数只处理一个 block，block 的读写和目录的伸缩由调用者完成。
+
+#define DIR_ITEMS 0
+#define DIR_RECORDS 1
+
+// 变长目录项，8 字节的头之后是名字
+typedef struct dir_record {
+    uint32_t inode_id;
+    uint16_t rec_len;
+    // 到下一个目录项的字节数，4 的倍数
+    uint8_t name_len;
+    // 0 表示空闲，只出现在 block 的第一项，根目录的 inode_id 为 0，不能用它表示空闲
+    uint8_t type;
+    char name[];
+    // name_len 个字符，之后是 '\0'
+} dir_record;
+
+#define DIR_RECORD_LEN(name_len) ((sizeof(dir_record) + (name_len) + 1 + 3) & ~(size_t) 3)
+// 名字长为 name_len 的目录项至少占用的字节数，名字不超过 120 字节时至多 132 字节
+#define DIR_BLOCK_MAX_ENTRIES(block_size) ((block_size) / DIR_RECORD_LEN(1))
+// 两种格式中一个 block 至多容纳的目录项数
+
+// 从 block 中读出的一个目录项
+typedef struct dir_entry {
+    int32_t inode_id;
+    uint8_t type;
+    int slot;
+    const char *name;
+    // 指向 block 中的名字
+} dir_entry;
+
+// 读出 block 中从 *pos 开始的下一个目录项，*pos 从 0 开始并随之后移，跳过已删除、空闲和损坏的目录项
+// 返回 1 表示读出了 entry，0 表示这个 block 已读完，-1 表示之前读出的是整个目录的最后一项（只有 DIR_ITEMS）
+int dir_block_next(int format, const void *block, uint32_t block_size, int *pos, dir_entry *entry);
+// 检查 block 中目录项的结构，返回第一个损坏的目录项的 slot，没有损坏时返回 -1
+// DIR_RECORDS 的 block 从损坏处起的内容不再读出
+int dir_block_check(int format, const void *block, uint32_t block_size);
+// 在 block 中加入目录项，返回它的 slot，没有空间时返回 -1
+// DIR_ITEMS 使用已删除的位置，或者追加在最后一项之后
+int dir_block_insert(int format, void *block, uint32_t block_size, const char *name, int32_t inode_id, uint8_t type);
+// 删除 block 中位于 slot 的目录项，返回 block 中剩余的目录项数
+// DIR_ITEMS 删除的是最后一项时，它之前的目录项成为最后一项；返回 0 时调用者应释放这个 block
+int dir_block_remove(int format, void *block, uint32_t block_size, int slot);
+// 目录在这个 block 之后加入了新的 block：DIR_ITEMS 取消其中最后一项的标记，返回 block 是否改变
+int dir_block_continue(int format, void *block, uint32_t block_size);
+// 目录之后的 block 已被释放，这个 block 成为最后一个：DIR_ITEMS 将其中最后一个目录项标记为最后一项
+// 返回 block 中是否还有目录项
+int dir_block_end(int format, void *block, uint32_t block_size);
+// 依次排列目录项：当前在第 *block 个 block，其中已占用 *used，放不下名为 name 的目录项时换到下一个 block
+// 返回目录项的 slot，dir_block_pack 按同样的方式排列
+int dir_block_place(int format, uint32_t block_size, int *block, int *used, const char *name);
+// 将 count 个目录项依次写入 block，替换原来的全部内容，last 为 1 表示它是目录的最后一个 block
+void dir_block_pack(int format, void *block, uint32_t block_size, const dir_entry *entries, int count, int last);
+// 累计 block 的容量 *used 和其中目录项占用的部分 *live，DIR_ITEMS 按项数，DIR_RECORDS 按字节数
+// 返回 -1 表示目录到这个 block 为止，否则返回 0
+int dir_block_usage(int format, const void *block, uint32_t block_size, int *used, int *live);
+// 按 dir_block_usage 累计的结果，整理目录可以回收的空间；DIR_RECORDS 只计整个 block
+int dir_block_slack(int format, uint32_t block_size, int used, int live);
+
+#endif //EXT2_EMULATOR_DIR_BLOCK_H
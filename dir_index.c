@@ -0,0 +1,187 @@
+#include "dir_index.h"
+
+// FNV-1a
+static uint32_t hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// 桶数量翻倍，重新分配所有项
+static void grow_buckets(dir_index *index) {
+    free(index->buckets);
+    index->bucket_count *= 2;
+    index->buckets = malloc(sizeof(int32_t) * index->bucket_count);
+    for (uint32_t i = 0; i < index->bucket_count; i++) {
+        index->buckets[i] = -1;
+    }
+    for (uint32_t i = 0; i < index->used; i++) {
+        index_entry *entry = &index->entries[i];
+        if (entry->inode_id == -1) {    // 已回收
+            continue;
+        }
+        uint32_t b = hash(entry->name) & (index->bucket_count - 1);
+        entry->next = index->buckets[b];
+        index->buckets[b] = i;
+    }
+}
+
+static void insert(dir_index *index, const char *name, int32_t inode_id, int block, int slot) {
+    int32_t i;
+    if (index->free_list != -1) {
+        i = index->free_list;
+        index->free_list = index->entries[i].next;
+    } else {
+        if (index->used == index->capacity) {
+            index->capacity *= 2;
+            index->entries = realloc(index->entries, sizeof(index_entry) * index->capacity);
+        }
+        i = index->used++;
+    }
+    index_entry *entry = &index->entries[i];
+    entry->inode_id = inode_id;
+    entry->block = block;
+    entry->slot = slot;
+    strcpy(entry->name, name);
+
+    uint32_t b = hash(name) & (index->bucket_count - 1);
+    entry->next = index->buckets[b];
+    index->buckets[b] = i;
+    index->live++;
+    if (index->live > index->bucket_count) {
+        grow_buckets(index);
+    }
+}
+
+static index_entry *find(dir_index *index, const char *name) {
+    uint32_t b = hash(name) & (index->bucket_count - 1);
+    for (int32_t i = index->buckets[b]; i != -1; i = index->entries[i].next) {
+        if (strcmp(index->entries[i].name, name) == 0) {
+            return &index->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// 扫描目录的所有 block，建立索引
+static dir_index *build(dir_index_table *table, int32_t dir_id) {
+    inode *dir = &table->inode_table[dir_id];
+    dir_index *index = malloc(sizeof(dir_index));
+    index->bucket_count = 64;
+    index->buckets = malloc(sizeof(int32_t) * index->bucket_count);
+    for (uint32_t i = 0; i < index->bucket_count; i++) {
+        index->buckets[i] = -1;
+    }
+    index->capacity = 64;
+    index->entries = malloc(sizeof(index_entry) * index->capacity);
+    index->used = 0;
+    index->live = 0;
+    index->free_list = -1;
+
+    int end = 0;
+    uint32_t block_size = table->map->cache->block_size;
+    for (int i = 0; i < dir->size && !end; i++) {
+        dir_item *data = block_cache_get(table->map->cache, bmap_lookup(table->map, dir, i), 1);
+        int pos = 0, result;
+        dir_entry entry;
+        while ((result = dir_block_next(table->format, data, block_size, &pos, &entry)) == 1) {
+            // 同名的项只记录第一个，与顺序扫描的结果一致
+            if (find(index, entry.name) == NULL) {
+                insert(index, entry.name, entry.inode_id, i, entry.slot);
+            }
+        }
+        end = result == -1;     // 末尾
+        block_cache_put(table->map->cache, data, 0);
+    }
+    return index;
+}
+
+static void free_index(dir_index *index) {
+    free(index->buckets);
+    free(index->entries);
+    free(index);
+}
+
+void dir_index_init(dir_index_table *table, inode *inode_table, uint32_t inode_count, const block_mapping *map) {
+    table->indexes = calloc(inode_count, sizeof(dir_index *));
+    table->inode_count = inode_count;
+    table->inode_table = inode_table;
+    table->map = map;
+}
+
+void dir_index_free(dir_index_table *table) {
+    for (uint32_t i = 0; i < table->inode_count; i++) {
+        dir_index_drop(table, i);
+    }
+    free(table->indexes);
+}
+
+int dir_index_find(dir_index_table *table, int32_t dir_id, const char *name, int32_t *inode_id, int *block, int *slot) {
+    dir_index *index = __atomic_load_n(&table->indexes[dir_id], __ATOMIC_ACQUIRE);
+    if (index == NULL) {
+        if (table->inode_table[dir_id].size < DIR_INDEX_MIN_BLOCKS) {
+            return 0;
+        }
+        // 共享锁下目录不会改变，同时建立的索引内容相同，没能发布的丢弃
+        dir_index *built = build(table, dir_id);
+        if (__atomic_compare_exchange_n(&table->indexes[dir_id], &index, built, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            index = built;
+        } else {
+            free_index(built);
+        }
+    }
+    index_entry *entry = find(index, name);
+    if (entry == NULL) {
+        *inode_id = -1;
+    } else {
+        *inode_id = entry->inode_id;
+        *block = entry->block;
+        *slot = entry->slot;
+    }
+    return 1;
+}
+
+int dir_index_lookup(dir_index_table *table, int32_t dir_id, const char *name, int32_t *inode_id) {
+    int block, slot;
+    return dir_index_find(table, dir_id, name, inode_id, &block, &slot);
+}
+
+void dir_index_add(dir_index_table *table, int32_t dir_id, const char *name, int32_t inode_id, int block, int slot) {
+    dir_index *index = table->indexes[dir_id];
+    if (index != NULL && find(index, name) == NULL) {
+        insert(index, name, inode_id, block, slot);
+    }
+}
+
+void dir_index_remove(dir_index_table *table, int32_t dir_id, const char *name) {
+    dir_index *index = table->indexes[dir_id];
+    if (index == NULL) {
+        return;
+    }
+    uint32_t b = hash(name) & (index->bucket_count - 1);
+    int32_t *p = &index->buckets[b];
+    while (*p != -1) {
+        index_entry *entry = &index->entries[*p];
+        if (strcmp(entry->name, name) == 0) {
+            int32_t i = *p;
+            *p = entry->next;
+            entry->inode_id = -1;       // 放入回收链表
+            entry->next = index->free_list;
+            index->free_list = i;
+            index->live--;
+            break;
+        }
+        p = &entry->next;
+    }
+}
+
+void dir_index_drop(dir_index_table *table, int32_t dir_id) {
+    dir_index *index = table->indexes[dir_id];
+    if (index != NULL) {
+        free_index(index);
+        table->indexes[dir_id] = NULL;
+    }
+}
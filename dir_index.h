@@ -0,0 +1,67 @@
+#ifndef EXT2_EMULATOR_DIR_INDEX_H
+#define EXT2_EMULATOR_DIR_INDEX_H
+
+#include "fs_operation.h"
+#include "bmap.h"
+#include "dir_block.h"
+
+#define DIR_INDEX_MIN_BLOCKS 2
+// 目录占用的 block 数不少于此值时才建立索引，更小的目录直接扫描
+
+typedef struct index_entry {
+    int32_t inode_id;
+    uint32_t block;
+    // 目录项位于目录的第几个 block
+    uint16_t slot;
+    // 目录项在 block 中的位置，见 dir_block.h
+    int32_t next;
+    // 同一个桶中的下一项，-1 表示末尾
+    char name[121];
+} index_entry;
+
+typedef struct dir_index {
+    uint32_t bucket_count;
+    // 2 的幂
+    int32_t *buckets;
+    index_entry *entries;
+    uint32_t used;
+    // entries 中已使用的项数，包括已回收的
+    uint32_t capacity;
+    uint32_t live;
+    // 有效的项数
+    int32_t free_list;
+    // 已回收的项，通过 next 链接
+} dir_index;
+
+typedef struct dir_index_table {
+    dir_index **indexes;
+    // 每个目录的索引，NULL 表示尚未建立
+    uint32_t inode_count;
+    inode *inode_table;
+    const block_mapping *map;
+    int format;
+    // 建立索引时从这里按目录 block 的格式读取目录，格式在加载或格式化超级块后填入
+} dir_index_table;
+
+// 每个目录的索引由调用者对目录加的锁保护，不同目录的查找互不影响：
+// 查找时对目录加共享锁，加入、删除目录项和丢弃索引时加独占锁；
+// 共享锁下几个线程可能同时为同一目录建立索引，只发布最先建好的一个
+
+// 在 fs_init 加载索引表之后调用，inode_table 中有 inode_count 个 inode
+void dir_index_init(dir_index_table *table, inode *inode_table, uint32_t inode_count, const block_mapping *map);
+// 释放所有索引，在关闭磁盘文件时调用
+void dir_index_free(dir_index_table *table);
+// 在目录 dir_id 的索引中查找 name，必要时先建立索引，调用者对目录至少加了共享锁
+// 使用了索引返回 1，结果写入 inode_id（不存在为 -1）；目录太小不使用索引时返回 0
+int dir_index_lookup(dir_index_table *table, int32_t dir_id, const char *name, int32_t *inode_id);
+// 同上，同时返回目录项所在的位置
+int dir_index_find(dir_index_table *table, int32_t dir_id, const char *name, int32_t *inode_id, int *block, int *slot);
+// 以下调用者对目录 dir_id 加了独占锁，或独占整个文件系统
+// 目录 dir_id 的第 block 个 block 的 slot 处写入了新的目录项
+void dir_index_add(dir_index_table *table, int32_t dir_id, const char *name, int32_t inode_id, int block, int slot);
+// 目录 dir_id 中名为 name 的目录项被删除
+void dir_index_remove(dir_index_table *table, int32_t dir_id, const char *name);
+// 丢弃目录 dir_id 的索引
+void dir_index_drop(dir_index_table *table, int32_t dir_id);
+
+#endif //EXT2_EMULATOR_DIR_INDEX_H
@@ -0,0 +1,128 @@
+#include "disk.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+int disk_open(disk_file *disk, const char *path, int backend) {
+    disk->fp = NULL;
+    disk->fd = -1;
+    disk->map = NULL;
+    if (backend == DISK_MMAP) {
+        struct stat st;
+        disk->fd = open(path, O_RDWR);
+        if (disk->fd == -1) {
+            return -1;
+        }
+        if (flock(disk->fd, LOCK_EX | LOCK_NB) == -1) {
+            close(disk->fd);
+            return -2;
+        }
+        if (fstat(disk->fd, &st) == -1 || st.st_size == 0) {
+            close(disk->fd);
+            return -1;
+        }
+        disk->map_size = st.st_size;
+        void *addr = mmap(NULL, disk->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+        if (addr == MAP_FAILED) {
+            close(disk->fd);
+            return -1;
+        }
+        disk->map = addr;
+        return 0;
+    }
+
+    disk->fp = fopen(path, "r+b");    // 以读写二进制文件方式打开
+    if (disk->fp == NULL) {
+        return -1;
+    }
+    // 同一个磁盘文件同时只能被打开一次
+    if (flock(fileno(disk->fp), LOCK_EX | LOCK_NB) == -1) {
+        fclose(disk->fp);
+        disk->fp = NULL;
+        return -2;
+    }
+    return 0;
+}
+
+int disk_create(const char *path, uint32_t size) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    // 不改变正在使用的磁盘文件
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        close(fd);
+        return -2;
+    }
+    int result = ftruncate(fd, size) == -1 ? -1 : 0;
+    close(fd);
+    return result;
+}
+
+void *disk_map(disk_file *disk, uint32_t offset) {
+    return disk->map == NULL ? NULL : disk->map + offset;
+}
+
+void disk_read(disk_file *disk, uint32_t offset, void *buf, size_t len) {
+    if (disk->map != NULL) {
+        if (buf != disk->map + offset) {
+            memcpy(buf, disk->map + offset, len);
+        }
+        return;
+    }
+    // seek 和读写须成对执行，多个线程共用同一个 FILE
+    flockfile(disk->fp);
+    fseek(disk->fp, offset, SEEK_SET);
+    fread(buf, len, 1, disk->fp);
+    funlockfile(disk->fp);
+}
+
+void disk_write(disk_file *disk, uint32_t offset, const void *buf, size_t len) {
+    if (disk->map != NULL) {
+        // 原地修改的结构（超级块、索引表）已在映射中，无需复制
+        if (buf != disk->map + offset) {
+            memmove(disk->map + offset, buf, len);
+        }
+        return;
+    }
+    flockfile(disk->fp);
+    fseek(disk->fp, offset, SEEK_SET);
+    fwrite(buf, len, 1, disk->fp);
+    funlockfile(disk->fp);
+}
+
+void disk_prefetch(disk_file *disk, uint32_t offset, size_t len) {
+    if (disk->map == NULL) {
+        return;
+    }
+    // madvise 要求起始地址按页对齐
+    long page = sysconf(_SC_PAGESIZE);
+    uint32_t start = offset / page * page;
+    madvise(disk->map + start, offset + len - start, MADV_WILLNEED);
+}
+
+void disk_sync(disk_file *disk) {
+    if (disk->map != NULL) {
+        msync(disk->map, disk->map_size, MS_SYNC);
+    } else {
+        fflush(disk->fp);
+        fsync(fileno(disk->fp));      // 写入设备，日志的提交依赖于此
+    }
+}
+
+void disk_close(disk_file *disk) {
+    disk_sync(disk);
+    if (disk->map != NULL) {
+        munmap(disk->map, disk->map_size);
+        close(disk->fd);
+        disk->map = NULL;
+        disk->fd = -1;
+    } else {
+        fclose(disk->fp);
+        disk->fp = NULL;
+    }
+}
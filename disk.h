@@ -0,0 +1,38 @@
+#ifndef EXT2_EMULATOR_DISK_H
+#define EXT2_EMULATOR_DISK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// 磁盘文件的访问方式
+#define DISK_STDIO 0
+// fseek + fread/fwrite
+#define DISK_MMAP 1
+// 将整个磁盘文件映射到内存，原地读写
+
+typedef struct disk_file {
+    FILE *fp;
+    // stdio 方式下的磁盘文件
+    int fd;
+    // mmap 方式下的文件描述符
+    uint8_t *map;
+    // mmap 方式下的映射起始地址，stdio 方式下为 NULL
+    size_t map_size;
+} disk_file;
+
+// 打开磁盘文件并加锁，失败返回 -1，已被其他上下文或进程打开返回 -2
+int disk_open(disk_file *disk, const char *path, int backend);
+// 创建磁盘文件或改变它的大小为 size 字节，返回值同 disk_open
+int disk_create(const char *path, uint32_t size);
+// mmap 方式下返回 offset 处的映射地址，stdio 方式下返回 NULL
+void *disk_map(disk_file *disk, uint32_t offset);
+void disk_read(disk_file *disk, uint32_t offset, void *buf, size_t len);
+void disk_write(disk_file *disk, uint32_t offset, const void *buf, size_t len);
+// 提示即将读取 offset 开始的 len 字节，mmap 方式下预先调入内存，stdio 方式下由 block 缓存预读
+void disk_prefetch(disk_file *disk, uint32_t offset, size_t len);
+// 将修改落盘：stdio 方式 fflush + fsync，mmap 方式 msync
+void disk_sync(disk_file *disk);
+void disk_close(disk_file *disk);
+
+#endif //EXT2_EMULATOR_DISK_H
@@ -0,0 +1,276 @@
+#include "ext2emu.h"
+#include "fs_context.h"
+#include "fsck.h"
+
+// 每个打开的磁盘文件有独立的上下文，可以同时打开多个
+int ext2emu_open(const char *path, int flags, ext2emu **fs) {
+    ext2emu *context = calloc(1, sizeof(ext2emu));
+    if (context == NULL) {
+        return EXT2EMU_ENOSPC;
+    }
+    int backend = (flags & EXT2EMU_MMAP) ? DISK_MMAP : DISK_STDIO;
+    int error = fs_init(context, path, backend, (flags & EXT2EMU_FORMAT) != 0, (flags & EXT2EMU_EXTENTS) != 0, NULL);
+    if (error != EXT2EMU_OK) {
+        free(context);
+        return error;
+    }
+    *fs = context;
+    return EXT2EMU_OK;
+}
+
+// 先检查几何参数，再按文件系统的大小创建磁盘文件并格式化
+int ext2emu_mkfs(const char *path, const ext2emu_geometry *geometry, int flags) {
+    sp_block super;
+    if (fs_plan_geometry(geometry, &super) != EXT2EMU_OK) {
+        return EXT2EMU_EINVAL;
+    }
+    int created = disk_create(path, super.block_count * super.block_size);
+    if (created != 0) {
+        return created == -2 ? EXT2EMU_EBUSY : EXT2EMU_EIO;
+    }
+    ext2emu *context = calloc(1, sizeof(ext2emu));
+    if (context == NULL) {
+        return EXT2EMU_ENOSPC;
+    }
+    int backend = (flags & EXT2EMU_MMAP) ? DISK_MMAP : DISK_STDIO;
+    int error = fs_init(context, path, backend, 1, (flags & EXT2EMU_EXTENTS) != 0, geometry);
+    if (error == EXT2EMU_OK) {
+        fs_shutdown(context);
+    }
+    free(context);
+    return error;
+}
+
+int ext2emu_formatted(const ext2emu *fs) {
+    return fs->formatted;
+}
+
+int ext2emu_close(ext2emu *fs) {
+    fs_shutdown(fs);
+    free(fs);
+    return EXT2EMU_OK;
+}
+
+int ext2emu_sync(ext2emu *fs) {
+    pthread_rwlock_wrlock(&fs->ns_lock);
+    fs_checkpoint(fs);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return EXT2EMU_OK;
+}
+
+void ext2emu_set_sync_policy(ext2emu *fs, int policy) {
+    fs_set_sync_policy(fs, policy);
+}
+
+void ext2emu_set_alloc_mode(ext2emu *fs, int mode) {
+    fs_set_alloc_mode(fs, mode);
+}
+
+void ext2emu_set_compact_threshold(ext2emu *fs, int percent) {
+    fs_set_compact_threshold(fs, percent);
+}
+
+// 只读的操作共享 ns_lock，可以与其他命令并行
+// 查找先只用 dcache，路径都在 dcache 中时不加任何锁
+int ext2emu_lookup(ext2emu *fs, const char *path, ext2emu_stat *st) {
+    if (fs_lookup_cached(fs, path, st)) {
+        return EXT2EMU_OK;
+    }
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int error = fs_lookup_path(fs, path, st);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return error;
+}
+
+int ext2emu_readdir(ext2emu *fs, const char *path, ext2emu_filldir filldir, void *arg) {
+    ext2emu_dirent *entries;
+    int count;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int error = fs_read_dir(fs, path, &entries, &count);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    if (error != EXT2EMU_OK) {
+        return error;
+    }
+    // 解锁后再回调，回调中可以继续调用其他操作
+    for (int i = 0; i < count; i++) {
+        if (filldir(arg, &entries[i]) != 0) {
+            break;
+        }
+    }
+    free(entries);
+    return EXT2EMU_OK;
+}
+
+int ext2emu_read(ext2emu *fs, const char *path, uint32_t offset, void *buf, uint32_t len) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int result = fs_read_file(fs, path, offset, buf, len);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return result;
+}
+
+int ext2emu_statfs(ext2emu *fs, ext2emu_fsstat *st) {
+    fs_get_statfs(fs, st);
+    return EXT2EMU_OK;
+}
+
+// 一条命令从 offset 开始写入的一段的末尾，这一段不超过 JOURNAL_DATA_BLOCKS 个 block
+static uint32_t chunk_end(ext2emu *fs, uint32_t offset, uint32_t end) {
+    uint32_t limit = (offset / fs->block_size + JOURNAL_DATA_BLOCKS) * fs->block_size;
+    return end < limit ? end : limit;
+}
+
+// 分成若干条命令写入，日志中放得下每条命令的修改，buf 为 NULL 时写入 0
+// 出错时之前的段已经写入
+static int write_chunks(ext2emu *fs, const char *path, uint32_t offset, const void *buf, uint32_t len) {
+    uint32_t pos = offset;
+    while (pos < offset + len) {
+        uint32_t next = chunk_end(fs, pos, offset + len);
+        fs_begin_command(fs, 0);
+        int result = fs_write_file(fs, path, pos, buf == NULL ? NULL : (const char *) buf + (pos - offset), next - pos);
+        fs_end_command(fs);
+        if (result < 0) {
+            return result;
+        }
+        pos = next;
+    }
+    return len;
+}
+
+// 修改文件系统的操作结束后按同步策略写回
+// 较大的文件先创建第一段，其余分段补 0，空间不足时删除创建了一半的文件
+int ext2emu_create(ext2emu *fs, const char *path, int size) {
+    int chunk = JOURNAL_DATA_BLOCKS * fs->block_size;
+    int first = size > chunk && (uint32_t) size <= fs->max_file_size ? chunk : size;
+    fs_begin_command(fs, 0);
+    int error = fs_create_file(fs, path, first);
+    fs_end_command(fs);
+    if (error != EXT2EMU_OK || first == size) {
+        return error;
+    }
+    int result = write_chunks(fs, path, first, NULL, size - first);
+    if (result < 0) {
+        ext2emu_unlink(fs, path);
+        return result;
+    }
+    return EXT2EMU_OK;
+}
+
+int ext2emu_mkdir(ext2emu *fs, const char *path) {
+    fs_begin_command(fs, 0);
+    int error = fs_create_dir(fs, path);
+    fs_end_command(fs);
+    return error;
+}
+
+int ext2emu_unlink(ext2emu *fs, const char *path) {
+    fs_begin_command(fs, 0);
+    int error = fs_delete_file(fs, path);
+    fs_end_command(fs);
+    return error;
+}
+
+// 文件末尾之后的空洞先分段补 0，再分段写入数据
+int ext2emu_write(ext2emu *fs, const char *path, uint32_t offset, const void *buf, uint32_t len) {
+    ext2emu_stat st;
+    if ((uint64_t) offset + len > fs->max_file_size || len == 0 || ext2emu_lookup(fs, path, &st) != EXT2EMU_OK
+        || st.type == 1) {
+        // 出错的情况由 fs_write_file 报告
+        fs_begin_command(fs, 0);
+        int result = fs_write_file(fs, path, offset, buf, len);
+        fs_end_command(fs);
+        return result;
+    }
+    if (st.size < offset) {
+        int result = write_chunks(fs, path, st.size, NULL, offset - st.size);
+        if (result < 0) {
+            return result;
+        }
+    }
+    return write_chunks(fs, path, offset, buf, len);
+}
+
+// 删除整棵子树时独占文件系统
+int ext2emu_rmdir(ext2emu *fs, const char *path) {
+    fs_begin_command(fs, 1);
+    int error = fs_delete_dir(fs, path);
+    fs_end_command(fs);
+    return error;
+}
+
+int ext2emu_rename(ext2emu *fs, const char *from, const char *to_dir) {
+    fs_begin_command(fs, 0);
+    int error = fs_move(fs, from, to_dir);
+    fs_end_command(fs);
+    return error;
+}
+
+// 较大的目录分多条命令整理
+int ext2emu_compact(ext2emu *fs, const char *path) {
+    int result;
+    do {
+        fs_begin_command(fs, 0);
+        result = fs_compact(fs, path);
+        fs_end_command(fs);
+    } while (result > 0);
+    return result;
+}
+
+// 检查期间独占文件系统，先写回内存中的修改，检查磁盘上的内容
+int ext2emu_fsck(ext2emu *fs, int flags, ext2emu_fsck_report report, void *arg, ext2emu_fsckstat *st) {
+    fsck_log log;
+    pthread_rwlock_wrlock(&fs->ns_lock);
+    fs_checkpoint(fs);
+    fsck_check(fs, (flags & EXT2EMU_FSCK_REPAIR) != 0, &log, st);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    // 解锁后再回调
+    const char *message = log.text;
+    for (uint32_t i = 0; i < log.count && report != NULL; i++) {
+        report(arg, message);
+        message += strlen(message) + 1;
+    }
+    fsck_log_free(&log);
+    return EXT2EMU_OK;
+}
+
+const char *ext2emu_strerror(int error) {
+    switch (error) {
+        case EXT2EMU_OK:
+            return "Success";
+        case EXT2EMU_ENOENT:
+            return "No such file or directory";
+        case EXT2EMU_ENODIR:
+            return "No such directory";
+        case EXT2EMU_ENOTDIR:
+            return "Not a directory";
+        case EXT2EMU_EISDIR:
+            return "Is a directory";
+        case EXT2EMU_EISFILE:
+            return "Is a file";
+        case EXT2EMU_EEXIST:
+            return "File exists";
+        case EXT2EMU_ENAMETOOLONG:
+            return "file name cannot be longer than 120 Bytes";
+        case EXT2EMU_ENOSPC:
+            return "No enough space";
+        case EXT2EMU_EDIRFULL:
+            return "No enough space in directory";
+        case EXT2EMU_EFBIG:
+            return "File too large";
+        case EXT2EMU_EDOT:
+            return "refusing to delete \'.\' or \'..\' directory";
+        case EXT2EMU_EROOT:
+            return "refusing to delete \'/\'";
+        case EXT2EMU_EIO:
+            return "Cannot open file";
+        case EXT2EMU_EBUSY:
+            return "Disk file is already in use";
+        case EXT2EMU_EINVAL:
+            return "Invalid file system geometry";
+        default:
+            return "Unknown error";
+    }
+}
+
+int ext2emu_error_path(const char **path) {
+    return fs_get_error_path(path);
+}
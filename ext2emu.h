@@ -0,0 +1,182 @@
+#ifndef EXT2_EMULATOR_EXT2EMU_H
+#define EXT2_EMULATOR_EXT2EMU_H
+
+#include <stdint.h>
+
+// libext2emu: the file system as a library.
+// every function returns EXT2EMU_OK or one of the negative error codes below;
+// paths are absolute, like "/dir/file".
+// an image can be used by several threads at once, except for ext2emu_close and the ext2emu_set_* functions.
+
+typedef struct ext2emu ext2emu;
+// an opened image, see ext2emu_open.
+
+#define EXT2EMU_OK 0
+#define EXT2EMU_ENOENT (-1)
+// the file does not exist.
+#define EXT2EMU_ENODIR (-2)
+// a directory on the path does not exist, or the path is not absolute.
+#define EXT2EMU_ENOTDIR (-3)
+// a directory is needed but the file is not one.
+#define EXT2EMU_EISDIR (-4)
+#define EXT2EMU_EISFILE (-5)
+#define EXT2EMU_EEXIST (-6)
+#define EXT2EMU_ENAMETOOLONG (-7)
+// a name is longer than 120 bytes.
+#define EXT2EMU_ENOSPC (-8)
+// no free inode or block.
+#define EXT2EMU_EDIRFULL (-9)
+// the directory already has as many blocks of entries as a file can have.
+#define EXT2EMU_EFBIG (-10)
+// a file is larger than all the blocks an inode can point to: 67375104 bytes with 1KB blocks,
+// and just under 2GB with 4KB blocks; see max_file_size in ext2emu_fsstat.
+#define EXT2EMU_EDOT (-11)
+// "." and ".." cannot be deleted.
+#define EXT2EMU_EROOT (-12)
+// "/" cannot be deleted.
+#define EXT2EMU_EIO (-13)
+// the image cannot be opened.
+#define EXT2EMU_EBUSY (-14)
+// the image is already open, in this process or another one.
+#define EXT2EMU_EINVAL (-15)
+// the geometry given to ext2emu_mkfs cannot be used.
+
+// flags of ext2emu_open.
+#define EXT2EMU_MMAP 1
+// map the image into memory instead of using stdio.
+// changes are then made in place without the journal, so a crash can leave the image half updated;
+// the journal is still replayed when the image is opened, and used again when it is opened without this flag.
+#define EXT2EMU_FORMAT 2
+// format the image even if it already has a file system.
+#define EXT2EMU_EXTENTS 4
+// when the image is formatted, map the blocks of each file as runs of contiguous blocks (extents)
+// instead of one pointer per block; an existing file system keeps the format it was made with.
+
+// when the super block is written back to the disk;
+// with a journal, how often a group of commands is committed.
+#define SYNC_ALWAYS 0
+// every time it changes; with a journal, after every command.
+#define SYNC_COMMAND 1
+// once at the end of each command; with a journal, every JOURNAL_GROUP_COMMANDS commands.
+#define SYNC_CHECKPOINT 2
+// only by ext2emu_sync() or ext2emu_close(); with a journal, also when it is nearly full.
+
+// how ext2emu_create allocates the blocks of a file.
+#define ALLOC_NEXT_FIT 0
+// one by one, each after the last allocated block.
+#define ALLOC_EXTENT 1
+// as one contiguous run if possible, otherwise as few runs as possible.
+
+#define COMPACT_THRESHOLD 50
+// a directory is compacted once deleted entries reach this percentage of its used slots,
+// or once the free space it could give back in whole blocks does, with variable-length entries; 0 disables it.
+
+typedef struct ext2emu_stat {
+    int32_t inode_id;
+    uint8_t type;
+    // 1 represents dir;
+    uint32_t blocks;
+    uint32_t size;
+    // in bytes; the blocks times the block size for a directory.
+} ext2emu_stat;
+
+typedef struct ext2emu_dirent {
+    int32_t inode_id;
+    uint8_t type;
+    // 1 represents dir;
+    char name[121];
+} ext2emu_dirent;
+
+typedef struct ext2emu_fsstat {
+    uint32_t block_size;
+    uint32_t blocks;
+    uint32_t free_blocks;
+    uint32_t inodes;
+    uint32_t free_inodes;
+    uint32_t dirs;
+    uint32_t files;
+    uint32_t max_file_size;
+    // in bytes.
+    uint32_t groups;
+    // the block groups, 1 for a small image.
+} ext2emu_fsstat;
+
+typedef struct ext2emu_geometry {
+    // the layout of an image made by ext2emu_mkfs, 0 for the default of each field.
+    uint32_t size;
+    // the size of the image in bytes, at most 2GB; 4MB by default.
+    uint32_t block_size;
+    // 1024, 2048 or 4096; 1024 by default.
+    uint32_t inodes;
+    // at most 262144; one for every 4KB of the image by default, up to that.
+    // rounded up to fill the last block of the inode table.
+} ext2emu_geometry;
+
+typedef struct ext2emu_fsckstat {
+    uint32_t problems;
+    // the problems found, one message each.
+    uint32_t repaired;
+    // the problems repaired, 0 unless EXT2EMU_FSCK_REPAIR was given.
+} ext2emu_fsckstat;
+
+// flags of ext2emu_fsck.
+#define EXT2EMU_FSCK_REPAIR 1
+// repair what is found: bad entries are dropped, shared blocks are copied,
+// orphaned inodes and blocks are freed and the bitmaps and counters are rebuilt.
+
+// called for each entry of a directory, in order, with no lock held; return non-zero to stop.
+typedef int (*ext2emu_filldir)(void *arg, const ext2emu_dirent *entry);
+// called for each problem found by ext2emu_fsck, in order, with no lock held.
+typedef void (*ext2emu_fsck_report)(void *arg, const char *message);
+
+// the library is built with hidden visibility, only the functions below are exported.
+#pragma GCC visibility push(default)
+
+// open the image at path, formatting it if it has no file system yet.
+// a new file system made here has the default geometry, 4MB of 1KB blocks and 1024 inodes.
+int ext2emu_open(const char *path, int flags, ext2emu **fs);
+// make a new file system at path with the given geometry, creating the image or changing its size to fit.
+// flags are EXT2EMU_MMAP and EXT2EMU_EXTENTS as for ext2emu_open; the image is closed afterwards.
+int ext2emu_mkfs(const char *path, const ext2emu_geometry *geometry, int flags);
+// 1 if ext2emu_open formatted the image.
+int ext2emu_formatted(const ext2emu *fs);
+// write everything back and close the image.
+int ext2emu_close(ext2emu *fs);
+// write everything in memory back to the disk.
+int ext2emu_sync(ext2emu *fs);
+
+void ext2emu_set_sync_policy(ext2emu *fs, int policy);
+void ext2emu_set_alloc_mode(ext2emu *fs, int mode);
+void ext2emu_set_compact_threshold(ext2emu *fs, int percent);
+
+int ext2emu_lookup(ext2emu *fs, const char *path, ext2emu_stat *st);
+int ext2emu_readdir(ext2emu *fs, const char *path, ext2emu_filldir filldir, void *arg);
+int ext2emu_statfs(ext2emu *fs, ext2emu_fsstat *st);
+// create a file of size bytes, all zero; a large file is filled in several steps that other calls may see.
+int ext2emu_create(ext2emu *fs, const char *path, int size);
+int ext2emu_mkdir(ext2emu *fs, const char *path);
+int ext2emu_unlink(ext2emu *fs, const char *path);
+// read up to len bytes of a file from offset; returns the number of bytes read, 0 at the end of the file, or an error code.
+// reading a file sequentially reads the following blocks ahead.
+int ext2emu_read(ext2emu *fs, const char *path, uint32_t offset, void *buf, uint32_t len);
+// write len bytes into a file at offset, growing it and filling a gap before offset with zeros;
+// returns len or an error code. a large write is done in several steps, each of them on the disk as a whole.
+int ext2emu_write(ext2emu *fs, const char *path, uint32_t offset, const void *buf, uint32_t len);
+// delete a directory and everything in it.
+int ext2emu_rmdir(ext2emu *fs, const char *path);
+// move the file from into the directory to_dir, keeping its name.
+int ext2emu_rename(ext2emu *fs, const char *from, const char *to_dir);
+// pack the entries of a directory and release its empty blocks.
+int ext2emu_compact(ext2emu *fs, const char *path);
+// check the whole image, scanning it with several threads; waits for every other call to finish.
+// report may be NULL.
+int ext2emu_fsck(ext2emu *fs, int flags, ext2emu_fsck_report report, void *arg, ext2emu_fsckstat *st);
+
+const char *ext2emu_strerror(int error);
+// the part of the path arguments the last error of the calling thread is about, for messages.
+// it is kept per thread, not per image: the last failed call of this thread on any image.
+int ext2emu_error_path(const char **path);
+
+#pragma GCC visibility pop
+
+#endif //EXT2_EMULATOR_EXT2EMU_H
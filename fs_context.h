@@ -0,0 +1,102 @@
+#ifndef EXT2_EMULATOR_FS_CONTEXT_H
+#define EXT2_EMULATOR_FS_CONTEXT_H
+
+#include "fs_operation.h"
+#include "disk.h"
+#include "block_cache.h"
+#include "bmap.h"
+#include "dcache.h"
+#include "dir_index.h"
+#include "scratch.h"
+#include "journal.h"
+#include <pthread.h>
+
+// everything about one opened image, so that several images can be open at the same time.
+// locks, always taken in this order:
+//  ns_lock: shared by every command, exclusive for deleting a directory tree and for checkpoints;
+//      it prefers writers, so that a stream of lookups cannot hold off a checkpoint;
+//      directories are never moved and only deleted exclusively, so a resolved directory stays valid while it is held.
+//  inode_locks: one per inode, shared to read the entries of a directory, exclusive to change them;
+//      several are taken in the order of inode_id.
+//      the lock of a file only guards its data and size, and is taken last, after its parent directory's.
+//      resolving a path takes none of them for components found in the dcache, see dcache.h;
+//      fs_lookup_cached takes no lock at all, not even ns_lock.
+//  meta_lock: the super block, the group descriptors, the bitmaps, the dirty flags and the counters below.
+//  scratch_lock, and the locks inside the dcache (writers only) and the block cache;
+//      the index of a directory is guarded by its inode lock, see dir_index.h.
+struct ext2emu {
+    disk_file disk;
+    block_cache cache;
+    block_mapping mapping;
+    // the cache and the inode format of the super block.
+    int dir_format;
+    // the format of the directory blocks in the super block, see dir_block.h.
+    dcache dcache;
+    dir_index_table dir_index;
+    scratch_arena scratch;
+    journal journal;
+
+    pthread_rwlock_t ns_lock;
+    pthread_rwlock_t *inode_locks;
+    // one for each inode.
+    uint32_t *inode_seq;
+    // one for each inode, odd while the size and the tail of a file change together, see fs_lookup_cached.
+    pthread_mutex_t meta_lock;
+    pthread_cond_t command_done;
+    // signalled under meta_lock when a command ends, for the commands waiting for room in the journal.
+    pthread_mutex_t scratch_lock;
+
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t inode_count;
+    // the geometry, see sp_block.
+    uint32_t group_count;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    // a single group of all the blocks and inodes without block groups.
+    uint32_t gdt_blocks;
+    // the blocks of group descriptors, 0 without block groups.
+    uint32_t data_start;
+    // the first data block of group 0; the other groups start with 2 bitmap blocks and their inode table.
+    uint32_t max_file_size;
+    // in bytes, what the inodes can point to, below 2GB.
+
+    uint8_t *meta;
+    // the super block, the descriptors, all block bitmaps, all inode bitmaps and all inode tables, in this order;
+    // without block groups this is blocks 0 to data_start - 1 of the disk, in place in the mapping with DISK_MMAP;
+    // otherwise a malloc'ed copy, written back block by block.
+    uint32_t meta_blocks;
+    uint32_t *meta_location;
+    // the block on the disk of each block of meta.
+    uint32_t inode_table_start;
+    // the first block of the inode tables in meta; the blocks before it are the super block, descriptors and bitmaps.
+    sp_block *spBlock;
+    group_desc *groups;
+    // in meta, or a single malloc'ed one kept in memory only without block groups.
+    uint64_t *block_map;
+    // the block bitmaps end to end, one bit for each block.
+    uint64_t *inode_map;
+    // the inode bitmaps, see fs_inode_bit.
+    inode *inode_table;
+    // inode_count inodes;
+    // point into meta.
+    uint8_t *meta_dirty;
+    // one flag for each block of meta, set when it has changed but is not on the disk yet.
+
+    int sync_policy;
+    uint32_t block_hint;
+    uint32_t inode_hint;
+    // where to start looking for a free block or inode.
+    int alloc_mode;
+    int compact_threshold;
+    int journaling;
+    // 1 if the metadata is written back through the journal.
+    uint32_t group_commands;
+    // the number of commands in the current transaction.
+    uint32_t active_commands;
+    // the number of commands running now, each may still dirty JOURNAL_COMMAND_BLOCKS blocks.
+    int formatted;
+    // 1 if fs_init formatted the image.
+};
+
+#endif //EXT2_EMULATOR_FS_CONTEXT_H
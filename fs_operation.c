@@ -1,1161 +1,2163 @@
-#include "fs_operation.h"
+#define _GNU_SOURCE
+#include "fs_context.h"
+#include "bitmap.h"
+#include "bmap.h"
+#include "dir_block.h"
 #include <math.h>
 
-#define SUPER_BLOCK_SIZE 1024
-#define INODE_NUM 1024
 #define SUPER_BLOCK_START 0
-#define INODE_TABLE_START (SUPER_BLOCK_SIZE)
 
-const char disk[] = "./disk.os";    // 磁盘文件
+// resolve_path 对父目录加锁的方式
+#define LOCK_NONE 0
+#define LOCK_SHARED 1
+#define LOCK_EXCLUSIVE 2
 
-// 从磁盘加载超级块
-void load_super_block() {
-    fseek(fp, SUPER_BLOCK_START, SEEK_SET);
-    fread(spBlock, sizeof(sp_block), 1, fp);
+// grow_inode、shrink_inode 每次最多处理的 block 数，另外最多涉及 3 个间接 block
+#define RESIZE_STEP 61
+
+// 上一个错误涉及的路径，每个线程各自记录
+static __thread const char *error_path = NULL;
+static __thread int error_length = 0;
+
+// 记录错误涉及的路径（path 的前 length 个字符），返回错误码
+static int fail(int error, const char *path, int length) {
+    error_path = path;
+    error_length = length;
+    return error;
+}
+
+int fs_get_error_path(const char **path) {
+    *path = error_path;
+    return error_length;
 }
 
-// 将超级块写入磁盘
-void write_super_block() {
-    fseek(fp, SUPER_BLOCK_START, SEEK_SET);
-    fwrite(spBlock, sizeof(sp_block), 1, fp);
+// 对目录 dir_id 加锁，mode 为 LOCK_SHARED 时只读取目录项
+static void lock_dir(ext2emu *fs, int32_t dir_id, int mode) {
+    if (mode == LOCK_SHARED) {
+        pthread_rwlock_rdlock(&fs->inode_locks[dir_id]);
+    } else if (mode == LOCK_EXCLUSIVE) {
+        pthread_rwlock_wrlock(&fs->inode_locks[dir_id]);
+    }
 }
 
-// 从磁盘加载索引表
-void load_inode_table() {
-    fseek(fp, INODE_TABLE_START, SEEK_SET);
-    fread(inode_table, sizeof(inode), INODE_NUM, fp);
+static void unlock_dir(ext2emu *fs, int32_t dir_id) {
+    pthread_rwlock_unlock(&fs->inode_locks[dir_id]);
 }
 
-// 将索引表写入磁盘
-void write_inode_table() {
-    fseek(fp, INODE_TABLE_START, SEEK_SET);
-    fwrite(inode_table, sizeof(inode), INODE_NUM, fp);
+// meta 中从第 start 个 block 开始、在磁盘上也相邻的 block 的末尾
+static uint32_t meta_run_end(ext2emu *fs, uint32_t start, uint32_t end) {
+    uint32_t stop = start + 1;
+    while (stop < end && fs->meta_location[stop] == fs->meta_location[stop - 1] + 1) {
+        stop++;
+    }
+    return stop;
 }
 
-// 从磁盘加载数据块
-void load_block(int32_t id) {
-    fseek(fp, id * BLOCK_SIZE, SEEK_SET);
-    fread(block_buffer, sizeof(dir_item), 8, fp);
+// 从磁盘加载超级块、组描述符、位图和索引表
+static void load_meta(ext2emu *fs) {
+    uint32_t start = 0;
+    while (start < fs->meta_blocks) {
+        uint32_t stop = meta_run_end(fs, start, fs->meta_blocks);
+        disk_read(&fs->disk, fs->meta_location[start] * fs->block_size, fs->meta + start * fs->block_size,
+                  (stop - start) * fs->block_size);
+        start = stop;
+    }
+    memset(fs->meta_dirty, 0, fs->meta_blocks);
 }
 
-// 将数据块写入磁盘
-void write_block(int32_t id) {
-    fseek(fp, id * BLOCK_SIZE, SEEK_SET);
-    fwrite(block_buffer, sizeof(dir_item), 8, fp);
+// 将 meta 中第 first 到 end - 1 个 block 中被修改的写入磁盘，在磁盘上相邻的脏 block 合并为一次写入
+static void flush_meta(ext2emu *fs, uint32_t first, uint32_t end) {
+    uint32_t start = first;
+    while (start < end) {
+        if (!fs->meta_dirty[start]) {
+            start++;
+            continue;
+        }
+        uint32_t stop = start + 1;
+        while (stop < end && fs->meta_dirty[stop] && fs->meta_location[stop] == fs->meta_location[stop - 1] + 1) {
+            stop++;
+        }
+        memset(fs->meta_dirty + start, 0, stop - start);
+        disk_write(&fs->disk, fs->meta_location[start] * fs->block_size, fs->meta + start * fs->block_size,
+                   (stop - start) * fs->block_size);
+        start = stop;
+    }
 }
 
-// 将 block 位图中对应位设为 1
-void set_block_map_bit(int32_t id) {
-    uint32_t index = id / 32;
-    uint32_t bit = id % 32;
-    uint32_t con = 0x1;
-    con = con << bit;
-    spBlock->block_map[index] |= con;
+// 将超级块、组描述符和位图中被修改的 block 写入磁盘，调用者持有 meta_lock 或独占 ns_lock
+static void write_super_block(ext2emu *fs) {
+    flush_meta(fs, 0, fs->inode_table_start);
 }
 
-// 将 block 位图中对应位设为 0
-void reset_block_map_bit(int32_t id) {
-    uint32_t index = id / 32;
-    uint32_t bit = id % 32;
-    uint32_t con = 0x1;
-    con = con << bit;
-    spBlock->block_map[index] &= ~con;
+// 标记超级块已修改，何时写入磁盘由 sync_policy 决定，调用者持有 meta_lock
+// 组描述符和位图单独占用 block 时，修改过的 block 与超级块一同写入
+static void mark_super_block_dirty(ext2emu *fs) {
+    fs->meta_dirty[0] = 1;
+    if (fs->sync_policy == SYNC_ALWAYS && !fs->journaling) {
+        write_super_block(fs);
+    }
 }
 
-// 将 inode 位图中对应位设为 1
-void set_inode_map_bit(int32_t id) {
-    uint32_t index = id / 32;
-    uint32_t bit = id % 32;
-    uint32_t con = 0x1;
-    con = con << bit;
-    spBlock->inode_map[index] |= con;
+// 设置或清除位图 map 的第 bit 位，并标记它所在的 block 已修改，调用者持有 meta_lock 并随后调用 mark_super_block_dirty
+static void map_set(ext2emu *fs, uint64_t *map, uint32_t bit) {
+    bitmap_set(map, bit);
+    fs->meta_dirty[((uint8_t *) &map[bit / 64] - fs->meta) / fs->block_size] = 1;
 }
 
-// 将 inode 位图中对应位设为 0
-void reset_inode_map_bit(int32_t id) {
-    uint32_t index = id / 32;
-    uint32_t bit = id % 32;
-    uint32_t con = 0x1;
-    con = con << bit;
-    spBlock->inode_map[index] &= ~con;
+static void map_clear(ext2emu *fs, uint64_t *map, uint32_t bit) {
+    bitmap_clear(map, bit);
+    fs->meta_dirty[((uint8_t *) &map[bit / 64] - fs->meta) / fs->block_size] = 1;
 }
 
-// 从 block 位图中找到一个空闲 block
-int32_t get_free_block() {
-    // 已满
-    if (spBlock->free_block_count == 0) {
-        return -1;
+// 第 g 个块组的第一个数据 block，之前是组内的位图和索引表，块组 0 还有超级块和组描述符
+static uint32_t group_data_start(ext2emu *fs, uint32_t g) {
+    if (g == 0) {
+        return fs->data_start;
     }
+    return g * fs->blocks_per_group + 2 + fs->inodes_per_group / INODES_PER_BLOCK(fs->block_size);
+}
 
-    // 初始位置
-    uint32_t index = 0;
-    uint32_t bit;
-    uint32_t con = 0x1;
+// 第 g 个块组的 block 数，最后一个块组可能不满
+static uint32_t group_blocks(ext2emu *fs, uint32_t g) {
+    uint32_t left = fs->block_count - g * fs->blocks_per_group;
+    return left < fs->blocks_per_group ? left : fs->blocks_per_group;
+}
 
-    while (spBlock->block_map[index] == 0xFFFFFFFF) {
-        index++;
+int fs_is_meta_block(ext2emu *fs, uint32_t block_id) {
+    return block_id < fs->block_count && block_id < group_data_start(fs, block_id / fs->blocks_per_group);
+}
+
+// 每个块组的 inode 位图从新的 block 开始，没有块组时即为 inode_id
+uint32_t fs_inode_bit(ext2emu *fs, int32_t inode_id) {
+    return inode_id / fs->inodes_per_group * fs->block_size * 8 + inode_id % fs->inodes_per_group;
+}
+
+// 第 g 个块组在 block_map、inode_map 中的部分
+static uint64_t *group_block_map(ext2emu *fs, uint32_t g) {
+    return fs->block_map + g * fs->blocks_per_group / 64;
+}
+
+static uint64_t *group_inode_map(ext2emu *fs, uint32_t g) {
+    return fs->inode_map + g * fs->block_size / 8;
+}
+
+// 标记第 g 个块组的描述符已修改，没有块组时描述符只在内存中
+static void mark_group_dirty(ext2emu *fs, uint32_t g) {
+    if (fs->gdt_blocks > 0) {
+        fs->meta_dirty[1 + g * sizeof(group_desc) / fs->block_size] = 1;
     }
+}
 
-    for (bit = 0; bit < 32; bit++) {
-        if (((spBlock->block_map[index] >> bit) & con) == 0) {
-            return index * 32 + bit;
+// 在位图中分配或释放一个 block，同时更新块组描述符和超级块中的计数，调用者持有 meta_lock 并随后调用 mark_super_block_dirty
+static void take_block(ext2emu *fs, uint32_t block_id) {
+    uint32_t g = block_id / fs->blocks_per_group;
+    map_set(fs, fs->block_map, block_id);
+    fs->groups[g].free_blocks_count--;
+    fs->spBlock->free_block_count--;
+    mark_group_dirty(fs, g);
+}
+
+static void release_block(ext2emu *fs, uint32_t block_id) {
+    uint32_t g = block_id / fs->blocks_per_group;
+    map_clear(fs, fs->block_map, block_id);
+    fs->groups[g].free_blocks_count++;
+    fs->spBlock->free_block_count++;
+    mark_group_dirty(fs, g);
+}
+
+// inode 同上，dir 为 1 时还要更新目录数
+static void take_inode(ext2emu *fs, int32_t inode_id, int dir) {
+    uint32_t g = inode_id / fs->inodes_per_group;
+    map_set(fs, fs->inode_map, fs_inode_bit(fs, inode_id));
+    fs->groups[g].free_inodes_count--;
+    fs->spBlock->free_inode_count--;
+    if (dir) {
+        fs->groups[g].used_dirs_count++;
+        fs->spBlock->dir_inode_count++;
+    }
+    mark_group_dirty(fs, g);
+}
+
+// 按索引表中的类型判断是否为目录
+static void release_inode(ext2emu *fs, int32_t inode_id) {
+    uint32_t g = inode_id / fs->inodes_per_group;
+    map_clear(fs, fs->inode_map, fs_inode_bit(fs, inode_id));
+    fs->groups[g].free_inodes_count++;
+    fs->spBlock->free_inode_count++;
+    if (fs->inode_table[inode_id].file_type == 1) {
+        fs->groups[g].used_dirs_count--;
+        fs->spBlock->dir_inode_count--;
+    }
+    mark_group_dirty(fs, g);
+}
+
+// 设置超级块的同步策略
+void fs_set_sync_policy(ext2emu *fs, int policy) {
+    fs->sync_policy = policy;
+}
+
+// meta 中第 first 到 end - 1 个 block 中被修改的数量
+static uint32_t dirty_meta(ext2emu *fs, uint32_t first, uint32_t end) {
+    uint32_t count = 0;
+    for (uint32_t i = first; i < end; i++) {
+        count += fs->meta_dirty[i];
+    }
+    return count;
+}
+
+// 日志或缓存中剩余的空间是否不足以容纳 commands 条命令的修改
+// 超级块、组描述符和位图只计入已修改的，每条命令另外预留 JOURNAL_COMMAND_META 个
+// 缓存中的脏 block 只占用为它们留出的 frame，不挤占供读取的 BLOCK_CACHE_SIZE 个
+static int journal_full(ext2emu *fs, uint32_t commands) {
+    int dirty = block_cache_dirty_blocks(&fs->cache, NULL);
+    int pending = dirty + dirty_meta(fs, 0, fs->meta_blocks);
+    int reserve = commands * JOURNAL_COMMAND_BLOCKS;
+    return pending + reserve + commands * JOURNAL_COMMAND_META > (int) journal_capacity(&fs->journal)
+           || dirty + reserve > (int) (fs->cache.frame_count - BLOCK_CACHE_SIZE);
+}
+
+// 当前事务是否需要提交：按同步策略，或日志、缓存中剩余的空间不足
+static int need_commit(ext2emu *fs) {
+    if (fs->sync_policy == SYNC_ALWAYS || (fs->sync_policy == SYNC_COMMAND && fs->group_commands >= JOURNAL_GROUP_COMMANDS)) {
+        return 1;
+    }
+    return journal_full(fs, fs->active_commands + 1);
+}
+
+// 开始一条命令：exclusive 为 1 时独占文件系统，否则与其他命令并行，只锁住涉及的目录
+// 有日志时先为本条命令在日志和缓存中预留空间；空间被正在执行的命令预留时等其中之一结束，
+// 已执行的命令的修改占满时提交
+void fs_begin_command(ext2emu *fs, int exclusive) {
+    while (1) {
+        if (exclusive) {
+            pthread_rwlock_wrlock(&fs->ns_lock);
+        } else {
+            pthread_rwlock_rdlock(&fs->ns_lock);
+        }
+        pthread_mutex_lock(&fs->meta_lock);
+        if (!fs->journaling || !journal_full(fs, fs->active_commands + 1)) {
+            fs->active_commands++;
+            pthread_mutex_unlock(&fs->meta_lock);
+            return;
+        }
+        if (fs->active_commands > 0 && !journal_full(fs, 1)) {
+            // 不持有 ns_lock 等待，以免挡住提交
+            pthread_rwlock_unlock(&fs->ns_lock);
+            pthread_cond_wait(&fs->command_done, &fs->meta_lock);
+            pthread_mutex_unlock(&fs->meta_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&fs->meta_lock);
+        pthread_rwlock_unlock(&fs->ns_lock);
+
+        pthread_rwlock_wrlock(&fs->ns_lock);
+        fs_checkpoint(fs);
+        pthread_rwlock_unlock(&fs->ns_lock);
+    }
+}
+
+// 一条命令执行完毕
+void fs_end_command(ext2emu *fs) {
+    int commit = 0;
+    pthread_mutex_lock(&fs->meta_lock);
+    fs->active_commands--;
+    if (fs->journaling) {
+        pthread_cond_broadcast(&fs->command_done);
+        // 以命令为单位组提交
+        fs->group_commands++;
+        commit = need_commit(fs);
+    } else if (fs->sync_policy == SYNC_COMMAND) {
+        write_super_block(fs);
+    }
+    pthread_mutex_unlock(&fs->meta_lock);
+    pthread_rwlock_unlock(&fs->ns_lock);
+
+    if (commit) {
+        // 提交需要独占，其他线程可能已经提交过
+        pthread_rwlock_wrlock(&fs->ns_lock);
+        if (need_commit(fs)) {
+            fs_checkpoint(fs);
         }
+        pthread_rwlock_unlock(&fs->ns_lock);
     }
 
+    pthread_mutex_lock(&fs->scratch_lock);
+    scratch_reset(&fs->scratch);    // 释放本条命令使用的临时内存
+    pthread_mutex_unlock(&fs->scratch_lock);
 }
 
-// 从 inode 位图中找到一个空闲 inode
-int32_t get_free_inode() {
-    // 已满
-    if (spBlock->free_inode_count == 0) {
-        return -1;
+// inode 所在的索引表 block 在 meta 中的位置
+static uint32_t inode_block(ext2emu *fs, int32_t inode_id) {
+    return fs->inode_table_start + inode_id / INODES_PER_BLOCK(fs->block_size);
+}
+
+// 标记 inode 已修改，其所在的索引表 block 将在 write_inode_table 时写回，有日志时在提交时写回
+static void mark_inode_dirty(ext2emu *fs, int32_t inode_id) {
+    pthread_mutex_lock(&fs->meta_lock);
+    fs->meta_dirty[inode_block(fs, inode_id)] = 1;
+    pthread_mutex_unlock(&fs->meta_lock);
+}
+
+// 将索引表中被修改的 block 写入磁盘
+static void flush_inode_table(ext2emu *fs) {
+    pthread_mutex_lock(&fs->meta_lock);
+    flush_meta(fs, fs->inode_table_start, fs->meta_blocks);
+    pthread_mutex_unlock(&fs->meta_lock);
+}
+
+// 写回索引表中修改过的 block，有日志时推迟到提交
+static void write_inode_table(ext2emu *fs) {
+    if (!fs->journaling) {
+        flush_inode_table(fs);
+    }
+}
+
+// 文件的字节数，最后一个 block 可能只用了一部分
+static uint32_t file_size(ext2emu *fs, const inode *file) {
+    if (file->size == 0) {
+        return 0;
     }
+    return file->size * fs->block_size - (file->tail == 0 ? 0 : fs->block_size - file->tail);
+}
+
+void fs_inode_change_begin(ext2emu *fs, int32_t inode_id) {
+    // 序号变为奇数；之后对 size、tail 和 file_type 的写都是 release，不会排到它前面
+    __atomic_store_n(&fs->inode_seq[inode_id], fs->inode_seq[inode_id] + 1, __ATOMIC_RELAXED);
+}
+
+void fs_inode_change_end(ext2emu *fs, int32_t inode_id) {
+    __atomic_store_n(&fs->inode_seq[inode_id], fs->inode_seq[inode_id] + 1, __ATOMIC_RELEASE);
+}
+
+// 加载数据块到 buffer，经过 block 缓存
+static void load_block(ext2emu *fs, int32_t id, dir_item *buffer) {
+    dir_item *data = block_cache_get(&fs->cache, id, 1);
+    memcpy(buffer, data, fs->block_size);
+    block_cache_put(&fs->cache, data, 0);
+}
+
+// 将 buffer 写入数据块，只写入缓存并标记为脏，由 block_cache_flush 写回磁盘
+static void write_block(ext2emu *fs, int32_t id, const dir_item *buffer) {
+    dir_item *data = block_cache_get(&fs->cache, id, 0);
+    memcpy(data, buffer, fs->block_size);
+    block_cache_put(&fs->cache, data, 1);
+}
 
-    // 初始化
-    uint32_t index = 0;
-    uint32_t bit;
-    uint32_t con = 0x1;
+// 将 count 个 block 的内容清零，不读取原来的内容
+static void zero_blocks(ext2emu *fs, const uint32_t *block_ids, int count) {
+    for (int i = 0; i < count; i++) {
+        dir_item *data = block_cache_get(&fs->cache, block_ids[i], 0);
+        memset(data, 0, fs->block_size);
+        block_cache_put(&fs->cache, data, 1);
+    }
+}
 
-    while (spBlock->inode_map[index] == 0xFFFFFFFF) {
-        index++;
+// 开始查找空闲 block 的位置：goal 为 0 时从上次分配的位置之后开始
+static uint32_t block_goal(ext2emu *fs, uint32_t goal) {
+    if (goal == 0 || goal >= fs->block_count) {
+        goal = fs->block_hint < fs->block_count ? fs->block_hint : 0;
     }
+    return goal;
+}
 
-    for (bit = 0; bit < 32; bit++) {
-        if (((spBlock->inode_map[index] >> bit) & con) == 0) {
-            return index * 32 + bit;
+// 从 block 位图中找到一个空闲 block，调用者持有 meta_lock
+// 从 goal 所在的块组开始逐个块组查找，跳过已满的块组，每次只扫描一个块组的位图
+static int32_t get_free_block(ext2emu *fs, uint32_t goal) {
+    // 已满
+    if (fs->spBlock->free_block_count == 0) {
+        return -1;
+    }
+    goal = block_goal(fs, goal);
+    uint32_t first = goal / fs->blocks_per_group;
+    for (uint32_t i = 0; i < fs->group_count; i++) {
+        uint32_t g = (first + i) % fs->group_count;
+        if (fs->groups[g].free_blocks_count == 0) {
+            continue;
+        }
+        uint32_t start = g * fs->blocks_per_group;
+        int32_t found = bitmap_find_zero(group_block_map(fs, g), group_blocks(fs, g), i == 0 ? goal - start : 0);
+        if (found != -1) {
+            return start + found;
         }
     }
+    return -1;
 }
 
-// 从指定目录的 inode 中找到对应文件的 inode_id
-int32_t find_inode_id(const char *file, inode *cur_inode) {
-    for (int i = 0; i < cur_inode->size; i++) {
-        load_block(cur_inode->block_point[i]);      // 加载 block
-        for (int j = 0; j < 8; j++) {
-            if (block_buffer[j].item_count == 2) {  // 已删除，跳过
-                continue;
+// 同上，查找 need 个连续的空闲 block，跳过空闲 block 不足的块组，没有返回 -1
+static int32_t get_free_run(ext2emu *fs, uint32_t need, uint32_t goal) {
+    goal = block_goal(fs, goal);
+    uint32_t first = goal / fs->blocks_per_group;
+    for (uint32_t i = 0; i < fs->group_count; i++) {
+        uint32_t g = (first + i) % fs->group_count;
+        if (fs->groups[g].free_blocks_count < need) {
+            continue;
+        }
+        uint32_t start = g * fs->blocks_per_group;
+        int32_t found = bitmap_find_zero_run(group_block_map(fs, g), group_blocks(fs, g), need, i == 0 ? goal - start : 0);
+        if (found != -1) {
+            return start + found;
+        }
+    }
+    return -1;
+}
+
+// 在第 g 个块组中找到一个空闲 inode，从上次分配的位置之后开始查找，调用者持有 meta_lock
+static int32_t get_free_inode(ext2emu *fs, uint32_t g) {
+    uint32_t first = g * fs->inodes_per_group;
+    uint32_t hint = fs->inode_hint >= first && fs->inode_hint - first < fs->inodes_per_group ? fs->inode_hint - first : 0;
+    int32_t found = bitmap_find_zero(group_inode_map(fs, g), fs->inodes_per_group, hint);
+    return found == -1 ? -1 : (int32_t) (first + found);
+}
+
+// 为父目录 parent_id 下的新目录选择块组（Orlov 算法），调用者持有 meta_lock
+// 根目录下的目录分散到空闲 inode 和 block 不少于平均值的块组中目录最少的一个；
+// 其他目录尽量与父目录在同一块组，除非那里的目录已经太多，或空闲的 inode、block 明显少于平均值
+static int32_t find_group_dir(ext2emu *fs, int32_t parent_id) {
+    uint32_t count = fs->group_count;
+    group_desc *groups = fs->groups;
+    int64_t avg_inodes = fs->spBlock->free_inode_count / count;
+    int64_t avg_blocks = fs->spBlock->free_block_count / count;
+    uint32_t parent_group = parent_id / fs->inodes_per_group;
+    if (parent_id == 0) {
+        int32_t best = -1;
+        for (uint32_t g = 0; g < count; g++) {
+            if (groups[g].free_inodes_count > 0 && groups[g].free_inodes_count >= avg_inodes
+                && groups[g].free_blocks_count >= avg_blocks
+                && (best == -1 || groups[g].used_dirs_count < groups[best].used_dirs_count)) {
+                best = g;
             }
-            if (strcmp(block_buffer[j].name, file) == 0) {  // 找到文件，返回
-                return block_buffer[j].inode_id;
+        }
+        if (best != -1) {
+            return best;
+        }
+    } else {
+        int64_t max_dirs = fs->spBlock->dir_inode_count / count + fs->inodes_per_group / 16;
+        int64_t min_inodes = avg_inodes - fs->inodes_per_group / 4;
+        int64_t min_blocks = avg_blocks - fs->blocks_per_group / 4;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t g = (parent_group + i) % count;
+            if (groups[g].free_inodes_count > 0 && groups[g].used_dirs_count < max_dirs
+                && groups[g].free_inodes_count >= min_inodes && groups[g].free_blocks_count >= min_blocks) {
+                return g;
             }
-            if (block_buffer[j].item_count == 1) {  // 到达末尾，结束
-                break;
+        }
+    }
+    // 退而求其次，取空闲 inode 不少于平均值的块组
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t g = (parent_group + i) % count;
+        if (groups[g].free_inodes_count > 0 && groups[g].free_inodes_count >= avg_inodes) {
+            return g;
+        }
+    }
+    return -1;
+}
+
+// 为父目录 parent_id 下的新文件选择块组：父目录所在的块组，已满时按平方探测找一个还有空闲 inode 和 block 的
+// 平方探测只经过 log2(块组数) 个块组，都不合适时再依次查找所有块组
+static int32_t find_group_file(ext2emu *fs, int32_t parent_id) {
+    uint32_t parent_group = parent_id / fs->inodes_per_group;
+    uint32_t g = parent_group;
+    for (uint32_t step = 0; step < fs->group_count; step = step ? step * 2 : 1) {
+        g = (g + step) % fs->group_count;
+        if (fs->groups[g].free_inodes_count > 0 && fs->groups[g].free_blocks_count > 0) {
+            return g;
+        }
+    }
+    for (uint32_t i = 1; i < fs->group_count; i++) {
+        g = (parent_group + i) % fs->group_count;
+        if (fs->groups[g].free_inodes_count > 0 && fs->groups[g].free_blocks_count > 0) {
+            return g;
+        }
+    }
+    return -1;
+}
+
+// 新 inode 的数据 block 从哪里开始分配：有多个块组时从它所在块组的数据区开始
+static uint32_t inode_goal(ext2emu *fs, int32_t inode_id) {
+    return fs->group_count > 1 ? group_data_start(fs, inode_id / fs->inodes_per_group) : 0;
+}
+
+// 在目录 dir_id 中查找名为 file 的目录项，返回 inode_id，并写入目录项所在的 block 序号和 slot
+static int32_t find_inode_id(ext2emu *fs, const char *file, int32_t dir_id, int *block, int *slot) {
+    inode *cur_inode = &fs->inode_table[dir_id];
+
+    // 文件中没有目录项
+    if (cur_inode->file_type == 0) {
+        return -1;
+    }
+
+    // 较大的目录通过索引查找
+    int32_t inode_id;
+    if (dir_index_find(&fs->dir_index, dir_id, file, &inode_id, block, slot)) {
+        return inode_id;
+    }
+
+    int end = 0;
+    for (int i = 0; i < cur_inode->size && !end; i++) {
+        dir_item *data = block_cache_get(&fs->cache, bmap_lookup(&fs->mapping, cur_inode, i), 1);    // 直接访问缓存中的 block
+        int pos = 0, result;
+        dir_entry entry;
+        while ((result = dir_block_next(fs->dir_format, data, fs->block_size, &pos, &entry)) == 1) {
+            if (strcmp(entry.name, file) == 0) {     // 找到文件，返回
+                *block = i;
+                *slot = entry.slot;
+                block_cache_put(&fs->cache, data, 0);
+                return entry.inode_id;
             }
         }
+        end = result == -1;     // 到达末尾，结束
+        block_cache_put(&fs->cache, data, 0);
     }
     return -1;  // 未找到，返回-1
 }
 
-// 分配一个 block
-int32_t alloc_block() {
+// 查找目录 dir_id 下名为 name 的目录项，先查 dcache，未命中时扫描目录并记录结果
+static int32_t lookup_dir_item(ext2emu *fs, int32_t dir_id, const char *name, int *block, int *slot) {
+    *block = -1;
+    *slot = -1;
+
+    // 不可能存在的文件名
+    if (strlen(name) > 120) {
+        return -1;
+    }
+
+    int32_t inode_id;
+    if (dcache_lookup(&fs->dcache, dir_id, name, &inode_id, block, slot)) {
+        return inode_id;
+    }
+    inode_id = find_inode_id(fs, name, dir_id, block, slot);
+    dcache_insert(&fs->dcache, dir_id, name, inode_id, *block, *slot);
+    return inode_id;
+}
+
+// 分配一个 block，尽量靠近 goal，goal 为 0 时接着上次分配的位置
+static int32_t alloc_block(ext2emu *fs, uint32_t goal) {
+    pthread_mutex_lock(&fs->meta_lock);
+    int32_t block_id = get_free_block(fs, goal);    // 分配一个空闲 block
     // 已满
-    if (spBlock->free_block_count == 0) {
+    if (block_id == -1) {
+        pthread_mutex_unlock(&fs->meta_lock);
         return -1;
     }
 
-    int32_t block_id = get_free_block();    // 分配一个空闲 block
-    spBlock->free_block_count--;            // 更新超级块信息
-    set_block_map_bit(block_id);            // 标记为已分配
-    write_super_block();             // 更新超级块信息到磁盘
+    take_block(fs, block_id);                   // 标记为已分配，更新块组和超级块信息
+    fs->block_hint = block_id + 1;              // 下次从这里开始查找
+    mark_super_block_dirty(fs);
+    pthread_mutex_unlock(&fs->meta_lock);
     return block_id;
 }
 
-// 分配一个 inode
-int32_t alloc_inode() {
-    if (spBlock->free_inode_count == 0) {
+// 找出最适合分配 need 个 block 的空闲段：能容纳 need 的最短空闲段，没有则取最长的空闲段
+static void find_best_fit_run(ext2emu *fs, uint32_t need, uint32_t *best_start, uint32_t *best_len) {
+    uint32_t start, len;
+    uint32_t pos = 0;
+    *best_len = 0;
+    while (bitmap_next_zero_run(fs->block_map, fs->block_count, pos, &start, &len)) {
+        if (len >= need) {
+            if (*best_len < need || len < *best_len) {
+                *best_start = start;
+                *best_len = len;
+            }
+        } else if (len > *best_len) {
+            *best_start = start;
+            *best_len = len;
+        }
+        pos = start + len;
+    }
+}
+
+// 一次分配 count 个 block，写入 block_ids，空间不足时不分配并返回 -1
+// goal 不为 0 时从 goal 所在的块组开始查找，否则接着上次分配的位置
+// ALLOC_EXTENT 方式下尽量分配连续的 block，goal 不为 0 时先从 goal 开始连续分配，使文件的 block 接在原来的之后
+static int alloc_blocks(ext2emu *fs, int count, uint32_t goal, uint32_t *block_ids) {
+    pthread_mutex_lock(&fs->meta_lock);
+    if (fs->spBlock->free_block_count < count) {
+        pthread_mutex_unlock(&fs->meta_lock);
         return -1;
     }
-    int32_t inode_id = get_free_inode();    // 分配一个空闲 inode
-    spBlock->free_inode_count--;            // 更新超级块信息
-    set_inode_map_bit(inode_id);            // 标记为已分配
-    write_super_block();             // 更新超级块信息到磁盘
+
+    if (fs->alloc_mode == ALLOC_EXTENT) {
+        int allocated = 0;
+        while (goal != 0 && goal < fs->block_count && allocated < count && !bitmap_test(fs->block_map, goal)) {
+            block_ids[allocated++] = goal;
+            take_block(fs, goal++);
+        }
+        int32_t start = allocated < count ? get_free_run(fs, count - allocated, goal) : -1;
+        if (start != -1) {
+            // 找到足够长的连续空闲段
+            for (int i = 0; allocated < count; i++) {
+                block_ids[allocated++] = start + i;
+                take_block(fs, start + i);
+            }
+        }
+        // 没有足够长的连续空闲段，由若干段拼成
+        while (allocated < count) {
+            uint32_t run_start = 0, run_len;
+            find_best_fit_run(fs, count - allocated, &run_start, &run_len);
+            for (uint32_t i = 0; i < run_len && allocated < count; i++) {
+                block_ids[allocated++] = run_start + i;
+                take_block(fs, run_start + i);
+            }
+        }
+        fs->block_hint = block_ids[count - 1] + 1;
+    } else {
+        for (int i = 0; i < count; i++) {
+            block_ids[i] = get_free_block(fs, i == 0 ? goal : block_ids[i - 1] + 1);
+            take_block(fs, block_ids[i]);
+            fs->block_hint = block_ids[i] + 1;
+        }
+    }
+    mark_super_block_dirty(fs);               // 只更新一次超级块
+    pthread_mutex_unlock(&fs->meta_lock);
+    return 0;
+}
+
+// 设置 block 的分配方式
+void fs_set_alloc_mode(ext2emu *fs, int mode) {
+    fs->alloc_mode = mode;
+}
+
+// 设置自动整理目录的阈值，0 表示不自动整理
+void fs_set_compact_threshold(ext2emu *fs, int percent) {
+    fs->compact_threshold = percent;
+}
+
+// 为父目录 parent_id 下的新文件分配一个 inode，dir 为 1 时是目录，parent_id 为 -1 时是根目录
+// 先按 find_group_dir、find_group_file 选择块组，其中没有空闲 inode 时从它开始依次查找其他块组
+static int32_t alloc_inode(ext2emu *fs, int32_t parent_id, int dir) {
+    pthread_mutex_lock(&fs->meta_lock);
+    int32_t inode_id = -1;
+    if (fs->spBlock->free_inode_count > 0) {
+        uint32_t first = 0;
+        if (parent_id >= 0) {
+            int32_t g = dir ? find_group_dir(fs, parent_id) : find_group_file(fs, parent_id);
+            first = g != -1 ? (uint32_t) g : parent_id / fs->inodes_per_group;
+        }
+        for (uint32_t i = 0; i < fs->group_count && inode_id == -1; i++) {
+            uint32_t g = (first + i) % fs->group_count;
+            if (fs->groups[g].free_inodes_count > 0) {
+                inode_id = get_free_inode(fs, g);
+            }
+        }
+    }
+    if (inode_id == -1) {
+        pthread_mutex_unlock(&fs->meta_lock);
+        return -1;
+    }
+    take_inode(fs, inode_id, dir);              // 标记为已分配，更新块组和超级块信息
+    fs->inode_hint = inode_id + 1;
+    mark_super_block_dirty(fs);
+    pthread_mutex_unlock(&fs->meta_lock);
     return inode_id;
 }
 
 // 释放一个 block
-void free_block(int32_t block_id) {
-    reset_block_map_bit(block_id);          // 标记为空闲
-    spBlock->free_block_count++;            // 更新超级块信息
-    write_super_block();
+static void free_block(ext2emu *fs, int32_t block_id) {
+    pthread_mutex_lock(&fs->meta_lock);
+    release_block(fs, block_id);                // 标记为空闲，更新块组和超级块信息
+    mark_super_block_dirty(fs);
+    pthread_mutex_unlock(&fs->meta_lock);
 }
 
-// 释放一个 inode
-void free_inode(int32_t inode_id) {
-    reset_inode_map_bit(inode_id);          // 标记为空闲
-    spBlock->free_inode_count++;            // 更新超级块信息
-    write_super_block();
+// 释放一个 inode，它是目录时同时减少目录数
+static void free_inode(ext2emu *fs, int32_t inode_id) {
+    pthread_mutex_lock(&fs->meta_lock);
+    release_inode(fs, inode_id);                // 标记为空闲，更新块组和超级块信息
+    mark_super_block_dirty(fs);
+    pthread_mutex_unlock(&fs->meta_lock);
+    dcache_invalidate_dir(&fs->dcache, inode_id);        // 以它为父目录的 dcache 项失效
+    dir_index_drop(&fs->dir_index, inode_id);
 }
 
-// 根据路径获取对应文件的 inode_id
-int32_t get_inode_id_by_path(char *path) {
-    // 错误处理
-    if (path == NULL) {
-        return -1;
+// 将 inode 截短到 blocks 个 block，在位图中释放空出的 block 和间接 block
+// 释放的 block 不再写回，丢弃它们的缓存，分步截短时前一步写过的间接 block 不会留在缓存中等待提交
+// 调用者持有 meta_lock，并随后调用 mark_super_block_dirty
+static void truncate_blocks(ext2emu *fs, inode *node, uint32_t blocks) {
+    uint32_t freed[RESIZE_STEP + 3];
+    while (node->size > blocks) {
+        uint32_t target = node->size - blocks > RESIZE_STEP ? node->size - RESIZE_STEP : blocks;
+        uint32_t count = bmap_truncate(&fs->mapping, node, target, freed);
+        for (uint32_t i = 0; i < count; i++) {
+            release_block(fs, freed[i]);
+        }
+        block_cache_discard(&fs->cache, freed, count);
     }
+}
 
-    char *temp_path = malloc(sizeof(char) * strlen(path) + 1);  // 复制一份，strtok 会修改源字符串内容
-    strcpy(temp_path, path);
+// 将 inode 截短到 blocks 个 block，调用者对它独占加锁，或它还不属于任何目录
+static void shrink_inode(ext2emu *fs, int32_t inode_id, uint32_t blocks) {
+    pthread_mutex_lock(&fs->meta_lock);
+    truncate_blocks(fs, &fs->inode_table[inode_id], blocks);
+    fs->meta_dirty[inode_block(fs, inode_id)] = 1;
+    mark_super_block_dirty(fs);
+    pthread_mutex_unlock(&fs->meta_lock);
+}
 
-    char *p = NULL;     // 指向当前解析的文件或目录名
-    int32_t cur_inode_id = 0;   // 从根目录开始解析，根目录的 inode_id 为 0
-    inode *cur_inode;
-    p = strtok(temp_path, "/");
-    while (p) {
-        cur_inode = &inode_table[cur_inode_id];
-        cur_inode_id = find_inode_id(p, cur_inode);
-        if (cur_inode_id == -1) {
-            break;
+// 将 inode 扩充到 blocks 个 block，新的 block 全部为 0，尽量接在原来的最后一个 block 之后，空文件从 inode 所在的块组开始
+// 先分配数据 block，再按它们能否合成连续的段分配需要的间接 block
+// 空间不足时恢复原来的大小并返回 -1，加锁要求同 shrink_inode
+static int grow_inode(ext2emu *fs, int32_t inode_id, uint32_t blocks) {
+    inode *node = &fs->inode_table[inode_id];
+    uint32_t size = node->size;
+    uint32_t ids[RESIZE_STEP + 3];
+    while (node->size < blocks) {
+        uint32_t count = blocks - node->size > RESIZE_STEP ? RESIZE_STEP : blocks - node->size;
+        uint32_t goal = node->size > 0 ? bmap_lookup(&fs->mapping, node, node->size - 1) + 1 : inode_goal(fs, inode_id);
+        if (alloc_blocks(fs, count, goal, ids) == -1) {
+            shrink_inode(fs, inode_id, size);
+            return -1;
+        }
+        int index = bmap_index_blocks(&fs->mapping, node, ids, count);
+        if (index < 0 || (index > 0 && alloc_blocks(fs, index, ids[count - 1] + 1, &ids[count]) == -1)) {
+            for (uint32_t i = 0; i < count; i++) {
+                free_block(fs, ids[i]);
+            }
+            shrink_inode(fs, inode_id, size);
+            return -1;
         }
-        p = strtok(NULL, "/");      // update
+        zero_blocks(fs, ids, count);
+        bmap_append(&fs->mapping, node, ids, count, &ids[count]);
     }
-    free(temp_path);
-    return cur_inode_id;
+    mark_inode_dirty(fs, inode_id);
+    return 0;
 }
 
-// 输出磁盘空间使用信息
-void print_information() {
-    int dir_num = spBlock->dir_inode_count;             // 文件夹数量
-    int file_num = 1024 - spBlock->free_inode_count - spBlock->dir_inode_count;     // 文件数量
-    int free_block_num = spBlock->free_block_count;     // 空闲 block 数量
-    int free_inode_num = spBlock->free_inode_count;     // 空闲 inode 数量
-    printf("In this FileSystem:\n"
-           "The maximum size of a single file is 6KB;\n"
-           "The maximum number of files and folders a single folder can contain is 46;\n"
-           "The whole file system can contain mostly 1024 files and folders;\n"
-           "**It has %d folders and %d files in this system now;\n"
-           "**It has %dKB free space now;\n"
-           "**And it can accept another %d now files or folders.\n"
-           "--------------------------------------------------------------------\n"
-           "!!!!!!! **The instruction should be shorter than 400 bytes** !!!!!!!\n"
-           "--------------------------------------------------------------------\n",
-           dir_num, file_num, free_block_num, free_inode_num);
-}
-
-// 文件系统初始化
-void fs_init() {
-    fp = fopen(disk, "r+b");    // 以读写二进制文件方式打开
+// 删除以 dir_id 为根的整棵子树，用栈按 inode_id 遍历，不经过路径解析，也不修改子树中的目录项
+// 子树中的 block 和 inode 直接在位图中释放，超级块只在最后标记一次
+// 修改的 block 用完本条命令的预留时先提交一次，子树的目录项已经删除，中途崩溃只会留下 -f repair 可以释放的孤立 inode
+// 调用者独占 ns_lock，子树中不会有其他命令
+static void delete_tree(ext2emu *fs, int32_t dir_id) {
+    pthread_mutex_lock(&fs->scratch_lock);
+    pthread_mutex_lock(&fs->meta_lock);
+    scratch_mark mark = scratch_save(&fs->scratch);
+    int32_t *stack = scratch_alloc(&fs->scratch, sizeof(int32_t) * fs->inode_count);   // 每个 inode 至多入栈一次
+    int top = 0;
+    // 上次检查日志空间时缓存中的脏 block 数和修改过的组描述符、位图数
+    int checked = block_cache_dirty_blocks(&fs->cache, NULL) + dirty_meta(fs, 0, fs->inode_table_start);
+
+    stack[top++] = dir_id;
+    while (top > 0) {
+        int32_t inode_id = stack[--top];
+        inode *cur_inode = &fs->inode_table[inode_id];
+
+        // 文件夹，将其下的文件和文件夹入栈
+        if (cur_inode->file_type == 1) {
+            int end = 0;
+            for (int i = 0; i < cur_inode->size && !end; i++) {
+                dir_item *data = block_cache_get(&fs->cache, bmap_lookup(&fs->mapping, cur_inode, i), 1);
+                int pos = 0, result;
+                dir_entry entry;
+                while ((result = dir_block_next(fs->dir_format, data, fs->block_size, &pos, &entry)) == 1) {
+                    // 跳过 "." 和 ".."
+                    if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0) {
+                        stack[top++] = entry.inode_id;
+                    }
+                }
+                end = result == -1;     // 末尾
+                block_cache_put(&fs->cache, data, 0);
+            }
+            dcache_invalidate_dir(&fs->dcache, inode_id);    // 以它为父目录的 dcache 项失效
+            dir_index_drop(&fs->dir_index, inode_id);
+        }
 
-    // 错误处理
-    if (fp == NULL) {
-        printf("Cannot open file \'%s\'", disk);
-        exit(1);
+        // 释放 block 和 inode
+        fs_inode_change_begin(fs, inode_id);
+        truncate_blocks(fs, cur_inode, 0);
+        fs_inode_change_end(fs, inode_id);
+        release_inode(fs, inode_id);
+
+        // 子树中的索引表不写回，只有缓存中的脏 block、组描述符和位图增加时才可能用完预留
+        int dirty = block_cache_dirty_blocks(&fs->cache, NULL) + dirty_meta(fs, 0, fs->inode_table_start);
+        if (fs->journaling && dirty > checked && journal_full(fs, 1)) {
+            mark_super_block_dirty(fs);
+            pthread_mutex_unlock(&fs->meta_lock);
+            fs_checkpoint(fs);
+            pthread_mutex_lock(&fs->meta_lock);
+            dirty = 0;
+        }
+        checked = dirty;
     }
 
-    load_super_block();          // 假设超级块已存在，加载超级块
-    if (spBlock->system_mod == 1) {     // 非首次使用文件系统
-        load_inode_table();             // 加载索引表
+    mark_super_block_dirty(fs);
+    scratch_restore(&fs->scratch, mark);
+    pthread_mutex_unlock(&fs->meta_lock);
+    pthread_mutex_unlock(&fs->scratch_lock);
+}
+
+// 解析路径的前 length 个字符，一次得到父目录、文件名和目标文件，以及目标文件的目录项在父目录中的位置
+// 路径以 '/' 结尾时目标文件即为父目录本身
+// 父目录存在时按 lock 对它加锁后再查找文件名，LOCK_NONE 以外由调用者用 unlock_dir 解锁
+static void resolve_path(ext2emu *fs, const char *path, int length, path_info *info, int lock) {
+    int end = length - 1;
+    while (end >= 0 && path[end] != '/') {
+        end--;
+    }
+    info->parent_length = end + 1;
+    info->name_length = length - end - 1;
+    if (info->name_length > 120) {
+        info->name[0] = '\0';
     } else {
-        // init super block
-        printf("File system does not exist.\nFormating...\n");
+        memcpy(info->name, path + end + 1, info->name_length);
+        info->name[info->name_length] = '\0';
+    }
+    info->inode_id = -1;
+    info->block = -1;
+    info->slot = -1;
+
+    // 从根目录开始逐级解析父目录，根目录的 inode_id 为 0
+    int32_t cur_inode_id = 0;
+    char component[121];
+    int block, slot;
+    int i = 0;
+    while (i < info->parent_length && cur_inode_id != -1) {
+        if (path[i] == '/') {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (path[i] != '/') {
+            i++;
+        }
+        if (i - start > 120) {      // 不可能存在的文件名
+            cur_inode_id = -1;
+            break;
+        }
+        memcpy(component, path + start, i - start);
+        component[i - start] = '\0';
+        // 目录只会在独占时被删除，解析过的目录不会失效
+        // dcache 命中时不加锁，未命中才对目录加锁扫描
+        int32_t dir_id = cur_inode_id;
+        if (!dcache_lookup(&fs->dcache, dir_id, component, &cur_inode_id, &block, &slot)) {
+            lock_dir(fs, dir_id, LOCK_SHARED);
+            cur_inode_id = lookup_dir_item(fs, dir_id, component, &block, &slot);
+            unlock_dir(fs, dir_id);
+        }
+    }
+    info->parent_id = cur_inode_id;
+    if (cur_inode_id == -1) {
+        return;
+    }
+
+    // 不加锁时结果只是一次快照，dcache 命中即可
+    if (lock == LOCK_NONE && info->name_length > 0 && info->name_length <= 120
+        && dcache_lookup(&fs->dcache, cur_inode_id, info->name, &info->inode_id, &info->block, &info->slot)) {
+        return;
+    }
+    lock_dir(fs, cur_inode_id, lock == LOCK_NONE ? LOCK_SHARED : lock);
+    if (info->name_length == 0) {
+        info->inode_id = cur_inode_id;
+    } else if (info->name_length <= 120) {
+        info->inode_id = lookup_dir_item(fs, cur_inode_id, info->name, &info->block, &info->slot);
+    }
+    if (lock == LOCK_NONE) {
+        unlock_dir(fs, cur_inode_id);
+    }
+}
+
+// 在目录 dir_id 中加入目录项，优先使用已有 block 中的空间，否则加在新的 block 中
+// 成功返回 0，目录已满返回 -1，没有空闲 block 返回 -2
+// 调用者对目录 dir_id 加了 LOCK_EXCLUSIVE，compact_dir、remove_dir_item 同样
+static int add_dir_item(ext2emu *fs, int32_t dir_id, const char *name, int32_t inode_id, uint8_t type) {
+    inode *dir = &fs->inode_table[dir_id];
+    dir_item buffer[MAX_DIR_ITEMS];
+    int block = 0, slot = -1;
+    for (; block < dir->size && slot == -1; block++) {
+        int32_t block_id = bmap_lookup(&fs->mapping, dir, block);
+        load_block(fs, block_id, buffer);
+        slot = dir_block_insert(fs->dir_format, buffer, fs->block_size, name, inode_id, type);
+        if (slot != -1) {
+            write_block(fs, block_id, buffer);
+        }
+    }
+    block--;
+
+    if (slot == -1) {
+        // 所有 block 都已满，已达上限
+        if (dir->size == FILE_MAX_BLOCKS(fs->block_size)) {
+            return -1;
+        }
+        // 仍可分配，目录项放在新的 block 中
+        if (grow_inode(fs, dir_id, dir->size + 1) == -1) {
+            return -2;
+        }
+        int32_t block_id = bmap_lookup(&fs->mapping, dir, block);
+        load_block(fs, block_id, buffer);
+        if (dir_block_continue(fs->dir_format, buffer, fs->block_size)) {
+            write_block(fs, block_id, buffer);
+        }
 
-        memset(spBlock, 0, sizeof(sp_block));           // 初始化 super_block
-        memset(inode_table, 0, sizeof(inode) * 1024);   // 初始化 inode_table
+        block++;
+        dir_entry entry = {inode_id, type, 0, name};
+        dir_block_pack(fs->dir_format, buffer, fs->block_size, &entry, 1, 1);
+        write_block(fs, bmap_lookup(&fs->mapping, dir, block), buffer);
+        write_inode_table(fs);
+        slot = entry.slot;
+    }
+    dir_index_add(&fs->dir_index, dir_id, name, inode_id, block, slot);
+    dcache_insert(&fs->dcache, dir_id, name, inode_id, block, slot);
+    return 0;
+}
 
-        // 文件系统每个块为 1KB，超级块大小为 656B，将其对齐到 1KB
-        // 索引表占用 32B * 1024 = 32KB
-        // 共占用 33 个 block
+// 整理目录 dir_id，按原顺序将目录项重新依次排列，到达末尾时释放空出的 block
+// 一次改写的 block 不超过 JOURNAL_DATA_BLOCKS 个，较大的目录分多次完成，返回还需移动的目录项数
+// 目录项的位置发生变化，dcache 和目录索引随之失效
+static int compact_dir(ext2emu *fs, int32_t dir_id) {
+    inode *dir = &fs->inode_table[dir_id];
+    int format = fs->dir_format;
+    uint32_t block_size = fs->block_size;
+    pthread_mutex_lock(&fs->scratch_lock);
+    scratch_mark mark = scratch_save(&fs->scratch);
+    uint8_t *data = scratch_alloc(&fs->scratch, (size_t) block_size * dir->size);
+    int capacity = DIR_BLOCK_MAX_ENTRIES(block_size) * dir->size;
+    dir_entry *entries = scratch_alloc(&fs->scratch, sizeof(dir_entry) * capacity);
+    int *from = scratch_alloc(&fs->scratch, sizeof(int) * capacity);
+    int *to = scratch_alloc(&fs->scratch, sizeof(int) * capacity);
+    int *slot = scratch_alloc(&fs->scratch, sizeof(int) * capacity);
+    uint8_t *changed = scratch_alloc(&fs->scratch, dir->size);
+    memset(changed, 0, dir->size);
+
+    // 读出到末尾为止的所有目录项，记下各自所在的 block，并排好新的位置
+    int count = 0, end = 0, blocks = 0, used = 0;
+    for (int i = 0; i < dir->size && !end; i++) {
+        uint8_t *block = data + (size_t) i * block_size;
+        load_block(fs, bmap_lookup(&fs->mapping, dir, i), (dir_item *) block);
+        int pos = 0, result;
+        while ((result = dir_block_next(format, block, block_size, &pos, &entries[count])) == 1) {
+            from[count] = i;
+            slot[count] = dir_block_place(format, block_size, &blocks, &used, entries[count].name);
+            to[count] = blocks;
+            count++;
+        }
+        end = result == -1;
+    }
+    blocks++;
 
-        // init block map
-        spBlock->block_map[0] = 0xFFFFFFFF;             // super_block, inode_table
-        spBlock->block_map[1] = 0x00000001;
+    // 依次移到新的位置，改写的 block 达到上限时停止
+    // 停止在第 k 项时，每个 block 的内容是移到其中的前 k 项，之后是原来在其中的其余目录项
+    int k = 0, rewritten = 0, left = 0;
+    for (; k < count; k++) {
+        if (to[k] == from[k] && slot[k] == entries[k].slot) {
+            continue;
+        }
+        int need = !changed[to[k]] + (to[k] != from[k] && !changed[from[k]]);
+        if (rewritten + need > JOURNAL_DATA_BLOCKS) {
+            break;
+        }
+        rewritten += need;
+        changed[to[k]] = changed[from[k]] = 1;
+    }
+    for (int j = k; j < count; j++) {
+        left += to[j] != from[j] || slot[j] != entries[j].slot;
+    }
 
-        spBlock->free_block_count = 4096 - 1 - 32;      // super_block: 1, inode_table: 32 * 1024
-        spBlock->free_inode_count = 1024;
-        spBlock->dir_inode_count = 0;
+    if (k == count && blocks == dir->size && rewritten == 0) {
+        scratch_restore(&fs->scratch, mark);
+        pthread_mutex_unlock(&fs->scratch_lock);
+        return 0;
+    }
 
-        // 分配根目录
-        int32_t inode_id = alloc_inode();       // 分配 inode
+    // 到达末尾时之后的 block 空出，否则目录的最后一个 block 不变
+    int size = k == count ? blocks : dir->size;
+    dir_entry *content = scratch_alloc(&fs->scratch, sizeof(dir_entry) * DIR_BLOCK_MAX_ENTRIES(block_size));
+    dir_item buffer[MAX_DIR_ITEMS];
+    for (int i = 0; i < size; i++) {
+        if (!changed[i]) {
+            continue;
+        }
+        int n = 0;
+        for (int j = 0; j < count; j++) {
+            if ((j < k && to[j] == i) || (j >= k && from[j] == i)) {
+                content[n++] = entries[j];
+            }
+        }
+        dir_block_pack(format, buffer, block_size, content, n, i == size - 1);
+        write_block(fs, bmap_lookup(&fs->mapping, dir, i), buffer);
+    }
 
-        inode_table[inode_id].size = 1;         // 1 个 block
-        inode_table[inode_id].file_type = 1;    // 文件夹
+    // 释放空出的 block
+    if (size < dir->size) {
+        shrink_inode(fs, dir_id, size);
+        write_inode_table(fs);
+    }
 
-        int32_t block_id = alloc_block();       // 分配 block
-        inode_table[inode_id].block_point[0] = block_id;
+    dcache_invalidate_dir(&fs->dcache, dir_id);
+    dir_index_drop(&fs->dir_index, dir_id);
+    scratch_restore(&fs->scratch, mark);
+    pthread_mutex_unlock(&fs->scratch_lock);
+    return left;
+}
 
-        write_inode_table();                    // 更新 inode_table
+// 可以回收的空间达到阈值时整理目录 dir_id
+static void maybe_compact_dir(ext2emu *fs, int32_t dir_id) {
+    if (fs->compact_threshold == 0) {
+        return;
+    }
+    inode *dir = &fs->inode_table[dir_id];
+    int used = 0, live = 0;
+    int finish = 0;
+    for (int i = 0; i < dir->size && finish == 0; i++) {
+        dir_item *data = block_cache_get(&fs->cache, bmap_lookup(&fs->mapping, dir, i), 1);
+        finish = dir_block_usage(fs->dir_format, data, fs->block_size, &used, &live) == -1;   // 末尾
+        block_cache_put(&fs->cache, data, 0);
+    }
+    int dead = dir_block_slack(fs->dir_format, fs->block_size, used, live);
+    if (dead > 0 && dead * 100LL >= used * (long long) fs->compact_threshold) {
+        compact_dir(fs, dir_id);
+    }
+}
 
-        load_block(block_id);
+// 删除目录 dir_id 中第 block 个 block 中位于 slot 的目录项，名为 name
+// 最后一个 block 中不再有目录项时释放它，直到最后一个 block 中还有目录项
+static void remove_dir_item(ext2emu *fs, int32_t dir_id, const char *name, int block, int slot) {
+    inode *dir = &fs->inode_table[dir_id];
+    dir_item buffer[MAX_DIR_ITEMS];
+    int i = block;
+    load_block(fs, bmap_lookup(&fs->mapping, dir, i), buffer);
+    int live = dir_block_remove(fs->dir_format, buffer, fs->block_size, slot);
+    int dropped = 0;
+    while (live == 0 && i == dir->size - 1 && i > 0) {
+        shrink_inode(fs, dir_id, i);
+        i--;
+        load_block(fs, bmap_lookup(&fs->mapping, dir, i), buffer);
+        live = dir_block_end(fs->dir_format, buffer, fs->block_size);
+        dropped = 1;
+    }
+    write_block(fs, bmap_lookup(&fs->mapping, dir, i), buffer);
+    dir_index_remove(&fs->dir_index, dir_id, name);
+    dcache_insert(&fs->dcache, dir_id, name, -1, -1, -1);
+
+    // 留下了空出的位置，检查是否需要整理
+    if (!dropped) {
+        maybe_compact_dir(fs, dir_id);
+    }
+}
 
-        // 创建目录项 "."
-        block_buffer[0].inode_id = 0;           // 根目录的 inode_id
-        block_buffer[0].item_count = 0;
-        block_buffer[0].type = 1;               // 文件夹
-        strcpy(block_buffer[0].name, ".");
+// 磁盘空间使用信息
+void fs_get_statfs(ext2emu *fs, ext2emu_fsstat *st) {
+    pthread_mutex_lock(&fs->meta_lock);
+    st->block_size = fs->block_size;
+    st->blocks = fs->block_count;
+    st->free_blocks = fs->spBlock->free_block_count;
+    st->inodes = fs->inode_count;
+    st->free_inodes = fs->spBlock->free_inode_count;
+    st->dirs = fs->spBlock->dir_inode_count;
+    st->files = fs->inode_count - fs->spBlock->free_inode_count - fs->spBlock->dir_inode_count;
+    st->max_file_size = fs->max_file_size;
+    st->groups = fs->group_count;
+    pthread_mutex_unlock(&fs->meta_lock);
+}
 
-        // 创建目录项 ".."
-        // 对于根目录，"." 和 ".." 均指向自身
-        block_buffer[1].inode_id = 0;           // 根目录的 inode_id
-        block_buffer[1].item_count = 1;         // 末尾
-        block_buffer[1].type = 1;               // 文件夹
-        strcpy(block_buffer[1].name, "..");
+// 块大小是否受支持
+static int valid_block_size(uint32_t block_size) {
+    return block_size == 1024 || block_size == 2048 || block_size == 4096;
+}
 
-        write_block(block_id);
+// 位图是否放得进超级块
+static int bitmaps_fit(const sp_block *super) {
+    return super->block_count <= sizeof(super->block_map) * 8 && super->inode_count <= sizeof(super->inode_map) * 8;
+}
 
-        spBlock->dir_inode_count++;             // 更新目录数
-        spBlock->system_mod = 1;                // 标记为已格式化
+// 按 super 中的块大小、block 数和 inode 数确定位图和索引表的位置，几何参数不合法时返回 -1
+// group_count 为 0 时没有块组：位图放得进超级块时放在超级块中，与之前的磁盘文件相同，
+// 否则依次单独占用超级块之后的 block，之后是索引表，这是分块组之前格式化的较大的磁盘文件
+// group_count 不为 0 时按一个位图 block 的位数划分块组，inode 平均分到每个块组，inode_count 随之向上取整
+static int plan_layout(sp_block *super) {
+    uint32_t size = super->block_size;
+    uint32_t per_block = INODES_PER_BLOCK(size);
+    if (!valid_block_size(size) || super->block_count == 0 || super->block_count > MAX_IMAGE_SIZE / size
+        || super->inode_count == 0 || super->inode_count > MAX_INODE_NUM || super->inode_count % per_block != 0) {
+        return -1;
+    }
+    uint32_t bits = size * 8;       // 一个位图 block 中的位数
+    if (super->group_count == 0) {
+        super->blocks_per_group = 0;
+        super->inodes_per_group = 0;
+        if (bitmaps_fit(super)) {
+            super->block_map_start = 0;
+            super->inode_map_start = 0;
+            super->inode_table_start = 1;
+        } else {
+            super->block_map_start = 1;
+            super->inode_map_start = super->block_map_start + (super->block_count + bits - 1) / bits;
+            super->inode_table_start = super->inode_map_start + (super->inode_count + bits - 1) / bits;
+        }
+        return 0;
+    }
 
-        write_super_block();             // 更新超级块
+    uint32_t groups = (super->block_count + bits - 1) / bits;
+    uint32_t per_group = (super->inode_count + groups - 1) / groups;
+    per_group = (per_group + per_block - 1) / per_block * per_block;
+    if (per_group * groups > MAX_INODE_NUM) {
+        per_group = MAX_INODE_NUM / groups / per_block * per_block;
     }
+    if (per_group > bits) {
+        return -1;
+    }
+    super->blocks_per_group = bits;
+    super->inodes_per_group = per_group;
+    super->group_count = groups;
+    super->inode_count = per_group * groups;
+    uint32_t gdt = (groups * sizeof(group_desc) + size - 1) / size;
+    super->block_map_start = 1 + gdt;
+    super->inode_map_start = 2 + gdt;
+    super->inode_table_start = 3 + gdt;
+    // 最后一个块组在位图和索引表之后还要有数据 block
+    uint32_t last = (groups - 1) * bits;
+    uint32_t last_meta = (groups == 1 ? super->inode_table_start : 2) + per_group / per_block;
+    return super->block_count - last > last_meta ? 0 : -1;
 }
 
-// ls
-// path 指向文件目录时，输出该目录下的所有文件；指向文件时，输出该文件的文件名
-void ls(char *path) {
-    // 目录起始地址不是根目录
-    if (path[0] != '/') {
-        printf("ls: cannot access \'%s\': No such file or directory\n", path);
-        return;
+// 第 g 个块组的第一个数据 block，没有块组时即为索引表之后的 block
+static uint32_t layout_data_start(const sp_block *super, uint32_t g) {
+    uint32_t per_block = INODES_PER_BLOCK(super->block_size);
+    if (super->group_count == 0) {
+        return super->inode_table_start + super->inode_count / per_block;
     }
+    return g * super->blocks_per_group + (g == 0 ? super->inode_table_start : 2) + super->inodes_per_group / per_block;
+}
 
-    char *parent_path = malloc(sizeof(char) * strlen(path) + 1);    // 父目录
-    int end = strlen(path);
-    while (path[end] != '/') {
-        end--;
+int fs_plan_geometry(const ext2emu_geometry *geometry, sp_block *super) {
+    ext2emu_geometry g = {BLOCK_NUM * BLOCK_SIZE, BLOCK_SIZE, 0};
+    if (geometry != NULL) {
+        g.size = geometry->size ? geometry->size : g.size;
+        g.block_size = geometry->block_size ? geometry->block_size : g.block_size;
+        g.inodes = geometry->inodes;
+    }
+    if (!valid_block_size(g.block_size) || g.inodes > MAX_INODE_NUM) {
+        return EXT2EMU_EINVAL;
+    }
+    // 默认每 4KB 一个 inode，但不超过 MAX_INODE_NUM，向上取整到占满索引表的 block
+    uint32_t per_block = INODES_PER_BLOCK(g.block_size);
+    uint32_t inodes = g.inodes ? g.inodes : g.size / 4096 < MAX_INODE_NUM ? g.size / 4096 : MAX_INODE_NUM;
+    inodes = inodes ? (inodes + per_block - 1) / per_block * per_block : per_block;
+
+    // 位图放得进超级块时不分块组，否则每个位图 block 管理一个块组
+    // 最后一个块组放不下它的位图、索引表和日志时舍去，剩下的 block 不使用
+    uint32_t block_count = g.size / g.block_size;
+    while (1) {
+        memset(super, 0, sizeof(sp_block));
+        super->block_size = g.block_size;
+        super->block_count = block_count;
+        super->inode_count = inodes;
+        super->group_count = !bitmaps_fit(super);
+        int planned = plan_layout(super) == 0;
+        uint32_t last = super->group_count > 1 ? super->group_count - 1 : 0;
+        // 日志位于磁盘末尾，至多占磁盘的 1/16，但不少于 JOURNAL_MIN_BLOCKS
+        // 命令只把改动的组描述符和位图写入日志，日志大小与块组数无关
+        int journal = JOURNAL_BLOCKS;
+        journal = journal < (int) (block_count / 16) ? journal : (int) (block_count / 16);
+        journal = journal > JOURNAL_MIN_BLOCKS ? journal : JOURNAL_MIN_BLOCKS;
+        super->journal_blocks = journal;
+        if (planned && (uint64_t) layout_data_start(super, last) + super->journal_blocks < block_count) {
+            break;      // 至少留出根目录的 block
+        }
+        if (last == 0) {
+            return EXT2EMU_EINVAL;
+        }
+        block_count = last * super->blocks_per_group;
     }
-    strncpy(parent_path, path, end + 1);    // 设定父目录
-    parent_path[end + 1] = '\0';
+    super->journal_start = super->block_count - super->journal_blocks;
+    return EXT2EMU_OK;
+}
 
-    // 查找父目录的 inode_id
-    int32_t parent_inode_id = get_inode_id_by_path(parent_path);
-    if (parent_inode_id == -1) {
-        printf("ls: cannot access \'%s\': No such directory\n", path);
-        free(parent_path);
-        return;
+// 按超级块设置 fs 的几何参数，分配 meta 并找到其中的超级块、组描述符、位图和索引表
+// 超级块中的几何参数不合法，或 mmap 方式下磁盘文件比文件系统小时返回 -1
+static int setup_meta(ext2emu *fs, const sp_block *super) {
+    sp_block layout = *super;
+    if (layout.block_size == 0) {
+        // 可以选择几何参数之前格式化的磁盘文件
+        layout.block_size = BLOCK_SIZE;
+        layout.block_count = BLOCK_NUM;
+        layout.inode_count = INODE_NUM;
+        layout.group_count = 0;
+    }
+    if (plan_layout(&layout) != 0) {
+        return -1;
+    }
+    // 选择几何参数之后格式化的磁盘文件，布局应与按几何参数重新计算的一致，日志位于末尾
+    if (super->block_size != 0 && (layout.inode_count != super->inode_count
+                                   || layout.group_count != super->group_count
+                                   || layout.blocks_per_group != super->blocks_per_group
+                                   || layout.inodes_per_group != super->inodes_per_group
+                                   || layout.block_map_start != super->block_map_start
+                                   || layout.inode_map_start != super->inode_map_start
+                                   || layout.inode_table_start != super->inode_table_start
+                                   || super->journal_start + super->journal_blocks != super->block_count)) {
+        return -1;
     }
 
-    // 父目录的 inode
-    inode *parent_inode = &inode_table[parent_inode_id];
-    if (parent_inode->file_type == 0) {
-        printf("ls: cannot access \'%s\': Not a directory\n", path);
-        free(parent_path);
-        return;
+    fs->block_size = layout.block_size;
+    fs->block_count = layout.block_count;
+    fs->inode_count = layout.inode_count;
+    fs->data_start = layout_data_start(&layout, 0);
+    if (fs->data_start >= fs->block_count) {
+        return -1;
+    }
+    int grouped = layout.group_count > 0;
+    // 没有块组时视为只有一个块组
+    fs->group_count = grouped ? layout.group_count : 1;
+    fs->blocks_per_group = grouped ? layout.blocks_per_group : fs->block_count;
+    fs->inodes_per_group = grouped ? layout.inodes_per_group : fs->inode_count;
+    fs->gdt_blocks = grouped ? layout.block_map_start - 1 : 0;
+    if (disk_map(&fs->disk, 0) != NULL && fs->disk.map_size < (size_t) fs->block_count * fs->block_size) {
+        return -1;
+    }
+    uint64_t max_file_size = (uint64_t) FILE_MAX_BLOCKS(fs->block_size) * fs->block_size;
+    fs->max_file_size = max_file_size < MAX_IMAGE_SIZE ? max_file_size : MAX_IMAGE_SIZE - 1;
+
+    // 没有块组时 meta 就是磁盘开头的 data_start 个 block；
+    // 有块组时依次放入超级块、组描述符、各块组的 block 位图、inode 位图和索引表，使位图和索引表在内存中连续
+    uint32_t table_blocks = fs->inodes_per_group / INODES_PER_BLOCK(fs->block_size);
+    fs->inode_table_start = grouped ? 1 + fs->gdt_blocks + 2 * fs->group_count : layout.inode_table_start;
+    fs->meta_blocks = grouped ? fs->inode_table_start + fs->group_count * table_blocks : fs->data_start;
+    fs->meta_location = malloc(sizeof(uint32_t) * fs->meta_blocks);
+    for (uint32_t i = 0; i < fs->meta_blocks; i++) {
+        fs->meta_location[i] = i;
+    }
+    if (grouped) {
+        for (uint32_t g = 0; g < fs->group_count; g++) {
+            uint32_t start = g == 0 ? layout.block_map_start : g * fs->blocks_per_group;
+            fs->meta_location[1 + fs->gdt_blocks + g] = start;
+            fs->meta_location[1 + fs->gdt_blocks + fs->group_count + g] = start + 1;
+            for (uint32_t k = 0; k < table_blocks; k++) {
+                fs->meta_location[fs->inode_table_start + g * table_blocks + k] = start + 2 + k;
+            }
+        }
     }
 
-    // 获取目标路径
-    int32_t cur_inode_id = get_inode_id_by_path(path);
-    int32_t cur_block_id;
-    if (cur_inode_id == -1) {
-        printf("ls: cannot access \'%s\': No such file or directory\n", path);
-        return;
+    // mmap 方式下没有块组时超级块、位图和索引表原地访问
+    fs->meta = grouped ? NULL : disk_map(&fs->disk, SUPER_BLOCK_START);
+    if (fs->meta == NULL) {
+        fs->meta = calloc(fs->meta_blocks, fs->block_size);
     }
+    fs->meta_dirty = calloc(fs->meta_blocks, 1);
+    fs->spBlock = (sp_block *) fs->meta;
+    if (grouped) {
+        fs->groups = (group_desc *) (fs->meta + fs->block_size);
+        fs->block_map = (uint64_t *) (fs->meta + (1 + fs->gdt_blocks) * fs->block_size);
+        fs->inode_map = (uint64_t *) (fs->meta + (1 + fs->gdt_blocks + fs->group_count) * fs->block_size);
+    } else {
+        fs->groups = calloc(1, sizeof(group_desc));     // 计数在加载或格式化后从超级块得到
+        fs->block_map = layout.block_map_start == 0 ? fs->spBlock->block_map
+                                                    : (uint64_t *) (fs->meta + layout.block_map_start * fs->block_size);
+        fs->inode_map = layout.inode_map_start == 0 ? fs->spBlock->inode_map
+                                                    : (uint64_t *) (fs->meta + layout.inode_map_start * fs->block_size);
+    }
+    fs->inode_table = (inode *) (fs->meta + fs->inode_table_start * fs->block_size);
+    return 0;
+}
 
-    inode *cur_inode;
-    cur_inode = &inode_table[cur_inode_id];
-    if (cur_inode->file_type == 0) {
-        // 路径指向文件
-        load_block(cur_inode->block_point[0]);
-        printf("%s\n", block_buffer[0].name);
+// 文件系统初始化，format 为 1 或磁盘上还没有文件系统时格式化，fs->formatted 记录是否进行了格式化
+// 格式化时 extents 为 1 则 inode 用 extent 记录 block，geometry 为 NULL 时使用默认的几何参数
+int fs_init(ext2emu *fs, const char *path, int backend, int format, int extents, const ext2emu_geometry *geometry) {
+    // 错误处理
+    int opened = disk_open(&fs->disk, path, backend);
+    if (opened != 0) {
+        return opened == -2 ? EXT2EMU_EBUSY : EXT2EMU_EIO;
+    }
+
+    // 假设超级块已存在，先读出其中的几何参数；格式化时按 geometry 重新确定
+    sp_block super;
+    memset(&super, 0, sizeof(sp_block));
+    disk_read(&fs->disk, SUPER_BLOCK_START, &super, sizeof(sp_block));
+    fs->formatted = format || super.system_mod != 1;
+    int error = fs->formatted ? fs_plan_geometry(geometry, &super) : EXT2EMU_OK;
+    if (error == EXT2EMU_OK && setup_meta(fs, &super) != 0) {
+        error = EXT2EMU_EIO;
+    }
+    if (error != EXT2EMU_OK) {
+        disk_close(&fs->disk);
+        return error;
+    }
+
+    fs->sync_policy = SYNC_COMMAND;
+    fs->block_hint = 0;
+    fs->inode_hint = 0;
+    fs->alloc_mode = ALLOC_EXTENT;
+    fs->compact_threshold = COMPACT_THRESHOLD;
+    fs->journaling = 0;
+    fs->active_commands = 0;
+
+    // 提交等待时不再放进新的只读操作，否则源源不断的查找会让修改文件系统的命令一直等下去
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&fs->ns_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    fs->inode_locks = malloc(sizeof(pthread_rwlock_t) * fs->inode_count);
+    for (uint32_t i = 0; i < fs->inode_count; i++) {
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    }
+    fs->inode_seq = calloc(fs->inode_count, sizeof(uint32_t));
+    pthread_mutex_init(&fs->meta_lock, NULL);
+    pthread_cond_init(&fs->command_done, NULL);
+    pthread_mutex_init(&fs->scratch_lock, NULL);
+
+    // 初始化 block 缓存，为同时执行的命令留出脏 block 的 frame
+    block_cache_init(&fs->cache, &fs->disk, fs->block_size, JOURNAL_MAX_COMMANDS * JOURNAL_COMMAND_BLOCKS);
+    fs->mapping.cache = &fs->cache;
+    dcache_init(&fs->dcache, fs->inode_count);                  // 初始化 dcache
+    dir_index_init(&fs->dir_index, fs->inode_table, fs->inode_count, &fs->mapping);   // 目录索引在首次查找时建立
+
+    if (!fs->formatted) {                  // 非首次使用文件系统
+        if (super.journal_blocks > 0) {
+            // 重放上次未写回的事务，超级块、位图和索引表可能随之改变
+            journal_init(&fs->journal, &fs->disk, super.journal_start, super.journal_blocks, fs->block_size);
+            journal_replay(&fs->journal);
+        }
+        load_meta(fs);                     // 加载超级块、组描述符、位图和索引表
+        fs->mapping.format = fs->spBlock->inode_format;
+        fs->dir_format = fs->spBlock->dir_format;
+        fs->dir_index.format = fs->dir_format;
+        if (fs->gdt_blocks == 0) {
+            // 没有块组时唯一的块组与超级块的计数相同
+            fs->groups[0].free_blocks_count = fs->spBlock->free_block_count;
+            fs->groups[0].free_inodes_count = fs->spBlock->free_inode_count;
+            fs->groups[0].used_dirs_count = fs->spBlock->dir_inode_count;
+        }
     } else {
-        // 路径指向目录
-        for (int i = 0; i < cur_inode->size; i++) {
-            cur_block_id = cur_inode->block_point[i];
-            load_block(cur_block_id);
-            for (int j = 0; j < 8; j++) {
-                if (block_buffer[j].item_count == 2) {  // 已删除
-                    continue;
-                }
-                if (block_buffer[j].type == 1) {        // 文件夹
-                    printf("*");
-                }
-                printf("%s  ", block_buffer[j].name);
-                if (block_buffer[j].item_count == 1) {  // 末尾
-                    break;
-                }
+        // 超级块、组描述符、位图和索引表全部需要写入
+        memset(fs->meta, 0, fs->meta_blocks * fs->block_size);
+        memset(fs->meta_dirty, 1, fs->meta_blocks);
+        *fs->spBlock = super;              // 几何参数、布局和日志的位置
+
+        // 超级块、组描述符、各块组的位图和索引表，以及日志占用的 block 不参与分配
+        uint32_t table_blocks = fs->inodes_per_group / INODES_PER_BLOCK(fs->block_size);
+        fs->spBlock->free_block_count = 0;
+        for (uint32_t g = 0; g < fs->group_count; g++) {
+            group_desc *desc = &fs->groups[g];
+            uint32_t start = g * fs->blocks_per_group;
+            for (uint32_t i = start; i < group_data_start(fs, g); i++) {
+                bitmap_set(fs->block_map, i);
             }
+            if (fs->gdt_blocks > 0) {
+                desc->block_bitmap = fs->meta_location[1 + fs->gdt_blocks + g];
+                desc->inode_bitmap = fs->meta_location[1 + fs->gdt_blocks + fs->group_count + g];
+                desc->inode_table = fs->meta_location[fs->inode_table_start + g * table_blocks];
+            }
+            desc->free_blocks_count = start + group_blocks(fs, g) - group_data_start(fs, g);
+            desc->free_inodes_count = fs->inodes_per_group;
+            desc->used_dirs_count = 0;
+        }
+        for (uint32_t i = super.journal_start; i < fs->block_count; i++) {
+            bitmap_set(fs->block_map, i);
+            fs->groups[i / fs->blocks_per_group].free_blocks_count--;
         }
-        printf("\n");
+        for (uint32_t g = 0; g < fs->group_count; g++) {
+            fs->spBlock->free_block_count += fs->groups[g].free_blocks_count;
+        }
+        fs->spBlock->free_inode_count = fs->inode_count;
+        fs->spBlock->dir_inode_count = 0;
+        fs->spBlock->inode_format = extents ? MAP_EXTENTS : MAP_POINTERS;
+        fs->mapping.format = fs->spBlock->inode_format;
+        fs->spBlock->dir_format = DIR_RECORDS;
+        fs->dir_format = fs->spBlock->dir_format;
+        fs->dir_index.format = fs->dir_format;
+
+        journal_init(&fs->journal, &fs->disk, super.journal_start, super.journal_blocks, fs->block_size);
+        journal_clear(&fs->journal);                        // 清除磁盘上残留的旧日志
+
+        // 分配根目录
+        dir_item buffer[MAX_DIR_ITEMS];
+        int32_t inode_id = alloc_inode(fs, -1, 1);     // 分配 inode，根目录的 inode_id 为 0
+
+        fs->inode_table[inode_id].file_type = 1;    // 文件夹
+
+        uint32_t block_id = alloc_block(fs, 0);   // 分配 block
+        bmap_append(&fs->mapping, &fs->inode_table[inode_id], &block_id, 1, NULL);     // 1 个 block
+
+        write_inode_table(fs);                    // 更新 inode_table
+
+        // 创建目录项 "." 和 ".."
+        // 对于根目录，"." 和 ".." 均指向自身
+        dir_entry entries[2] = {{0, 1, 0, "."}, {0, 1, 0, ".."}};
+        dir_block_pack(fs->dir_format, buffer, fs->block_size, entries, 2, 1);
+        write_block(fs, block_id, buffer);
+
+        fs->spBlock->system_mod = 1;                // 标记为已格式化
+
+        // 格式化不经过日志，直接写回
+        block_cache_flush(&fs->cache);
+        write_super_block(fs);             // 更新超级块
+        flush_inode_table(fs);
+        disk_sync(&fs->disk);
     }
+
+    // stdio 方式下所有元数据经过日志写回，mmap 方式下修改直接落在映射上，无法先写日志
+    fs->journaling = fs->spBlock->journal_blocks > 0 && disk_map(&fs->disk, 0) == NULL;
+    block_cache_hold_dirty(&fs->cache, fs->journaling);
+    fs->group_commands = 0;
+    return EXT2EMU_OK;
 }
 
-// 创建文件
-void create_file(char *path, int size) {
-    // 文件过大
-    if (size > 6144) {
-        printf("create: cannot create file \'%s\': file size should be between 0 and 6144\n", path);
-        return;
+// 查找 path 指向的文件
+int fs_lookup_path(ext2emu *fs, const char *path, ext2emu_stat *st) {
+    int length = strlen(path);
+
+    // 目录起始地址不是根目录
+    if (path[0] != '/') {
+        return fail(EXT2EMU_ENOENT, path, length);
     }
 
-    // 起始路径非根目录
+    // 读取目标文件的 inode 时父目录保持加锁，文件不会同时被删除
+    path_info info;
+    resolve_path(fs, path, length, &info, LOCK_SHARED);
+
+    // 父目录不存在
+    if (info.parent_id == -1) {
+        return fail(EXT2EMU_ENODIR, path, length);
+    }
+
+    int error = EXT2EMU_OK;
+    if (fs->inode_table[info.parent_id].file_type == 0) {
+        // 父目录不是文件夹
+        error = fail(EXT2EMU_ENOTDIR, path, length);
+    } else if (info.inode_id == -1) {
+        // 目标路径不存在
+        error = fail(EXT2EMU_ENOENT, path, length);
+    } else {
+        // 文件的大小可能正在被 fs_write_file 修改
+        int file = fs->inode_table[info.inode_id].file_type == 0;
+        if (file) {
+            lock_dir(fs, info.inode_id, LOCK_SHARED);
+        }
+        inode *cur_inode = &fs->inode_table[info.inode_id];
+        st->inode_id = info.inode_id;
+        st->type = cur_inode->file_type;
+        st->blocks = cur_inode->size;
+        st->size = file ? file_size(fs, cur_inode) : cur_inode->size * fs->block_size;
+        if (file) {
+            unlock_dir(fs, info.inode_id);
+        }
+    }
+    unlock_dir(fs, info.parent_id);
+    return error;
+}
+
+// 只经过 dcache 解析路径，有一个目录项不在 dcache 中就返回 -1，不存在的文件也返回 -1
+static int32_t walk_cached(ext2emu *fs, const char *path) {
+    char component[121];
+    int32_t cur_inode_id = 0;
+    int block, slot;
+    int i = 0;
+    while (path[i] != '\0') {
+        if (path[i] == '/') {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (path[i] != '/' && path[i] != '\0') {
+            i++;
+        }
+        if (i - start > 120) {
+            return -1;
+        }
+        memcpy(component, path + start, i - start);
+        component[i - start] = '\0';
+        int32_t dir_id = cur_inode_id;
+        if (!dcache_lookup(&fs->dcache, dir_id, component, &cur_inode_id, &block, &slot) || cur_inode_id == -1) {
+            return -1;
+        }
+    }
+    return cur_inode_id;
+}
+
+int fs_lookup_cached(ext2emu *fs, const char *path, ext2emu_stat *st) {
     if (path[0] != '/') {
-        printf("create: cannot access \'%s\': No such directory\n", path);
-        return;
+        return 0;
+    }
+    int32_t inode_id = walk_cached(fs, path);
+    if (inode_id == -1) {
+        return 0;
     }
 
-    char *parent_path = malloc(sizeof(char) * strlen(path) + 1);    // 父目录
-    char name[121];
-    int end = strlen(path);
-    while (path[end] != '/') {
-        end--;
+    // 读取期间序号为奇数或有变化，说明 size 和 tail 正在被修改，交给加锁的查找
+    inode *cur_inode = &fs->inode_table[inode_id];
+    uint32_t seq = __atomic_load_n(&fs->inode_seq[inode_id], __ATOMIC_ACQUIRE);
+    inode copy;
+    copy.file_type = __atomic_load_n(&cur_inode->file_type, __ATOMIC_ACQUIRE);
+    copy.size = __atomic_load_n(&cur_inode->size, __ATOMIC_ACQUIRE);
+    copy.tail = __atomic_load_n(&cur_inode->tail, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || __atomic_load_n(&fs->inode_seq[inode_id], __ATOMIC_RELAXED) != seq) {
+        return 0;
     }
-    int name_length = strlen(path) - end - 1;
-    // 文件名过长
-    if (name_length > 120) {
-        printf("create: cannot create file \'%s\': file name cannot be longer than 120 Bytes\n", path);
-        free(parent_path);
-        return;
+    int length = strlen(path);
+    if (path[length - 1] == '/' && copy.file_type != 1) {
+        return 0;
     }
-    strncpy(name, path + end + 1, name_length + 1);
-    strncpy(parent_path, path, end + 1);
-    parent_path[end + 1] = '\0';
 
-    // 父目录的 inode_id
-    int32_t parent_inode_id = get_inode_id_by_path(parent_path);
-    if (parent_inode_id == -1) {
-        printf("create: cannot access \'%s\': No such directory\n", parent_path);
-        free(parent_path);
-        return;
+    // 读取期间文件可能被删除，inode 又分给了别的文件；目录项先于 inode 释放，再解析一次仍得到它就说明读到的是它
+    if (walk_cached(fs, path) != inode_id) {
+        return 0;
     }
+    st->inode_id = inode_id;
+    st->type = copy.file_type;
+    st->blocks = copy.size;
+    st->size = copy.file_type == 0 ? file_size(fs, &copy) : copy.size * fs->block_size;
+    return 1;
+}
 
-    // 父目录的 inode
-    inode *parent_inode = &inode_table[parent_inode_id];
-    if (parent_inode->file_type == 0) {
-        printf("create: cannot access \'%s\': Not a directory\n", parent_path);
-        free(parent_path);
-        return;
+// 解析 path 指向的文件，对父目录加共享锁，对文件按 lock 加锁，解锁前文件不会被删除或移动
+// 失败时不持有任何锁
+static int open_file(ext2emu *fs, const char *path, int lock, path_info *info) {
+    int length = strlen(path);
+
+    // 目录起始地址不是根目录
+    if (path[0] != '/') {
+        return fail(EXT2EMU_ENOENT, path, length);
     }
 
-    // 查找是否存在同名文件或文件夹
-    for (int i = 0; i < parent_inode->size; i++) {
-        load_block(parent_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (block_buffer[j].item_count == 2) {
-                continue;
-            }
-            if (strcmp(block_buffer[j].name, name) == 0) {
-                printf("create: cannot create file \'%s\': File exists\n", path);
-                free(parent_path);
-                return;
-            }
-            if (block_buffer[j].item_count == 1) {
-                break;
-            }
-        }
+    resolve_path(fs, path, length, info, LOCK_SHARED);
+    if (info->parent_id == -1) {
+        return fail(EXT2EMU_ENODIR, path, length);
     }
 
-    // 分配 inode
-    int32_t inode_id = alloc_inode();
-    if (inode_id == -1) {
-        printf("create: cannot create file \'%s\': No enough space\n", path);
-        free(parent_path);
-        return;
+    int error = EXT2EMU_OK;
+    if (fs->inode_table[info->parent_id].file_type == 0) {
+        error = fail(EXT2EMU_ENOTDIR, path, info->parent_length);
+    } else if (info->inode_id == -1) {
+        error = fail(EXT2EMU_ENOENT, path, length);
+    } else if (fs->inode_table[info->inode_id].file_type == 1) {
+        error = fail(EXT2EMU_EISDIR, path, length);
     }
+    if (error != EXT2EMU_OK) {
+        unlock_dir(fs, info->parent_id);
+        return error;
+    }
+    lock_dir(fs, info->inode_id, lock);
+    return EXT2EMU_OK;
+}
 
-    inode *cur_inode = &inode_table[inode_id];
+static void close_file(ext2emu *fs, path_info *info) {
+    unlock_dir(fs, info->inode_id);
+    unlock_dir(fs, info->parent_id);
+}
 
-    // 根据 size 分配 block
-    cur_inode->size = ceil(size / 1024.0);
-    cur_inode->file_type = 0;
-    for (int i = 0; i < cur_inode->size; i++) {
-        int32_t block_id = alloc_block();
-        if (block_id == -1) {
-            // 空间不足，释放刚刚分配的 inode 和 block
-            printf("create: cannot create file \'%s\': No enough space\n", path);
-            for (int j = 0; j < i; j++) {
-                free_block(cur_inode->block_point[j]);
+// 从文件的 offset 处读取至多 len 字节，返回读取的字节数，到达末尾时返回 0
+// 先预读本次要读的 block 和之后的 block，顺序读取时后续的调用直接命中缓存
+int fs_read_file(ext2emu *fs, const char *path, uint32_t offset, void *buf, uint32_t len) {
+    path_info info;
+    int error = open_file(fs, path, LOCK_SHARED, &info);
+    if (error != EXT2EMU_OK) {
+        return error;
+    }
+
+    inode *file = &fs->inode_table[info.inode_id];
+    uint32_t size = file_size(fs, file);
+    uint32_t count = 0;
+    if (offset < size) {
+        count = len < size - offset ? len : size - offset;
+        uint32_t ids[READAHEAD_BLOCKS];
+        uint32_t first = offset / fs->block_size;
+        uint32_t ahead = file->size - first < READAHEAD_BLOCKS ? file->size - first : READAHEAD_BLOCKS;
+        bmap_range(&fs->mapping, file, first, ahead, ids);
+        block_cache_readahead(&fs->cache, ids, ahead);
+
+        uint32_t pos = offset;
+        while (pos < offset + count) {
+            uint32_t start = pos % fs->block_size;      // 在 block 中的偏移
+            uint32_t n = fs->block_size - start;
+            if (n > offset + count - pos) {
+                n = offset + count - pos;
             }
-            free_inode(inode_id);
-            free(parent_path);
-            return;
+            char *data = (char *) block_cache_get(&fs->cache, bmap_lookup(&fs->mapping, file, pos / fs->block_size), 1);
+            memcpy((char *) buf + (pos - offset), data + start, n);
+            block_cache_put(&fs->cache, (dir_item *) data, 0);
+            pos += n;
         }
-        cur_inode->block_point[i] = block_id;
-    }
-    write_inode_table();        // 更新索引表
-    write_super_block(); // 更新超级块
-
-    // 记录 dir_item
-    load_block(cur_inode->block_point[0]);
-    block_buffer[0].inode_id = inode_id;
-    block_buffer[0].item_count = 1;         // 末尾
-    block_buffer[0].type = 0;               // 文件
-    strcpy(block_buffer[0].name, name);
-    write_block(cur_inode->block_point[0]);
-
-    // 更新父目录的 inode
-    for (int i = 0; i < parent_inode->size; i++) {
-        load_block(parent_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (block_buffer[j].item_count == 1) {
-                // 找到末尾
-                block_buffer[j].item_count = 0;     // 更新标记
-                if (j < 7) {
-                    block_buffer[j + 1].inode_id = inode_id;
-                    block_buffer[j + 1].item_count = 1;     // 末尾
-                    block_buffer[j + 1].type = 0;           // 文件
-                    strcpy(block_buffer[j + 1].name, name);
-                    write_block(parent_inode->block_point[i]);
-                } else {
-                    // 当前分配给父目录的 block 已满
-                    // 已达上限，释放刚刚分配的 inode 和 block
-                    if (parent_inode->size == 6) {
-                        printf("create: cannot create file \'%s\': No enough space in directory\n", path);
-                        block_buffer[j].item_count = 1;
-                        for (int k = 0; k < cur_inode->size; k++) {
-                            free_block(cur_inode->block_point[k]);
-                        }
-                        free_inode(inode_id);
-                        free(parent_path);
-                        return;
-                    }
-                    // 仍可分配
-                    write_block(parent_inode->block_point[i]);
-                    int block_id = alloc_block();       // 分配 block
-                    parent_inode->block_point[i + 1] = block_id;
-                    parent_inode->size++;
-
-                    load_block(block_id);
-                    block_buffer[0].inode_id = inode_id;
-                    block_buffer[0].item_count = 1;     // 末尾
-                    block_buffer[0].type = 0;           // 文件
-                    strcpy(block_buffer[0].name, name);
-                    write_block(parent_inode->block_point[i + 1]);
-                    write_inode_table();
-                }
-                free(parent_path);
-                return;
-            } else if (block_buffer[j].item_count == 2) {
-                // 找到已删除位
-                block_buffer[j].inode_id = inode_id;
-                block_buffer[j].item_count = 0;         // 标记为可用
-                block_buffer[j].type = 0;               // 文件
-                strcpy(block_buffer[j].name, name);
-                write_block(parent_inode->block_point[i]);
-                free(parent_path);
-                return;
+    }
+    close_file(fs, &info);
+    return count;
+}
+
+// 将 buf 中的 len 字节写入文件的 offset 处，需要时为文件分配新的 block，返回写入的字节数
+// buf 为 NULL 时写入 0；从文件末尾之后开始写入时，中间的部分补 0；整块覆盖的 block 不读取原来的内容
+int fs_write_file(ext2emu *fs, const char *path, uint32_t offset, const void *buf, uint32_t len) {
+    int length = strlen(path);
+
+    // 文件过大
+    if (offset > fs->max_file_size || len > fs->max_file_size - offset) {
+        return fail(EXT2EMU_EFBIG, path, length);
+    }
+
+    path_info info;
+    int error = open_file(fs, path, LOCK_EXCLUSIVE, &info);
+    if (error != EXT2EMU_OK) {
+        return error;
+    }
+    if (len == 0) {
+        close_file(fs, &info);
+        return 0;
+    }
+
+    inode *file = &fs->inode_table[info.inode_id];
+    uint32_t size = file_size(fs, file);
+    uint32_t end = offset + len;
+    uint32_t new_size = end > size ? end : size;
+    int blocks = (new_size + fs->block_size - 1) / fs->block_size;
+    // size 和 tail 一起修改，不加锁的查找要么都看到，要么改用加锁的查找
+    fs_inode_change_begin(fs, info.inode_id);
+    if (blocks > file->size && grow_inode(fs, info.inode_id, blocks) == -1) {
+        fs_inode_change_end(fs, info.inode_id);
+        close_file(fs, &info);
+        return fail(EXT2EMU_ENOSPC, path, length);
+    }
+    __atomic_store_n(&file->tail, new_size % fs->block_size, __ATOMIC_RELEASE);
+    fs_inode_change_end(fs, info.inode_id);
+
+    uint32_t pos = offset < size ? offset : size;
+    while (pos < end) {
+        uint32_t start = pos % fs->block_size;
+        uint32_t n = fs->block_size - start;
+        if (n > end - pos) {
+            n = end - pos;
+        }
+        if (pos < offset && n > offset - pos) {     // 空洞与数据分两次写
+            n = offset - pos;
+        }
+        int whole = start == 0 && n == fs->block_size;
+        char *data = (char *) block_cache_get(&fs->cache, bmap_lookup(&fs->mapping, file, pos / fs->block_size), !whole);
+        if (pos < offset || buf == NULL) {
+            memset(data + start, 0, n);
+        } else {
+            memcpy(data + start, (const char *) buf + (pos - offset), n);
+        }
+        block_cache_put(&fs->cache, (dir_item *) data, 1);
+        pos += n;
+    }
+
+    mark_inode_dirty(fs, info.inode_id);
+    write_inode_table(fs);
+    close_file(fs, &info);
+    return len;
+}
+
+// 将 path 指向的目录中的所有项复制到 entries，由调用者 free
+// 复制出来后即可解锁，调用者处理这些项时可以继续调用其他操作
+int fs_read_dir(ext2emu *fs, const char *path, ext2emu_dirent **entries, int *count) {
+    ext2emu_stat st;
+    int error = fs_lookup_path(fs, path, &st);
+    if (error != EXT2EMU_OK) {
+        return error;
+    }
+    if (st.type == 0) {
+        return fail(EXT2EMU_ENOTDIR, path, strlen(path));
+    }
+
+    lock_dir(fs, st.inode_id, LOCK_SHARED);
+    inode *cur_inode = &fs->inode_table[st.inode_id];
+    int capacity = 64;
+    *entries = malloc(sizeof(ext2emu_dirent) * capacity);
+    *count = 0;
+    int finish = 0;
+    for (int i = 0; i < cur_inode->size && finish == 0; i++) {
+        dir_item *data = block_cache_get(&fs->cache, bmap_lookup(&fs->mapping, cur_inode, i), 1);
+        int pos = 0, result;
+        dir_entry item;
+        while ((result = dir_block_next(fs->dir_format, data, fs->block_size, &pos, &item)) == 1) {
+            if (*count == capacity) {
+                capacity *= 2;
+                *entries = realloc(*entries, sizeof(ext2emu_dirent) * capacity);
             }
+            ext2emu_dirent *entry = &(*entries)[(*count)++];
+            entry->inode_id = item.inode_id;
+            entry->type = item.type;
+            strcpy(entry->name, item.name);
         }
+        finish = result == -1;      // 到达末尾
+        block_cache_put(&fs->cache, data, 0);
     }
+    unlock_dir(fs, st.inode_id);
+    return EXT2EMU_OK;
 }
 
-// 创建文件夹
-void create_dir(char *path) {
-    // 错误处理
-    if (path[0] != '/') {
-        printf("create: cannot access \'%s\': No such directory\n", path);
-        return;
+// 创建文件，调用者已对父目录加锁
+static int create_file_locked(ext2emu *fs, const char *path, int length, int size, path_info *info) {
+    // 文件名过长
+    if (info->name_length > 120) {
+        return fail(EXT2EMU_ENAMETOOLONG, path, length);
     }
 
-    // 删除末尾的 "/"
-    if (path[strlen(path) - 1] == '/') {
-        path[strlen(path) - 1] = '\0';
+    // 父目录不存在
+    if (info->parent_id == -1) {
+        return fail(EXT2EMU_ENODIR, path, info->parent_length);
     }
 
-    char *parent_path = malloc(sizeof(char) * strlen(path) + 1);
-    char name[121];
-    int end = strlen(path);
-    while (path[end] != '/') {
-        end--;
+    // 父目录的 inode
+    inode *parent_inode = &fs->inode_table[info->parent_id];
+    if (parent_inode->file_type == 0) {
+        return fail(EXT2EMU_ENOTDIR, path, info->parent_length);
+    }
+
+    // 存在同名文件或文件夹
+    if (info->inode_id != -1) {
+        return fail(EXT2EMU_EEXIST, path, length);
+    }
+
+    // 分配 inode
+    int32_t inode_id = alloc_inode(fs, info->parent_id, 0);
+    if (inode_id == -1) {
+        return fail(EXT2EMU_ENOSPC, path, length);
+    }
+
+    inode *cur_inode = &fs->inode_table[inode_id];
+
+    // 根据 size 分配所有 block，文件内容初始为 0
+    // 之前用过这个 inode 的文件可能还在被不加锁地查找，见 fs_lookup_cached
+    fs_inode_change_begin(fs, inode_id);
+    __atomic_store_n(&cur_inode->size, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&cur_inode->file_type, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&cur_inode->tail, size % fs->block_size, __ATOMIC_RELEASE);
+    int grown = grow_inode(fs, inode_id, ceil(size / (double) fs->block_size));
+    fs_inode_change_end(fs, inode_id);
+    if (grown == -1) {
+        // 空间不足，释放刚刚分配的 inode
+        free_inode(fs, inode_id);
+        return fail(EXT2EMU_ENOSPC, path, length);
+    }
+    write_inode_table(fs);        // 更新索引表
+
+    // 更新父目录
+    int result = add_dir_item(fs, info->parent_id, info->name, inode_id, 0);
+    if (result != 0) {
+        // 父目录已满，释放刚刚分配的 inode 和 block
+        shrink_inode(fs, inode_id, 0);
+        free_inode(fs, inode_id);
+        return fail(result == -1 ? EXT2EMU_EDIRFULL : EXT2EMU_ENOSPC, path, length);
+    }
+    return EXT2EMU_OK;
+}
+
+// 创建文件
+int fs_create_file(ext2emu *fs, const char *path, int size) {
+    int length = strlen(path);
+
+    // 文件过大
+    if (size <= 0 || (uint32_t) size > fs->max_file_size) {
+        return fail(EXT2EMU_EFBIG, path, length);
+    }
+
+    // 起始路径非根目录
+    if (path[0] != '/') {
+        return fail(EXT2EMU_ENODIR, path, length);
+    }
+
+    path_info info;
+    resolve_path(fs, path, length, &info, LOCK_EXCLUSIVE);
+    int error = create_file_locked(fs, path, length, size, &info);
+    if (info.parent_id != -1) {
+        unlock_dir(fs, info.parent_id);
     }
-    int name_length = strlen(path) - end - 1;
+    return error;
+}
+
+// 创建文件夹，调用者已对父目录加锁
+static int create_dir_locked(ext2emu *fs, const char *path, int length, path_info *info) {
     // 文件夹名过长
-    if (name_length > 120) {
-        printf("create: cannot create directory \'%s\': file name cannot be longer than 120 Bytes\n", path);
-        free(parent_path);
-        return;
+    if (info->name_length > 120) {
+        return fail(EXT2EMU_ENAMETOOLONG, path, length);
     }
-    strncpy(name, path + end + 1, name_length + 1);
-    strncpy(parent_path, path, end + 1);
-    parent_path[end + 1] = '\0';
 
-    // 父目录的 inode_id
-    int32_t parent_inode_id = get_inode_id_by_path(parent_path);
-    if (parent_inode_id == -1) {
-        printf("create: cannot access \'%s\': No such directory\n", parent_path);
-        free(parent_path);
-        return;
+    // 父目录不存在
+    if (info->parent_id == -1) {
+        return fail(EXT2EMU_ENODIR, path, info->parent_length);
     }
 
     // 父目录的 inode
-    inode *parent_inode = &inode_table[parent_inode_id];
+    inode *parent_inode = &fs->inode_table[info->parent_id];
     if (parent_inode->file_type == 0) {
-        printf("create: cannot access \'%s\': Not a directory\n", parent_path);
-        free(parent_path);
-        return;
+        return fail(EXT2EMU_ENOTDIR, path, info->parent_length);
     }
 
-    // 查找是否存在同名文件或文件夹
-    for (int i = 0; i < parent_inode->size; i++) {
-        load_block(parent_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (block_buffer[j].item_count == 2) {
-                continue;
-            }
-            if (strcmp(block_buffer[j].name, name) == 0) {
-                printf("create: cannot create directory \'%s\': File exists\n", path);
-                free(parent_path);
-                return;
-            }
-            if (block_buffer[j].item_count == 1) {
-                break;
-            }
-        }
+    // 存在同名文件或文件夹
+    if (info->inode_id != -1) {
+        return fail(EXT2EMU_EEXIST, path, length);
     }
 
-    // 分配 inode
-    int32_t inode_id = alloc_inode();
+    // 分配 inode，目录数随之增加
+    int32_t inode_id = alloc_inode(fs, info->parent_id, 1);
     if (inode_id == -1) {
-        printf("create: cannot create file \'%s\': No enough space\n", path);
-        free(parent_path);
-        return;
+        return fail(EXT2EMU_ENOSPC, path, length);
     }
 
-    inode *cur_inode = &inode_table[inode_id];
+    inode *cur_inode = &fs->inode_table[inode_id];
 
-    cur_inode->size = 1;        // 已分配 block 数量
-    cur_inode->file_type = 1;   // 文件夹
+    fs_inode_change_begin(fs, inode_id);
+    __atomic_store_n(&cur_inode->size, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&cur_inode->file_type, 1, __ATOMIC_RELEASE);   // 文件夹，释放时据此减少目录数
 
-    // 分配 block
-    int32_t block_id = alloc_block();
+    // 分配 block，放在 inode 所在的块组
+    int32_t block_id = alloc_block(fs, inode_goal(fs, inode_id));
     if (block_id == -1) {
-        printf("create: cannot create file \'%s\': No enough space\n", path);
-        free_inode(inode_id);
-        free(parent_path);
-        return;
-    }
-
-    cur_inode->block_point[0] = block_id;
-    write_inode_table();
-
-    load_block(cur_inode->block_point[0]);
-
-    // 创建目录项 "."
-    block_buffer[0].inode_id = inode_id;
-    block_buffer[0].item_count = 0;
-    block_buffer[0].type = 1;
-    strcpy(block_buffer[0].name, ".");
-
-    // 创建目录项 ".."
-    block_buffer[1].inode_id = parent_inode_id;
-    block_buffer[1].item_count = 1;
-    block_buffer[1].type = 1;
-    strcpy(block_buffer[1].name, "..");
-
-    write_block(cur_inode->block_point[0]);
-
-    spBlock->dir_inode_count++;
-    write_super_block();
-
-    // 更新父目录的 inode
-    for (int i = 0; i < parent_inode->size; i++) {
-        load_block(parent_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (block_buffer[j].item_count == 1) {
-                // 末尾
-                block_buffer[j].item_count = 0;
-                if (j < 7) {
-                    block_buffer[j + 1].inode_id = inode_id;
-                    block_buffer[j + 1].item_count = 1;     // 末尾
-                    block_buffer[j + 1].type = 1;           // 文件夹
-                    strcpy(block_buffer[j + 1].name, name);
-                    write_block(parent_inode->block_point[i]);
-                } else {
-                    // 当前分配给父目录的 block 已满
-                    // 已达上限，释放刚刚分配的 inode 和 block
-                    if (parent_inode->size == 6) {
-                        printf("create: cannot create file \'%s\': No enough space in directory\n", path);
-                        block_buffer[j].item_count = 1;
-                        for (int k = 0; k < cur_inode->size; k++) {
-                            free_block(cur_inode->block_point[k]);
-                        }
-                        free_inode(inode_id);
-                        free(parent_path);
-                        return;
-                    }
-                    // 未达到上限
-                    write_block(parent_inode->block_point[i]);
-                    int new_block_id = alloc_block();   // 分配 block
-                    parent_inode->block_point[i + 1] = new_block_id;
-                    parent_inode->size++;
-                    load_block(new_block_id);
-                    block_buffer[0].inode_id = inode_id;
-                    block_buffer[0].item_count = 1;     // 末尾
-                    block_buffer[0].type = 1;           // 文件夹
-                    strcpy(block_buffer[0].name, name);
-                    write_block(parent_inode->block_point[i + 1]);
-                    write_inode_table();
-                }
-                free(parent_path);
-                return;
-            } else if (block_buffer[j].item_count == 2) {
-                //已删除位
-                block_buffer[j].inode_id = inode_id;
-                block_buffer[j].item_count = 0;         // 标记为可用
-                block_buffer[j].type = 1;               // 文件夹
-                strcpy(block_buffer[j].name, name);
-                write_block(parent_inode->block_point[i]);
-                free(parent_path);
-                return;
-            }
-        }
-    }
+        fs_inode_change_end(fs, inode_id);
+        free_inode(fs, inode_id);
+        return fail(EXT2EMU_ENOSPC, path, length);
+    }
+
+    bmap_append(&fs->mapping, cur_inode, (uint32_t *) &block_id, 1, NULL);    // 已分配 1 个 block
+    fs_inode_change_end(fs, inode_id);
+    mark_inode_dirty(fs, inode_id);
+    write_inode_table(fs);
+
+    dir_item buffer[MAX_DIR_ITEMS];
+    dir_entry entries[2] = {{inode_id, 1, 0, "."}, {info->parent_id, 1, 0, ".."}};     // 目录项 "." 和 ".."
+    dir_block_pack(fs->dir_format, buffer, fs->block_size, entries, 2, 1);
+    write_block(fs, block_id, buffer);
+
+    // 更新父目录
+    int result = add_dir_item(fs, info->parent_id, info->name, inode_id, 1);
+    if (result != 0) {
+        // 父目录已满，释放刚刚分配的 inode 和 block
+        free_block(fs, block_id);
+        free_inode(fs, inode_id);
+        return fail(result == -1 ? EXT2EMU_EDIRFULL : EXT2EMU_ENOSPC, path, length);
+    }
+    return EXT2EMU_OK;
 }
 
-// 删除文件
-void delete_file(char *path) {
+// 创建文件夹
+int fs_create_dir(ext2emu *fs, const char *path) {
+    int length = strlen(path);
+
     // 错误处理
     if (path[0] != '/') {
-        printf("delete: cannot access \'%s\': No such directory\n", path);
-        return;
+        return fail(EXT2EMU_ENODIR, path, length);
     }
 
-    char *parent_path = malloc(sizeof(char) * strlen(path) + 1);
-    char name[121];
-    int end = strlen(path);
-    while (path[end] != '/') {
-        end--;
+    // 忽略末尾的 "/"
+    if (length > 1 && path[length - 1] == '/') {
+        length--;
     }
-    int name_length = strlen(path) - end - 1;
+
+    path_info info;
+    resolve_path(fs, path, length, &info, LOCK_EXCLUSIVE);
+    int error = create_dir_locked(fs, path, length, &info);
+    if (info.parent_id != -1) {
+        unlock_dir(fs, info.parent_id);
+    }
+    return error;
+}
+
+// 删除文件，调用者已对父目录加锁
+static int delete_file_locked(ext2emu *fs, const char *path, int length, path_info *info) {
     // 不可能存在的文件名
-    if (name_length > 120) {
-        printf("delete: cannot access file \'%s\': file name cannot be longer than 120 Bytes\n", path);
-        free(parent_path);
-        return;
+    if (info->name_length > 120) {
+        return fail(EXT2EMU_ENAMETOOLONG, path, length);
     }
-    strncpy(name, path + end + 1, name_length + 1);
-    strncpy(parent_path, path, end + 1);
-    parent_path[end + 1] = '\0';
 
-    // 父目录的 inode_id
-    int32_t parent_inode_id = get_inode_id_by_path(parent_path);
-    if (parent_inode_id == -1) {
-        printf("delete: cannot access \'%s\': No such directory\n", parent_path);
-        free(parent_path);
-        return;
+    // 父目录不存在
+    if (info->parent_id == -1) {
+        return fail(EXT2EMU_ENODIR, path, info->parent_length);
     }
 
     // 父目录的 inode
-    inode *parent_inode = &inode_table[parent_inode_id];
+    inode *parent_inode = &fs->inode_table[info->parent_id];
     if (parent_inode->file_type == 0) {
-        printf("delete: cannot access \'%s\': Not a directory\n", parent_path);
-        free(parent_path);
-        return;
+        return fail(EXT2EMU_ENOTDIR, path, info->parent_length);
     }
 
-    // 目标文件的 inode_id
-    int32_t cur_inode_id = get_inode_id_by_path(path);
-    if (cur_inode_id == -1) {
-        printf("delete: cannot access \'%s\': No such file or directory\n", path);
-        free(parent_path);
-        return;
+    // 目标文件不存在
+    if (info->inode_id == -1) {
+        return fail(EXT2EMU_ENOENT, path, length);
     }
 
-    inode *cur_inode = &inode_table[cur_inode_id];
+    inode *cur_inode = &fs->inode_table[info->inode_id];
 
     // 目标为文件夹
     if (cur_inode->file_type == 1) {
-        printf("delete: cannot delete \'%s\': Is a directory\n", path);
-        free(parent_path);
-        return;
+        return fail(EXT2EMU_EISDIR, path, length);
     }
 
-    // 释放 block
-    for (int i = 0; i < cur_inode->size; i++) {
-        free_block(cur_inode->block_point[i]);
-    }
-    free_inode(cur_inode_id);   // 释放 inode
-
-    // 更新父目录的 inode
-    for (int i = 0; i < parent_inode->size; i++) {
-        load_block(parent_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (strcmp(block_buffer[j].name, name) == 0) {
-                if (block_buffer[j].item_count == 0) {
-                    block_buffer[j].item_count = 2;     // 不是末尾，标记为已删除
-                    write_block(parent_inode->block_point[i]);
-                } else if (block_buffer[j].item_count == 1) {   // 末尾
-                    // 寻找最后一个未删除文件
-                    if (j == 0) {
-                        j = 7;
-                        free_block(parent_inode->block_point[i]);
-                        parent_inode->size--;
-                        i--;
-                        load_block(parent_inode->block_point[i]);
-                    } else {
-                        j--;
-                    }
-                    while (block_buffer[j].item_count == 2) {
-                        j--;
-                        if (j < 0) {
-                            free_block(parent_inode->block_point[i]);
-                            parent_inode->size--;
-                            i--;
-                            load_block(parent_inode->block_point[i]);
-                            j = 7;
-                        }
-                    }
-                    block_buffer[j].item_count = 1;
-                    write_block(parent_inode->block_point[i]);
-                }
-                free(parent_path);
-                return;
-            }
-        }
+    // 先更新父目录，不加锁的查找不再找到它
+    remove_dir_item(fs, info->parent_id, info->name, info->block, info->slot);
+
+    // 释放 block 和 inode
+    fs_inode_change_begin(fs, info->inode_id);
+    shrink_inode(fs, info->inode_id, 0);
+    fs_inode_change_end(fs, info->inode_id);
+    free_inode(fs, info->inode_id);
+    return EXT2EMU_OK;
+}
+
+// 删除文件
+int fs_delete_file(ext2emu *fs, const char *path) {
+    int length = strlen(path);
+
+    // 错误处理
+    if (path[0] != '/') {
+        return fail(EXT2EMU_ENODIR, path, length);
+    }
+
+    path_info info;
+    resolve_path(fs, path, length, &info, LOCK_EXCLUSIVE);
+    int error = delete_file_locked(fs, path, length, &info);
+    if (info.parent_id != -1) {
+        unlock_dir(fs, info.parent_id);
     }
+    return error;
 }
 
 // 删除文件夹
-void delete_dir(char *path) {
+int fs_delete_dir(ext2emu *fs, const char *path) {
+    int length = strlen(path);
+
     // 错误处理
     if (path[0] != '/') {
-        printf("delete: cannot access \'%s\': No such directory\n", path);
-        return;
+        return fail(EXT2EMU_ENODIR, path, length);
     }
 
-    // 删除末尾的 "/"
-    if (path[strlen(path) - 1] == '/') {
-        path[strlen(path) - 1] = '\0';
+    // 忽略末尾的 "/"
+    if (length > 1 && path[length - 1] == '/') {
+        length--;
     }
 
-    char *parent_path = malloc(sizeof(char) * strlen(path) + 1);
-    char name[121];
-    int end = strlen(path);
-    while (path[end] != '/') {
-        end--;
-    }
-    int name_length = strlen(path) - end - 1;
+    // 独占文件系统，不需要对目录加锁
+    path_info info;
+    resolve_path(fs, path, length, &info, LOCK_NONE);
+
     // 不合法的文件名
-    if (name_length > 120) {
-        printf("delete: cannot access directory \'%s\': file name cannot be longer than 120 Bytes\n", path);
-        free(parent_path);
-        return;
+    if (info.name_length > 120) {
+        return fail(EXT2EMU_ENAMETOOLONG, path, length);
     }
-    strncpy(name, path + end + 1, name_length + 1);
-    strncpy(parent_path, path, end + 1);
-    parent_path[end + 1] = '\0';
 
     // 跳过删除 "." 和 ".."
-    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-        printf("delete: refusing to delete \'.\' or \'..\' directory: skipping \'%s\'\n", path);
-        free(parent_path);
-        return;
+    if (strcmp(info.name, ".") == 0 || strcmp(info.name, "..") == 0) {
+        return fail(EXT2EMU_EDOT, path, length);
     }
 
-    // 父目录的 inode_id
-    int32_t parent_inode_id = get_inode_id_by_path(parent_path);
-    if (parent_inode_id == -1) {
-        printf("delete: cannot access \'%s\': No such directory\n", parent_path);
-        free(parent_path);
-        return;
+    // 父目录不存在
+    if (info.parent_id == -1) {
+        return fail(EXT2EMU_ENODIR, path, info.parent_length);
     }
 
     // 父目录的 inode
-    inode *parent_inode = &inode_table[parent_inode_id];
+    inode *parent_inode = &fs->inode_table[info.parent_id];
     if (parent_inode->file_type == 0) {
-        printf("delete: cannot access \'%s\': Not a directory\n", parent_path);
-        free(parent_path);
-        return;
+        return fail(EXT2EMU_ENOTDIR, path, info.parent_length);
     }
 
-    // 目标文件的 inode_id
-    int32_t cur_inode_id = get_inode_id_by_path(path);
-    if (cur_inode_id == -1) {
-        printf("delete: cannot access \'%s\': No such file or directory\n", path);
-        free(parent_path);
-        return;
+    // 目标文件不存在
+    if (info.inode_id == -1) {
+        return fail(EXT2EMU_ENOENT, path, length);
     }
 
     // 跳过删除 "/"
-    if (cur_inode_id == 0) {
-        printf("delete: refusing to delete \'/\': skipping \'%s\'\n", path);
-        free(parent_path);
-        return;
+    if (info.inode_id == 0) {
+        return fail(EXT2EMU_EROOT, path, length);
     }
 
-    // 目标文件夹的 inode
-    inode *cur_inode = &inode_table[cur_inode_id];
-
     // 目标文件不是文件夹
-    if (cur_inode->file_type == 0) {
-        printf("delete: cannot delete \'%s\': Is a file\n", path);
-        free(parent_path);
-        return;
+    if (fs->inode_table[info.inode_id].file_type == 0) {
+        return fail(EXT2EMU_EISFILE, path, length);
     }
 
-    // 删除文件夹下的文件和文件夹
-    for (int i = 0; i < cur_inode->size; i++) {
-        load_block(cur_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            // 跳过 "."、".." 和已删除
-            if (strcmp(block_buffer[j].name, ".") != 0 && strcmp(block_buffer[j].name, "..") != 0 && block_buffer[j].item_count != 2) {
-                char *sub_path = malloc(sizeof(char) * (strlen(path) + 121));   // 欲删除文件的完整路径
-                strcpy(sub_path, path);
-                if (sub_path[strlen(path) - 1] != '/') {
-                    strcat(sub_path, "/");
-                }
-                strcat(sub_path, block_buffer[j].name);
-
-                if (block_buffer[j].type == 1) {
-                    // 删除文件夹
-                    delete_dir(sub_path);
-                } else {
-                    // 删除文件
-                    delete_file(sub_path);
-                }
-                load_block(cur_inode->block_point[i]);  // 重新加载
-                free(sub_path);
-            }
-            if (block_buffer[j].item_count == 1) {  // 末尾
-                break;
-            }
-        }
+    // 先更新父目录，不加锁的查找不再找到它
+    remove_dir_item(fs, info.parent_id, info.name, info.block, info.slot);
+
+    // 删除整棵子树
+    delete_tree(fs, info.inode_id);
+    return EXT2EMU_OK;
+}
+
+// 移动文件，调用者已对源文件的父目录和目标目录加锁
+static int move_locked(ext2emu *fs, const char *from, int from_length, const char *to, int to_length,
+                       path_info *from_info, int32_t to_inode_id) {
+    // 加锁前源文件可能已被移动或删除，重新查找
+    if (from_info->name_length > 0) {
+        from_info->inode_id = lookup_dir_item(fs, from_info->parent_id, from_info->name, &from_info->block, &from_info->slot);
     }
 
-    // 释放 block
-    for (int i = 0; i < cur_inode->size; i++) {
-        free_block(cur_inode->block_point[i]);
-    }
-
-    free_inode(cur_inode_id);                       // 释放 inode
-
-    spBlock->dir_inode_count--;                     // 更新
-    write_super_block();
-
-    // 更新父目录的 inode
-    for (int i = 0; i < parent_inode->size; i++) {
-        load_block(parent_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (strcmp(block_buffer[j].name, name) == 0) {
-                if (block_buffer[j].item_count == 0) {
-                    // 未到末尾，标记为已删除
-                    block_buffer[j].item_count = 2;
-                    write_block(parent_inode->block_point[i]);
-                } else if (block_buffer[j].item_count == 1) {
-                    // 寻找最后一个未删除文件
-                    j--;
-                    while (block_buffer[j].item_count == 2) {
-                        j--;
-                        if (j < 0) {
-                            free_block(parent_inode->block_point[i]);
-                            parent_inode->size--;
-                            i--;
-                            load_block(parent_inode->block_point[i]);
-                            j = 7;
-                        }
-                    }
-                    block_buffer[j].item_count = 1;
-                    write_block(parent_inode->block_point[i]);
-                }
-                free(parent_path);
-                return;
-            }
-        }
+    // 源文件不存在
+    if (from_info->inode_id == -1) {
+        return fail(EXT2EMU_ENOENT, from, from_length);
+    }
+
+    inode *cur_inode = &fs->inode_table[from_info->inode_id];
+    if (cur_inode->file_type == 1) {
+        return fail(EXT2EMU_EISDIR, from, from_length);
+    }
+
+    // 目标路径
+    if (to_inode_id == -1) {
+        return fail(EXT2EMU_ENODIR, to, to_length);
+    }
+
+    // 目标路径不是文件夹
+    if (fs->inode_table[to_inode_id].file_type == 0) {
+        return fail(EXT2EMU_ENOTDIR, to, to_length);
+    }
+
+    // 查找目标路径下是否存在同名文件或文件夹
+    int block, slot;
+    if (lookup_dir_item(fs, to_inode_id, from_info->name, &block, &slot) != -1) {
+        return fail(EXT2EMU_EEXIST, from, from_length);
+    }
+
+    // 移动先更新目标路径，再更新源路径
+    int result = add_dir_item(fs, to_inode_id, from_info->name, from_info->inode_id, 0);
+    if (result != 0) {
+        return fail(result == -1 ? EXT2EMU_EDIRFULL : EXT2EMU_ENOSPC, from, from_length);
     }
+    remove_dir_item(fs, from_info->parent_id, from_info->name, from_info->block, from_info->slot);
+    return EXT2EMU_OK;
 }
 
 // 移动文件（不可移动文件夹）
-void move(char *from, char *to) {
+int fs_move(ext2emu *fs, const char *from, const char *to) {
+    int from_length = strlen(from);
+    int to_length = strlen(to);
+
     // 错误处理
     if (from[0] != '/') {
-        printf("move: cannot access \'%s\': No such directory\n", from);
-        return;
+        return fail(EXT2EMU_ENODIR, from, from_length);
     }
     if (to[0] != '/') {
-        printf("move: cannot access \'%s\': No such directory\n", to);
-        return;
+        return fail(EXT2EMU_ENODIR, to, to_length);
     }
 
-    char *from_parent_path = malloc(sizeof(char) * strlen(from) + 1);
-    char name[121];
-    int end = strlen(from);
-    while (from[end] != '/') {
-        end--;
-    }
-    int name_length = strlen(from) - end - 1;
+    path_info from_info;
+    resolve_path(fs, from, from_length, &from_info, LOCK_NONE);
+
     // 不合法文件名
-    if (name_length > 120) {
-        printf("move: cannot access directory \'%s\': file name cannot be longer than 120 Bytes\n", from);
-        free(from_parent_path);
-        return;
+    if (from_info.name_length > 120) {
+        return fail(EXT2EMU_ENAMETOOLONG, from, from_length);
     }
-    strncpy(name, from + end + 1, name_length + 1);
-    strncpy(from_parent_path, from, end + 1);
-    from_parent_path[end + 1] = '\0';
 
-    // 源文件的父目录的 inode_id
-    int32_t parent_inode_id = get_inode_id_by_path(from_parent_path);
-    if (parent_inode_id == -1) {
-        printf("move: cannot access \'%s\': No such directory\n", from_parent_path);
-        free(from_parent_path);
-        return;
+    // 源文件的父目录不存在
+    if (from_info.parent_id == -1) {
+        return fail(EXT2EMU_ENODIR, from, from_info.parent_length);
     }
 
     // 源文件的父目录的 inode
-    inode *from_parent_inode = &inode_table[parent_inode_id];
+    inode *from_parent_inode = &fs->inode_table[from_info.parent_id];
     if (from_parent_inode->file_type == 0) {
-        printf("move: cannot access \'%s\': Not a directory\n", from_parent_path);
-        free(from_parent_path);
-        return;
+        return fail(EXT2EMU_ENOTDIR, from, from_info.parent_length);
     }
 
-    // 源文件的 inode
-    int32_t cur_inode_id = get_inode_id_by_path(from);
-    if (cur_inode_id == -1) {
-        printf("move: cannot access \'%s\': No such file or directory\n", from);
-        free(from_parent_path);
-        return;
-    }
+    path_info to_info;
+    resolve_path(fs, to, to_length, &to_info, LOCK_NONE);
+    int32_t to_inode_id = to_info.inode_id;
 
-    inode *cur_inode = &inode_table[cur_inode_id];
-    if (cur_inode->file_type == 1) {
-        printf("move: cannot move file \'%s\': Is a directory\n", from);
-        free(from_parent_path);
-        return;
+    // 涉及两个目录，按 inode_id 从小到大加锁
+    int32_t first = from_info.parent_id, second = -1;
+    if (to_inode_id != -1 && to_inode_id != first && fs->inode_table[to_inode_id].file_type == 1) {
+        second = to_inode_id;
+        if (second < first) {
+            second = first;
+            first = to_inode_id;
+        }
     }
+    lock_dir(fs, first, LOCK_EXCLUSIVE);
+    if (second != -1) {
+        lock_dir(fs, second, LOCK_EXCLUSIVE);
+    }
+    int error = move_locked(fs, from, from_length, to, to_length, &from_info, to_inode_id);
+    if (second != -1) {
+        unlock_dir(fs, second);
+    }
+    unlock_dir(fs, first);
+    return error;
+}
 
-    // 目标路径的 inode_id
-    int32_t to_inode_id = get_inode_id_by_path(to);
-    if (to_inode_id == -1) {
-        printf("move: cannot access \'%s\': No such directory\n", to);
-        free(from_parent_path);
-        return;
+// 整理目录，返回剩余的已删除项数，大于 0 时需要再次调用
+int fs_compact(ext2emu *fs, const char *path) {
+    int length = strlen(path);
+
+    // 错误处理
+    if (path[0] != '/') {
+        return fail(EXT2EMU_ENOENT, path, length);
     }
 
-    // 目标路径的 inode
-    inode *to_inode = &inode_table[to_inode_id];
+    path_info info;
+    resolve_path(fs, path, length, &info, LOCK_NONE);
+
+    // 目标路径不存在
+    if (info.inode_id == -1) {
+        return fail(EXT2EMU_ENOENT, path, length);
+    }
 
     // 目标路径不是文件夹
-    if (to_inode->file_type == 0) {
-        printf("move: cannot access \'%s\': Not a directory\n", to);
-        free(from_parent_path);
-        return;
+    if (fs->inode_table[info.inode_id].file_type == 0) {
+        return fail(EXT2EMU_ENOTDIR, path, length);
     }
 
-    // 查找目标路径下是否存在同名文件或文件夹
-    for (int i = 0; i < to_inode->size; i++) {
-        load_block(to_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (block_buffer[j].item_count == 2) {
-                continue;
-            }
-            if (strcmp(block_buffer[j].name, name) == 0) {
-                printf("move: cannot move file \'%s\': File exists\n", from);
-                free(from_parent_path);
-                return;
-            }
-            if (block_buffer[j].item_count == 1) {
-                break;
-            }
+    lock_dir(fs, info.inode_id, LOCK_EXCLUSIVE);
+    int dead = compact_dir(fs, info.inode_id);
+    unlock_dir(fs, info.inode_id);
+    return dead;
+}
+
+// 将超级块、位图、索引表和缓存中修改过的 block 作为一个事务写入日志并提交，返回写入的 block 数
+// 命令按 JOURNAL_COMMAND_BLOCKS 和 JOURNAL_COMMAND_META 预留空间，正常不会超出日志；
+// 修复大磁盘时所有位图都被修改，可能超出，此时放弃这个事务，返回 0，由调用者直接写回原位置
+static uint32_t commit_journal(ext2emu *fs) {
+    journal_begin(&fs->journal);
+    int full = 0;
+    for (uint32_t i = 0; i < fs->meta_blocks && !full; i++) {
+        if (fs->meta_dirty[i]) {
+            full = journal_log(&fs->journal, fs->meta_location[i], fs->meta + i * fs->block_size, fs->block_size) == -1;
         }
     }
+    int32_t *ids = malloc(sizeof(int32_t) * fs->cache.frame_count);
+    int count = block_cache_dirty_blocks(&fs->cache, ids);
+    for (int i = 0; i < count && !full; i++) {
+        dir_item *data = block_cache_get(&fs->cache, ids[i], 1);
+        full = journal_log(&fs->journal, ids[i], data, fs->block_size) == -1;
+        block_cache_put(&fs->cache, data, 0);
+    }
+    free(ids);
+    if (full) {
+        journal_begin(&fs->journal);    // 描述块还没有写入，已写入日志的内容不会被重放
+        return 0;
+    }
+    return journal_commit(&fs->journal);
+}
 
-    // 移动先更新目标路径的 inode，再更新源路径的 inode
-    // 更新目标路径的 inode
-    int finish = 0;     // 标志位，用于快速跳出多重循环
-    for (int i = 0; i < to_inode->size && finish == 0; i++) {
-        load_block(to_inode->block_point[i]);
-        for (int j = 0; j < 8 && finish == 0; j++) {
-            if (block_buffer[j].item_count == 1) {  // 找到末尾
-                block_buffer[j].item_count = 0;
-                if (j < 7) {
-                    // 未满
-                    block_buffer[j + 1].inode_id = cur_inode_id;
-                    block_buffer[j + 1].item_count = 1;     // 末尾
-                    block_buffer[j + 1].type = 0;           // 文件
-                    strcpy(block_buffer[j + 1].name, name);
-                    write_block(to_inode->block_point[i]);
-                } else {
-                    // 当前分配给目标路径的 block 已满
-                    // 达到上限，取消移动
-                    if (to_inode->size == 6) {
-                        printf("move: cannot move file \'%s\': No enough space in directory\n", from);
-                        block_buffer[j].item_count = 1;
-                        free(from_parent_path);
-                        return;
-                    }
-                    // 未达到上限
-                    write_block(to_inode->block_point[i]);
-                    int block_id = alloc_block();       // 分配 block
-                    to_inode->block_point[i + 1] = block_id;
-                    to_inode->size++;
-                    load_block(block_id);
-                    block_buffer[0].inode_id = cur_inode_id;
-                    block_buffer[0].item_count = 1;     // 末尾
-                    block_buffer[0].type = 0;           // 文件
-                    strcpy(block_buffer[0].name, name);
-                    write_block(to_inode->block_point[i + 1]);
-                    write_inode_table();
-                }
-                finish = 1;
-            } else if (block_buffer[j].item_count == 2) {
-                // 已删除位
-                block_buffer[j].inode_id = cur_inode_id;
-                block_buffer[j].item_count = 0;
-                block_buffer[j].type = 0;
-                strcpy(block_buffer[j].name, name);
-                write_block(to_inode->block_point[i]);
-                finish = 1;
-            }
-        }
+// 将内存中的修改全部写回磁盘，调用者独占 ns_lock
+void fs_checkpoint(ext2emu *fs) {
+    // 有日志时先将所有修改作为一个事务写入日志并提交
+    uint32_t logged = 0;
+    if (fs->journaling) {
+        logged = commit_journal(fs);
+        fs->group_commands = 0;
     }
 
-    // 更新源路径的 inode
-    for (int i = 0; i < from_parent_inode->size; i++) {
-        load_block(from_parent_inode->block_point[i]);
-        for (int j = 0; j < 8; j++) {
-            if (strcmp(block_buffer[j].name, name) == 0) {
-                if (block_buffer[j].item_count == 0) {  // 不是末尾，标记为已删除
-                    block_buffer[j].item_count = 2;
-                    write_block(from_parent_inode->block_point[i]);
-                } else if (block_buffer[j].item_count == 1) {
-                    // 寻找最后一个未删除文件
-                    if (j == 0) {
-                        j = 7;
-                        free_block(from_parent_inode->block_point[i]);
-                        from_parent_inode->size--;
-                        i--;
-                        load_block(from_parent_inode->block_point[i]);
-                    } else {
-                        j--;
-                    }
-                    while (block_buffer[j].item_count == 2) {
-                        j--;
-                        if (j < 0) {
-                            free_block(from_parent_inode->block_point[i]);
-                            from_parent_inode->size--;
-                            i--;
-                            load_block(from_parent_inode->block_point[i]);
-                            j = 7;
-                        }
-                    }
-                    block_buffer[j].item_count = 1;
-                    write_block(from_parent_inode->block_point[i]);
-                }
-                free(from_parent_path);
-                return;
-            }
-        }
+    block_cache_flush(&fs->cache);        // 写回缓存中的脏 block
+    write_super_block(fs);
+    flush_inode_table(fs);
+    disk_sync(&fs->disk);                // fflush + fsync 或 msync
+
+    // 已全部写回原位置，事务不再需要重放
+    if (logged > 0) {
+        journal_clear(&fs->journal);
     }
 }
 
-// 退出文件系统
-void shutdown() {
-    write_super_block();
-    write_inode_table();
-    printf("############################# GOODBYE! #############################\n");
-    fclose(fp);
-}
-
-void print_help_info()
-{
-    printf("create:\n"
-           "Usage: create SIZE FILE\n"
-           "  or:  create OPTION DIRECTORY\n"
-           "Create the FILE or DIRECTORY, if it does not already exist.\n"
-           "  -d\tcreate directory\n\n"
-           "delete:\n"
-           "Usage: delete OPTION FILE\n"
-           "Delete the FILE\n"
-           "  -d\tdelete directory and its contents recursively.\n"
-           "  -f\tdelete file\n\n"
-           "df:\n"
-           "Usage: df\n"
-           "Show information about the file system.\n\n"
-           "ls:\n"
-           "Usage: ls FILE\n"
-           "List information about the FILEs.\n\n"
-           "move:\n"
-           "Usage: move SOURCE DESTINATION\n"
-           "move SOURCE to DESTINATION.\n\n"
-           "shutdown:\n"
-           "Usage: shutdown\n"
-           "Shut down the file system.\n");
+// 退出文件系统，此时不能再有其他线程在使用 fs
+void fs_shutdown(ext2emu *fs) {
+    fs_checkpoint(fs);
+    if (fs->meta != disk_map(&fs->disk, 0)) {
+        free(fs->meta);     // mmap 方式下没有块组时 meta 位于映射中
+    }
+    if (fs->gdt_blocks == 0) {
+        free(fs->groups);
+    }
+    free(fs->meta_location);
+    disk_close(&fs->disk);
+    dir_index_free(&fs->dir_index);
+    scratch_free(&fs->scratch);
+    block_cache_destroy(&fs->cache);
+    dcache_destroy(&fs->dcache);
+    pthread_rwlock_destroy(&fs->ns_lock);
+    for (uint32_t i = 0; i < fs->inode_count; i++) {
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+    }
+    free(fs->inode_locks);
+    free(fs->inode_seq);
+    free(fs->meta_dirty);
+    pthread_mutex_destroy(&fs->meta_lock);
+    pthread_cond_destroy(&fs->command_done);
+    pthread_mutex_destroy(&fs->scratch_lock);
 }
@@ -16,15 +16,33 @@
     and one group descriptor. then why don't we put them together \
     and make them one single structure as "super_block"? that's \
     how i handle with it.
+//  a larger file system is split into block groups like ext2: \
+    each group has its own block bitmap, inode bitmap and inode table \
+    at its start, described by a group_desc after the super block; \
+    a small one is still the single group above.
 
 
+#ifndef EXT2_EMULATOR_FS_OPERATION_H
+#define EXT2_EMULATOR_FS_OPERATION_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include "ext2emu.h"
 
 #define BLOCK_SIZE 1024
 // 1KB.
+#define INODE_NUM 1024
+#define BLOCK_NUM 4096
+// 4MB.
+// the geometry of an image formatted without one, and of images formatted before it could be chosen.
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 4096
+// the block size is 1KB, 2KB or 4KB.
+#define MAX_INODE_NUM (1 << 18)
+#define MAX_IMAGE_SIZE (1u << 31)
+// 2GB, block offsets are 32 bits.
 
 typedef struct inode {
     // 32 bytes;
@@ -32,31 +50,84 @@ typedef struct inode {
     // the number of blocks it have.
     uint16_t file_type;
     // 1->dir; 0->file;
-    uint16_t link;  // it doesn't matter if you \
-        don't know what this variable means.
+    uint16_t tail;
+    // the bytes used in the last block of a file, 0 means all of it.
     uint32_t block_point[6];
-    // the blocks belonging to this inode.
+    // the blocks belonging to this inode, see bmap.h:
+    // with block pointers, all of them are direct with at most 6 blocks, otherwise the first 4 are direct,
+    // block_point[4] is a single indirect block and block_point[5] a double indirect block;
+    // with extents, up to 3 runs of contiguous blocks, or the blocks holding more of them.
 } inode;
 
+#define INODES_PER_BLOCK(block_size) ((block_size) / sizeof(inode))
+
+#define INODE_BLOCKS 6
+// the pointers in an inode.
+#define DIRECT_BLOCKS 4
+#define INDIRECT_BLOCK 4
+#define DOUBLE_INDIRECT_BLOCK 5
+#define POINTERS_PER_BLOCK(block_size) ((block_size) / sizeof(uint32_t))
+// 256 block numbers in an indirect block of 1KB.
+#define FILE_MAX_BLOCKS(block_size) \
+    (DIRECT_BLOCKS + POINTERS_PER_BLOCK(block_size) + POINTERS_PER_BLOCK(block_size) * POINTERS_PER_BLOCK(block_size))
+// about 64MB with 1KB blocks; the file size is also kept below 2GB, see fs->max_file_size.
+
 typedef struct super_block {
-    // 656 bytes;
+    // 708 bytes;
     int32_t system_mod;
     // use system_mod to check if it \
         is the first time to run the FS.
     int32_t free_block_count;
-    // 2^12; 4096;
     int32_t free_inode_count;
-    // 1024;
     int32_t dir_inode_count;
-    uint32_t block_map[128];
-    // 512 bytes;
-    uint32_t inode_map[32];
-    // 128 bytes;
+    uint64_t block_map[64];
+    // 512 bytes, 4096 blocks;
+    uint64_t inode_map[16];
+    // 128 bytes, 1024 inodes;
+    // bit n is bit (n % 64) of word (n / 64), see bitmap.h;
+    // a larger FS keeps its bitmaps in their own blocks, see block_map_start.
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    // the journal region, in blocks, see journal.h;
+    // 0 blocks means the FS has no journal.
+    uint32_t inode_format;
+    // how block_point maps the blocks of an inode, MAP_POINTERS or MAP_EXTENTS, see bmap.h;
+    // images formatted before extents existed have 0 here, which is MAP_POINTERS.
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t inode_count;
+    // the geometry chosen at format time;
+    // images formatted before it could be chosen have 0 here, and BLOCK_SIZE, BLOCK_NUM and INODE_NUM.
+    uint32_t block_map_start;
+    uint32_t inode_map_start;
+    // the first blocks of the bitmaps, 0 if they fit in block_map and inode_map above;
+    uint32_t inode_table_start;
+    // the first block of the inode table, right after the bitmaps; data blocks follow it;
+    // with block groups, all three are those of group 0.
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t group_count;
+    // 0 without block groups; blocks_per_group is the bits in one bitmap block.
+    uint32_t dir_format;
+    // how the entries of a directory fill its blocks, DIR_ITEMS or DIR_RECORDS, see dir_block.h;
+    // images formatted before records existed have 0 here, which is DIR_ITEMS.
 } sp_block;
-// 1 block;
+// 1 block, the first 1KB of block 0;
+
+typedef struct group_desc {
+    // 32 bytes; the descriptors fill the blocks right after the super block.
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    // where the group keeps them, at its start; group 0 has the super block and the descriptors before them.
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t used_dirs_count;
+    uint32_t reserved[2];
+} group_desc;
 
 typedef struct dir_item {
-    // the content of folders.
+    // the content of folders formatted before dir_record, see dir_block.h.
     // 128 bytes;
     uint32_t inode_id;
     uint16_t item_count;
@@ -68,21 +139,80 @@ typedef struct dir_item {
     char name[121];
 } dir_item;
 
-FILE *fp;
-sp_block *spBlock;
-inode inode_table[1024];
-dir_item block_buffer[8];
+#define DIR_ITEMS_PER_BLOCK(block_size) ((block_size) / sizeof(dir_item))
+#define MAX_DIR_ITEMS DIR_ITEMS_PER_BLOCK(MAX_BLOCK_SIZE)
+// enough dir_items for a buffer of one block.
+
+typedef struct path_info {
+    // the result of resolve_path.
+    int32_t parent_id;
+    // -1 if the parent directory does not exist.
+    int32_t inode_id;
+    // -1 if the file does not exist;
+    // the parent itself if the path ends with '/'.
+    int32_t block;
+    int32_t slot;
+    // where the entry of the file is in its parent, see dir_block.h.
+    int parent_length;
+    // the parent path is the first parent_length bytes of the path.
+    int name_length;
+    char name[121];
+    // empty if the name is longer than 120 bytes.
+} path_info;
 
+// every function below works on the image fs, see fs_context.h.
 
-void print_information();
 // do some pre-work when you run the FS.
-void fs_init();
-void ls(char *path);
-void create_file(char *path,int size);
-void create_dir(char *path);
-void delete_file(char *path);
-void delete_dir(char *path);
-void move(char *from,char *to);
-void shutdown();
-
-void print_help_info();
\ No newline at end of file
+// backend: DISK_STDIO or DISK_MMAP, see disk.h;
+// formats the image if format is 1 or it has no FS yet, and tells it by fs->formatted;
+// a new FS maps the blocks of its inodes by extents if extents is 1,
+// and has the given geometry, or the default one if it is NULL, see ext2emu_mkfs.
+int fs_init(ext2emu *fs, const char *path, int backend, int format, int extents, const ext2emu_geometry *geometry);
+// fill the geometry, the layout and the journal of a new FS into super,
+// returns EXT2EMU_EINVAL if the geometry is not supported.
+int fs_plan_geometry(const ext2emu_geometry *geometry, sp_block *super);
+// 1 if the block holds the super block, the descriptors, or a bitmap or the inode table of its group.
+int fs_is_meta_block(ext2emu *fs, uint32_t block_id);
+// the bit of an inode in fs->inode_map, whose groups each start a new block.
+uint32_t fs_inode_bit(ext2emu *fs, int32_t inode_id);
+// the commands below return EXT2EMU_OK or an error code, see ext2emu.h.
+// call them between fs_begin_command and fs_end_command, or with fs->ns_lock held shared if they only read.
+int fs_lookup_path(ext2emu *fs, const char *path, ext2emu_stat *st);
+// the same without any lock, when every component of the path is in the dcache and the file exists;
+// returns 1 if it filled st, 0 to fall back to fs_lookup_path.
+int fs_lookup_cached(ext2emu *fs, const char *path, ext2emu_stat *st);
+// copy the entries of a directory into a malloc'ed array, so they can be used after the locks are released.
+int fs_read_dir(ext2emu *fs, const char *path, ext2emu_dirent **entries, int *count);
+void fs_get_statfs(ext2emu *fs, ext2emu_fsstat *st);
+int fs_create_file(ext2emu *fs, const char *path, int size);
+int fs_create_dir(ext2emu *fs, const char *path);
+int fs_delete_file(ext2emu *fs, const char *path);
+// needs fs_begin_command(fs, 1).
+int fs_delete_dir(ext2emu *fs, const char *path);
+int fs_move(ext2emu *fs, const char *from, const char *to);
+// read up to len bytes of a file from offset into buf, returns the number of bytes read or an error code.
+int fs_read_file(ext2emu *fs, const char *path, uint32_t offset, void *buf, uint32_t len);
+// write len bytes of buf, or zeros if buf is NULL, into a file at offset, growing it if needed; returns len or an error code.
+// a command should write at most JOURNAL_DATA_BLOCKS blocks, see journal.h.
+int fs_write_file(ext2emu *fs, const char *path, uint32_t offset, const void *buf, uint32_t len);
+// pack the entries of a directory and release its empty blocks.
+// returns the number of entries still to be moved, a large directory takes several commands.
+int fs_compact(ext2emu *fs, const char *path);
+// the part of the path arguments the last error of this thread is about, see ext2emu_error_path.
+int fs_get_error_path(const char **path);
+// the size and the tail of an inode change between them, so that fs_lookup_cached sees both or falls back.
+void fs_inode_change_begin(ext2emu *fs, int32_t inode_id);
+void fs_inode_change_end(ext2emu *fs, int32_t inode_id);
+// write everything in memory back to the disk. needs fs->ns_lock held exclusively.
+void fs_checkpoint(ext2emu *fs);
+void fs_set_sync_policy(ext2emu *fs, int policy);
+void fs_set_alloc_mode(ext2emu *fs, int mode);
+void fs_set_compact_threshold(ext2emu *fs, int percent);
+// call it before every command that changes the FS; exclusive is 1 to keep every other command out.
+void fs_begin_command(ext2emu *fs, int exclusive);
+// call it after every command that changes the FS, see SYNC_COMMAND. Also releases the scratch memory of the command.
+void fs_end_command(ext2emu *fs);
+// write everything back and close the disk file.
+void fs_shutdown(ext2emu *fs);
+
+#endif //EXT2_EMULATOR_FS_OPERATION_H
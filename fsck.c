@@ -0,0 +1,861 @@
+#include "fsck.h"
+#include "fs_context.h"
+#include "bitmap.h"
+#include "bmap.h"
+#include "dir_block.h"
+#include <stdarg.h>
+#include <unistd.h>
+
+// 一个目录的解析结果，只保留 "." 和 ".." 以外未删除的目录项
+typedef struct fsck_dir {
+    int32_t dot;
+    int32_t dotdot;
+    // "." 和 ".." 指向的 inode，-1 表示缺少
+    int block_count;
+    int index_count;
+    uint32_t *blocks;
+    // 合法且在末尾之前的 block，之后是合法的间接 block
+    int item_count;
+    int item_capacity;
+    dir_item *items;
+    uint8_t *dropped;
+    // 修复时丢弃的目录项
+    uint8_t rebuild;
+    // 修复时需要重写整个目录
+    fsck_log log;
+    // 解析时发现的问题，遍历到该目录时才计入结果
+} fsck_dir;
+
+typedef struct fsck_state {
+    ext2emu *fs;
+    uint32_t data_end;
+    // 数据区的末尾，之后是日志
+    // 以下数组按 inode_id 或 block 号下标，长度随文件系统的几何参数分配
+    fsck_dir **dirs;
+    // 每个目录的解析结果，NULL 表示不是目录或没有可用的 block
+    uint8_t *reachable;
+    int32_t *parent;
+    int *block_count;
+    int *index_count;
+    uint32_t **blocks;
+    // 每个可达 inode 的合法 block，之后是合法的间接 block，修复时据此重写 block_point
+    fsck_log *file_logs;
+    // 扫描文件的 block 时发现的问题，按 inode_id 的顺序计入结果
+    uint32_t *claims;
+    // 引用每个 block 的次数
+    int32_t *owner;
+    // 引用每个 block 的最小的 inode_id
+    int32_t next;
+    // 并行扫描时下一个待领取的 inode
+    void (*work)(struct fsck_state *state, int32_t inode_id);
+    fsck_log *log;
+} fsck_state;
+
+static void log_problem(fsck_log *log, const char *format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length >= (int) sizeof(message)) {
+        length = sizeof(message) - 1;
+    }
+    if (log->length + length + 1 > log->capacity) {
+        log->capacity = log->capacity == 0 ? 4096 : log->capacity * 2;
+        log->text = realloc(log->text, log->capacity);
+    }
+    memcpy(log->text + log->length, message, length + 1);
+    log->length += length + 1;
+    log->count++;
+}
+
+// 将 src 中的消息移到 dst 末尾
+static void log_append(fsck_log *dst, fsck_log *src) {
+    const char *message = src->text;
+    for (uint32_t i = 0; i < src->count; i++) {
+        log_problem(dst, "%s", message);
+        message += strlen(message) + 1;
+    }
+    fsck_log_free(src);
+}
+
+void fsck_log_free(fsck_log *log) {
+    free(log->text);
+    log->text = NULL;
+    log->length = log->capacity = 0;
+    log->count = 0;
+}
+
+// 可以分配给文件和目录的 block：不是各块组的位图和索引表，也不在日志中
+static int valid_block(fsck_state *state, uint32_t block_id) {
+    return block_id < state->data_end && !fs_is_meta_block(state->fs, block_id);
+}
+
+static int valid_name(const char *name) {
+    return memchr(name, '\0', 121) != NULL && name[0] != '\0' && strchr(name, '/') == NULL;
+}
+
+static void *worker(void *arg) {
+    fsck_state *state = arg;
+    int32_t inode_id;
+    while ((inode_id = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < (int32_t) state->fs->inode_count) {
+        state->work(state, inode_id);
+    }
+    return NULL;
+}
+
+// 多个线程依次领取 inode，对每个 inode 调用 work，全部完成后返回
+static void for_each_inode(fsck_state *state, void (*work)(fsck_state *state, int32_t inode_id)) {
+    state->next = 0;
+    state->work = work;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count > FSCK_THREADS) {
+        thread_count = FSCK_THREADS;
+    }
+    pthread_t threads[FSCK_THREADS];
+    int started = 0;
+    for (long i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, worker, state) == 0) {
+            started++;
+        }
+    }
+    worker(state);      // 当前线程同样参与
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void free_dir(fsck_dir *d) {
+    free(d->blocks);
+    free(d->items);
+    free(d->dropped);
+    free(d);
+}
+
+// 一组 block 号，先是数据 block，之后是间接 block
+typedef struct block_list {
+    uint32_t *ids;
+    int count;
+    int index_count;
+    uint32_t *index_ids;
+} block_list;
+
+// 记录间接 block indirect 指向的前 count 个 block，跳过超出范围的 block
+static void read_indirect(fsck_state *state, int32_t inode_id, uint32_t indirect, uint32_t count, block_list *list,
+                          fsck_log *log) {
+    if (!valid_block(state, indirect)) {
+        log_problem(log, "inode %d: indirect block %u is out of range", inode_id, indirect);
+        return;
+    }
+    list->index_ids[list->index_count++] = indirect;
+    uint32_t *pointers = (uint32_t *) block_cache_get(&state->fs->cache, indirect, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        if (valid_block(state, pointers[i])) {
+            list->ids[list->count++] = pointers[i];
+        } else {
+            log_problem(log, "inode %d: block %u is out of range", inode_id, pointers[i]);
+        }
+    }
+    block_cache_put(&state->fs->cache, (dir_item *) pointers, 0);
+}
+
+// 按直接和间接指针读出 inode 的前 size 个 block
+static void read_pointers(fsck_state *state, int32_t inode_id, uint32_t size, block_list *list, fsck_log *log) {
+    inode *node = &state->fs->inode_table[inode_id];
+    uint32_t block_size = state->fs->block_size;
+    uint32_t per_block = POINTERS_PER_BLOCK(block_size);
+    uint32_t single_end = DIRECT_BLOCKS + per_block;    // 一级间接 block 之后的第一个 block
+    uint32_t direct = size <= INODE_BLOCKS ? size : DIRECT_BLOCKS;
+    for (uint32_t i = 0; i < direct; i++) {
+        if (valid_block(state, node->block_point[i])) {
+            list->ids[list->count++] = node->block_point[i];
+        } else {
+            log_problem(log, "inode %d: block %u is out of range", inode_id, node->block_point[i]);
+        }
+    }
+    if (size > INODE_BLOCKS) {
+        uint32_t single = size < single_end ? size : single_end;
+        read_indirect(state, inode_id, node->block_point[INDIRECT_BLOCK], single - DIRECT_BLOCKS, list, log);
+    }
+    if (size > single_end) {
+        uint32_t root = node->block_point[DOUBLE_INDIRECT_BLOCK];
+        if (valid_block(state, root)) {
+            list->index_ids[list->index_count++] = root;
+            uint32_t leaves[POINTERS_PER_BLOCK(MAX_BLOCK_SIZE)];
+            uint32_t *pointers = (uint32_t *) block_cache_get(&state->fs->cache, root, 1);
+            memcpy(leaves, pointers, block_size);
+            block_cache_put(&state->fs->cache, (dir_item *) pointers, 0);
+            for (uint32_t i = 0; i * per_block < size - single_end; i++) {
+                uint32_t count = size - single_end - i * per_block;
+                read_indirect(state, inode_id, leaves[i], count < per_block ? count : per_block, list, log);
+            }
+        } else {
+            log_problem(log, "inode %d: indirect block %u is out of range", inode_id, root);
+        }
+    }
+}
+
+// 记录 count 段中的 block，至多 size 个，跳过超出范围的段，mapped 累加各段的 block 数
+static void read_runs(fsck_state *state, int32_t inode_id, const extent *extents, uint32_t count, uint32_t size,
+                      uint64_t *mapped, block_list *list, fsck_log *log) {
+    for (uint32_t k = 0; k < count; k++) {
+        const extent *e = &extents[k];
+        if (e->count == 0) {    // 未用的段
+            continue;
+        }
+        *mapped += e->count;
+        if (!valid_block(state, e->start) || e->count > state->data_end - e->start) {
+            log_problem(log, "inode %d: extent of %u blocks at %u is out of range", inode_id, e->count, e->start);
+            continue;
+        }
+        for (uint32_t i = 0; i < e->count && (uint32_t) list->count < size; i++) {
+            list->ids[list->count++] = e->start + i;
+        }
+    }
+}
+
+// 记录 extent block 中的前 count 段
+static void read_extent_block(fsck_state *state, int32_t inode_id, uint32_t block_id, uint32_t count, uint32_t size,
+                              uint64_t *mapped, block_list *list, fsck_log *log) {
+    if (!valid_block(state, block_id)) {
+        log_problem(log, "inode %d: extent block %u is out of range", inode_id, block_id);
+        return;
+    }
+    list->index_ids[list->index_count++] = block_id;
+    extent *extents = (extent *) block_cache_get(&state->fs->cache, block_id, 1);
+    read_runs(state, inode_id, extents, count, size, mapped, list, log);
+    block_cache_put(&state->fs->cache, (dir_item *) extents, 0);
+}
+
+// 按 extent 读出 inode 的前 size 个 block，各段的 block 数之和应等于 size
+static void read_extents(fsck_state *state, int32_t inode_id, uint32_t size, block_list *list, fsck_log *log) {
+    inode *node = &state->fs->inode_table[inode_id];
+    uint32_t block_size = state->fs->block_size;
+    uint32_t per_block = EXTENTS_PER_BLOCK(block_size);
+    uint32_t max = EXTENT_MAX(block_size);
+    uint32_t problems = log->count;
+    uint64_t mapped = 0;
+    if (size == 0) {
+        return;
+    }
+    if (node->block_point[0] != 0) {    // 直接存放在 inode 中
+        read_runs(state, inode_id, (extent *) node->block_point, INLINE_EXTENTS, size, &mapped, list, log);
+    } else {
+        uint32_t n = node->block_point[1];
+        if (n > max) {
+            log_problem(log, "inode %d has %u extents, more than %u", inode_id, n, max);
+            n = max;
+        }
+        for (uint32_t i = 0; i < EXTENT_BLOCKS && i * per_block < n; i++) {
+            uint32_t count = n - i * per_block;
+            read_extent_block(state, inode_id, node->block_point[2 + i], count < per_block ? count : per_block,
+                              size, &mapped, list, log);
+        }
+        if (n > EXTENT_BLOCKS * per_block) {
+            uint32_t index = node->block_point[EXTENT_INDEX_BLOCK];
+            if (valid_block(state, index)) {
+                list->index_ids[list->index_count++] = index;
+                uint32_t leaves[POINTERS_PER_BLOCK(MAX_BLOCK_SIZE)];
+                uint32_t *pointers = (uint32_t *) block_cache_get(&state->fs->cache, index, 1);
+                memcpy(leaves, pointers, block_size);
+                block_cache_put(&state->fs->cache, (dir_item *) pointers, 0);
+                for (uint32_t i = 0; (EXTENT_BLOCKS + i) * per_block < n; i++) {
+                    uint32_t count = n - (EXTENT_BLOCKS + i) * per_block;
+                    read_extent_block(state, inode_id, leaves[i], count < per_block ? count : per_block,
+                                      size, &mapped, list, log);
+                }
+            } else {
+                log_problem(log, "inode %d: extent block %u is out of range", inode_id, index);
+            }
+        }
+    }
+    // 跳过的段已经记录过
+    if (log->count == problems && mapped != size) {
+        log_problem(log, "inode %d: its extents hold %llu blocks instead of %u",
+                    inode_id, (unsigned long long) mapped, size);
+    }
+}
+
+// 按 block_point 读出 inode 的所有 block，不经过 bmap_lookup，超出范围的 block 和间接 block 连同它指向的 block 被跳过
+// 结果为 malloc 的数组，问题记入 log，返回问题数
+static uint32_t read_blocks(fsck_state *state, int32_t inode_id, block_list *list, fsck_log *log) {
+    inode *node = &state->fs->inode_table[inode_id];
+    uint32_t problems = log->count;
+    uint32_t size = node->size;
+    uint32_t block_size = state->fs->block_size;
+    uint32_t max = state->data_end - state->fs->data_start;     // 数据区中至多这么多 block
+    if (max > FILE_MAX_BLOCKS(block_size)) {
+        max = FILE_MAX_BLOCKS(block_size);
+    }
+    if (size > max) {
+        log_problem(log, "inode %d has %u blocks, more than %u", inode_id, size, max);
+        size = max;
+    }
+    list->ids = malloc(sizeof(uint32_t) * (size + BMAP_MAX_INDEX_BLOCKS(block_size)));
+    list->index_ids = malloc(sizeof(uint32_t) * BMAP_MAX_INDEX_BLOCKS(block_size));
+    list->count = 0;
+    list->index_count = 0;
+    if (state->fs->mapping.format == MAP_EXTENTS) {
+        read_extents(state, inode_id, size, list, log);
+    } else {
+        read_pointers(state, inode_id, size, list, log);
+    }
+
+    // 间接 block 接在数据 block 之后
+    memcpy(list->ids + list->count, list->index_ids, sizeof(uint32_t) * list->index_count);
+    free(list->index_ids);
+    list->index_ids = list->ids + list->count;
+    return log->count - problems;
+}
+
+// 读取目录 dir_id 的所有 block，检查目录项链表，结果记入 state->dirs
+static void parse_dir(fsck_state *state, int32_t dir_id) {
+    ext2emu *fs = state->fs;
+    inode *dir = &fs->inode_table[dir_id];
+    if (dir->file_type != 1) {
+        return;
+    }
+    fsck_dir *d = calloc(1, sizeof(fsck_dir));
+    d->dot = -1;
+    d->dotdot = -1;
+
+    block_list list;
+    if (read_blocks(state, dir_id, &list, &d->log) > 0) {
+        d->rebuild = 1;
+    }
+    d->blocks = list.ids;
+    int finish = 0, live = 0, result = 0;
+    for (int i = 0; i < list.count; i++) {
+        uint32_t block_id = list.ids[i];
+        if (finish) {
+            log_problem(&d->log, "directory %d: block %u is after the last entry", dir_id, block_id);
+            d->rebuild = 1;
+            continue;
+        }
+        d->blocks[d->block_count++] = block_id;
+        dir_item *data = block_cache_get(&fs->cache, block_id, 1);
+        int bad = dir_block_check(fs->dir_format, data, fs->block_size);
+        if (bad != -1) {
+            log_problem(&d->log, "directory %d: entry %d of block %u is damaged", dir_id, bad, block_id);
+            d->rebuild = 1;
+        }
+        int pos = 0;
+        dir_entry entry;
+        while ((result = dir_block_next(fs->dir_format, data, fs->block_size, &pos, &entry)) == 1) {
+            // 复制名字，定长目录项的名字可能没有 '\0'
+            dir_item item;
+            memset(&item, 0, sizeof(item));
+            item.inode_id = entry.inode_id;
+            item.type = entry.type;
+            memcpy(item.name, entry.name, strnlen(entry.name, sizeof(item.name)));
+            if (!valid_name(item.name)) {
+                log_problem(&d->log, "directory %d: entry %d of block %u has a bad name", dir_id, entry.slot, block_id);
+                d->rebuild = 1;
+                continue;
+            }
+            // "." 和 ".." 必须是前两项
+            if (live == 0 && strcmp(item.name, ".") == 0) {
+                d->dot = item.inode_id;
+            } else if (live == 1 && strcmp(item.name, "..") == 0) {
+                d->dotdot = item.inode_id;
+            } else if (strcmp(item.name, ".") == 0 || strcmp(item.name, "..") == 0) {
+                log_problem(&d->log, "directory %d: extra '%s' entry", dir_id, item.name);
+                d->rebuild = 1;
+            } else if (item.inode_id >= fs->inode_count) {
+                log_problem(&d->log, "directory %d: entry '%s' points to inode %u, which does not exist",
+                            dir_id, item.name, item.inode_id);
+                d->rebuild = 1;
+            } else {
+                int duplicate = 0;
+                for (int k = 0; k < d->item_count && !duplicate; k++) {
+                    duplicate = strcmp(d->items[k].name, item.name) == 0;
+                }
+                if (duplicate) {
+                    log_problem(&d->log, "directory %d: duplicate entry '%s'", dir_id, item.name);
+                    d->rebuild = 1;
+                } else {
+                    if (d->item_count == d->item_capacity) {
+                        d->item_capacity = d->item_capacity == 0 ? 64 : d->item_capacity * 2;
+                        d->items = realloc(d->items, sizeof(dir_item) * d->item_capacity);
+                    }
+                    d->items[d->item_count++] = item;
+                }
+            }
+            live++;
+        }
+        finish = result == -1;
+        block_cache_put(&fs->cache, data, 0);
+    }
+
+    // 丢弃末尾之后的 block，间接 block 随之前移
+    memmove(d->blocks + d->block_count, list.index_ids, sizeof(uint32_t) * list.index_count);
+    d->index_count = list.index_count;
+    d->dropped = calloc(d->item_count + 1, 1);
+    if (d->block_count == 0) {      // 无法使用的目录，指向它的目录项将被丢弃
+        fsck_log_free(&d->log);
+        free_dir(d);
+        return;
+    }
+    // 变长目录项没有末尾标记，目录到最后一个 block 为止
+    if (!finish && fs->dir_format == DIR_ITEMS) {
+        log_problem(&d->log, "directory %d has no last entry", dir_id);
+        d->rebuild = 1;
+    }
+    if (d->dot != dir_id) {
+        log_problem(&d->log, "directory %d: '.' is missing or does not point to itself", dir_id);
+        d->rebuild = 1;
+    }
+    if (d->dotdot == -1) {
+        log_problem(&d->log, "directory %d: '..' is missing", dir_id);
+        d->rebuild = 1;
+    }
+    state->dirs[dir_id] = d;
+}
+
+// 从根目录按层遍历，每个 inode 只属于第一个遇到它的目录，之后的目录项被丢弃
+static void walk_tree(fsck_state *state) {
+    inode *inode_table = state->fs->inode_table;
+    int32_t *queue = malloc(sizeof(int32_t) * state->fs->inode_count);
+    int head = 0, tail = 0;
+    queue[tail++] = 0;
+    state->reachable[0] = 1;
+    state->parent[0] = 0;       // 根目录的 ".." 指向自身
+    while (head < tail) {
+        int32_t dir_id = queue[head++];
+        fsck_dir *d = state->dirs[dir_id];
+        log_append(state->log, &d->log);
+        if (d->dotdot != -1 && d->dotdot != state->parent[dir_id]) {
+            log_problem(state->log, "directory %d: '..' points to %d instead of %d",
+                        dir_id, d->dotdot, state->parent[dir_id]);
+            d->rebuild = 1;
+        }
+
+        // 重写时依次排列 "."、".." 和保留的目录项，原有的 block 放不下的目录项被丢弃
+        int format = state->fs->dir_format, block_size = state->fs->block_size;
+        int block = 0, used = 0;
+        dir_block_place(format, block_size, &block, &used, ".");
+        dir_block_place(format, block_size, &block, &used, "..");
+        for (int k = 0; k < d->item_count; k++) {
+            dir_item *item = &d->items[k];
+            int32_t child = item->inode_id;
+            uint8_t type = inode_table[child].file_type == 1;
+            int next_block = block, next_used = used;
+            dir_block_place(format, block_size, &next_block, &next_used, item->name);
+            if (type == 1 && state->dirs[child] == NULL) {
+                log_problem(state->log, "directory %d: entry '%s' points to damaged directory %d",
+                            dir_id, item->name, child);
+            } else if (state->reachable[child]) {
+                log_problem(state->log, "inode %d is linked from directory %d and directory %d",
+                            child, state->parent[child], dir_id);
+            } else if (next_block >= d->block_count) {
+                log_problem(state->log, "directory %d: no room for entry '%s'", dir_id, item->name);
+            } else {
+                if (item->type != type) {
+                    log_problem(state->log, "directory %d: entry '%s' has the wrong type", dir_id, item->name);
+                    item->type = type;
+                    d->rebuild = 1;
+                }
+                state->reachable[child] = 1;
+                state->parent[child] = dir_id;
+                block = next_block;
+                used = next_used;
+                if (type == 1) {
+                    queue[tail++] = child;
+                }
+                continue;
+            }
+            d->dropped[k] = 1;
+            d->rebuild = 1;
+        }
+    }
+    free(queue);
+}
+
+// 记录可达 inode 的合法 block 和间接 block，并统计每个 block 被引用的次数
+static void claim_blocks(fsck_state *state, int32_t inode_id) {
+    if (!state->reachable[inode_id]) {
+        return;
+    }
+    fsck_dir *d = state->dirs[inode_id];
+    if (d != NULL) {
+        state->block_count[inode_id] = d->block_count;
+        state->index_count[inode_id] = d->index_count;
+        state->blocks[inode_id] = d->blocks;
+        d->blocks = NULL;
+    } else {
+        block_list list;
+        read_blocks(state, inode_id, &list, &state->file_logs[inode_id]);
+        state->block_count[inode_id] = list.count;
+        state->index_count[inode_id] = list.index_count;
+        state->blocks[inode_id] = list.ids;
+    }
+    for (int i = 0; i < state->block_count[inode_id] + state->index_count[inode_id]; i++) {
+        uint32_t block_id = state->blocks[inode_id][i];
+        __atomic_fetch_add(&state->claims[block_id], 1, __ATOMIC_RELAXED);
+        int32_t owner = __atomic_load_n(&state->owner[block_id], __ATOMIC_RELAXED);
+        while (inode_id < owner && !__atomic_compare_exchange_n(&state->owner[block_id], &owner, inode_id, 0,
+                                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+}
+
+// block 的第 i 个引用是否与之前的引用重复：属于更小的 inode，或在本 inode 中已出现过
+static int shared_block(fsck_state *state, int32_t inode_id, int i) {
+    uint32_t block_id = state->blocks[inode_id][i];
+    if (state->owner[block_id] != inode_id) {
+        return 1;
+    }
+    if (state->claims[block_id] == 1) {
+        return 0;
+    }
+    for (int j = 0; j < i; j++) {
+        if (state->blocks[inode_id][j] == block_id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 检查文件的 block 和所有可达 inode 之间重复使用的 block
+static void check_inodes(fsck_state *state) {
+    for (int32_t inode_id = 0; inode_id < (int32_t) state->fs->inode_count; inode_id++) {
+        if (!state->reachable[inode_id]) {
+            continue;
+        }
+        inode *cur_inode = &state->fs->inode_table[inode_id];
+        if (state->dirs[inode_id] == NULL) {    // 目录的 block 在解析时已检查
+            log_append(state->log, &state->file_logs[inode_id]);
+            if (cur_inode->tail >= state->fs->block_size) {
+                log_problem(state->log, "inode %d: its last block holds %u bytes", inode_id, cur_inode->tail);
+            }
+        }
+        for (int i = 0; i < state->block_count[inode_id] + state->index_count[inode_id]; i++) {
+            uint32_t block_id = state->blocks[inode_id][i];
+            if (!shared_block(state, inode_id, i)) {
+                continue;
+            }
+            if (state->owner[block_id] == inode_id) {
+                log_problem(state->log, "block %u is used twice by inode %d", block_id, inode_id);
+            } else {
+                log_problem(state->log, "block %u is used by inode %d and inode %d",
+                            block_id, state->owner[block_id], inode_id);
+            }
+        }
+    }
+}
+
+// 第 g 个块组的位图和索引表应在的位置，与 setup_meta 一致
+static void group_locations(ext2emu *fs, uint32_t g, group_desc *desc) {
+    uint32_t table_blocks = fs->inodes_per_group / INODES_PER_BLOCK(fs->block_size);
+    desc->block_bitmap = fs->meta_location[1 + fs->gdt_blocks + g];
+    desc->inode_bitmap = fs->meta_location[1 + fs->gdt_blocks + fs->group_count + g];
+    desc->inode_table = fs->meta_location[fs->inode_table_start + g * table_blocks];
+}
+
+// 位图和计数应与遍历结果一致，超级块、组描述符、各块组的位图、索引表和日志所在的 block 始终已分配
+// 每个块组的描述符还应记录它的位图和索引表的位置，以及组内的计数
+static void check_bitmaps(fsck_state *state) {
+    ext2emu *fs = state->fs;
+    sp_block *spBlock = fs->spBlock;
+    int32_t free_blocks = 0, free_inodes = 0, dirs = 0;
+    uint32_t *group_free_blocks = calloc(fs->group_count, sizeof(uint32_t));
+    uint32_t *group_free_inodes = calloc(fs->group_count, sizeof(uint32_t));
+    uint32_t *group_dirs = calloc(fs->group_count, sizeof(uint32_t));
+    for (uint32_t block_id = 0; block_id < fs->block_count; block_id++) {
+        int used = !valid_block(state, block_id) || state->claims[block_id] > 0;
+        free_blocks += !used;
+        group_free_blocks[block_id / fs->blocks_per_group] += !used;
+        if (used && !bitmap_test(fs->block_map, block_id)) {
+            log_problem(state->log, "block %u is in use but marked free", block_id);
+        } else if (!used && bitmap_test(fs->block_map, block_id)) {
+            log_problem(state->log, "block %u is marked in use but not used by any inode", block_id);
+        }
+    }
+    for (int32_t inode_id = 0; inode_id < (int32_t) fs->inode_count; inode_id++) {
+        int used = state->reachable[inode_id];
+        free_inodes += !used;
+        dirs += used && state->dirs[inode_id] != NULL;
+        group_free_inodes[inode_id / fs->inodes_per_group] += !used;
+        group_dirs[inode_id / fs->inodes_per_group] += used && state->dirs[inode_id] != NULL;
+        if (used && !bitmap_test(fs->inode_map, fs_inode_bit(fs, inode_id))) {
+            log_problem(state->log, "inode %d is in use but marked free", inode_id);
+        } else if (!used && bitmap_test(fs->inode_map, fs_inode_bit(fs, inode_id))) {
+            log_problem(state->log, "inode %d is not linked from any directory", inode_id);
+        }
+    }
+    // 没有块组时描述符只在内存中，与超级块的计数一同检查
+    for (uint32_t g = 0; g < fs->group_count && fs->gdt_blocks > 0; g++) {
+        group_desc *desc = &fs->groups[g], expected;
+        group_locations(fs, g, &expected);
+        if (desc->block_bitmap != expected.block_bitmap || desc->inode_bitmap != expected.inode_bitmap
+            || desc->inode_table != expected.inode_table) {
+            log_problem(state->log, "group %u: the descriptor points to the wrong blocks", g);
+        }
+        if (desc->free_blocks_count != group_free_blocks[g]) {
+            log_problem(state->log, "group %u: free block count is %u, should be %u",
+                        g, desc->free_blocks_count, group_free_blocks[g]);
+        }
+        if (desc->free_inodes_count != group_free_inodes[g]) {
+            log_problem(state->log, "group %u: free inode count is %u, should be %u",
+                        g, desc->free_inodes_count, group_free_inodes[g]);
+        }
+        if (desc->used_dirs_count != group_dirs[g]) {
+            log_problem(state->log, "group %u: directory count is %u, should be %u",
+                        g, desc->used_dirs_count, group_dirs[g]);
+        }
+    }
+    free(group_free_blocks);
+    free(group_free_inodes);
+    free(group_dirs);
+    if (spBlock->free_block_count != free_blocks) {
+        log_problem(state->log, "free block count is %d, should be %d", spBlock->free_block_count, free_blocks);
+    }
+    if (spBlock->free_inode_count != free_inodes) {
+        log_problem(state->log, "free inode count is %d, should be %d", spBlock->free_inode_count, free_inodes);
+    }
+    if (spBlock->dir_inode_count != dirs) {
+        log_problem(state->log, "directory count is %d, should be %d", spBlock->dir_inode_count, dirs);
+    }
+}
+
+// 按解析结果重写目录：依次为 "."、".." 和保留的目录项，空出的 block 不再属于目录
+static void rebuild_dir(fsck_state *state, int32_t dir_id) {
+    ext2emu *fs = state->fs;
+    fsck_dir *d = state->dirs[dir_id];
+    dir_entry *entries = malloc(sizeof(dir_entry) * (d->item_count + 2));
+    entries[0] = (dir_entry) {dir_id, 1, 0, "."};
+    entries[1] = (dir_entry) {state->parent[dir_id], 1, 0, ".."};
+    int count = 2;
+    for (int k = 0; k < d->item_count; k++) {
+        if (!d->dropped[k]) {
+            entries[count++] = (dir_entry) {d->items[k].inode_id, d->items[k].type, 0, d->items[k].name};
+        }
+    }
+
+    // 与 walk_tree 同样依次排列，每排满一个 block 写入一次
+    int block = 0, used = 0, first = 0;
+    for (int k = 0; k <= count; k++) {
+        int next = block;
+        if (k < count) {
+            dir_block_place(fs->dir_format, fs->block_size, &next, &used, entries[k].name);
+        }
+        if (k == count || next != block) {
+            dir_item *data = block_cache_get(&fs->cache, state->blocks[dir_id][block], 0);
+            dir_block_pack(fs->dir_format, data, fs->block_size, entries + first, k - first, k == count);
+            block_cache_put(&fs->cache, data, 1);
+            first = k;
+            block = next;
+        }
+    }
+    int blocks = block + 1;
+    // 间接 block 随之前移
+    uint32_t *ids = state->blocks[dir_id];
+    memmove(ids + blocks, ids + state->block_count[dir_id], sizeof(uint32_t) * state->index_count[dir_id]);
+    state->block_count[dir_id] = blocks;
+    free(entries);
+    dcache_invalidate_dir(&fs->dcache, dir_id);
+    dir_index_drop(&fs->dir_index, dir_id);
+}
+
+// 修复所有问题，返回无法修复的问题数
+static uint32_t repair_fs(fsck_state *state) {
+    ext2emu *fs = state->fs;
+    sp_block *spBlock = fs->spBlock;
+    uint32_t unrepaired = 0;
+
+    // 已分配的 block，用于为重复使用的 block 分配副本
+    uint64_t *used = calloc((fs->block_count + 63) / 64, sizeof(uint64_t));
+    for (uint32_t block_id = 0; block_id < fs->block_count; block_id++) {
+        if (!valid_block(state, block_id) || state->claims[block_id] > 0) {
+            bitmap_set(used, block_id);
+        }
+    }
+
+    // 重复使用的 block 除第一个引用外各复制一份，没有空闲 block 时保持原样
+    for (int32_t inode_id = 0; inode_id < (int32_t) fs->inode_count; inode_id++) {
+        for (int i = 0; i < state->block_count[inode_id] + state->index_count[inode_id]; i++) {
+            if (!shared_block(state, inode_id, i)) {
+                continue;
+            }
+            int32_t copy = bitmap_find_zero(used, fs->block_count, fs->data_start);
+            if (copy == -1) {
+                unrepaired++;
+                continue;
+            }
+            bitmap_set(used, copy);
+            dir_item *src = block_cache_get(&fs->cache, state->blocks[inode_id][i], 1);
+            dir_item *dst = block_cache_get(&fs->cache, copy, 0);
+            memcpy(dst, src, fs->block_size);
+            block_cache_put(&fs->cache, dst, 1);
+            block_cache_put(&fs->cache, src, 0);
+            state->blocks[inode_id][i] = copy;
+        }
+    }
+
+    for (int32_t inode_id = 0; inode_id < (int32_t) fs->inode_count; inode_id++) {
+        if (state->reachable[inode_id] && state->dirs[inode_id] != NULL && state->dirs[inode_id]->rebuild) {
+            rebuild_dir(state, inode_id);
+        }
+    }
+
+    // 按遍历结果重写 block_point 并重建位图和计数
+    memset(fs->block_map, 0, (fs->block_count + 63) / 64 * sizeof(uint64_t));
+    memset(fs->inode_map, 0, (fs_inode_bit(fs, fs->inode_count - 1) + 64) / 64 * sizeof(uint64_t));
+    for (uint32_t g = 0; g < fs->group_count; g++) {
+        group_desc *desc = &fs->groups[g];
+        if (fs->gdt_blocks > 0) {
+            group_locations(fs, g, desc);
+        }
+        desc->free_blocks_count = 0;
+        desc->free_inodes_count = fs->inodes_per_group;
+        desc->used_dirs_count = 0;
+    }
+    int32_t used_blocks = 0, used_inodes = 0, dirs = 0;
+    for (uint32_t block_id = 0; block_id < fs->block_count; block_id++) {
+        if (!valid_block(state, block_id)) {
+            bitmap_set(fs->block_map, block_id);
+            used_blocks++;
+        }
+    }
+    for (int32_t inode_id = 0; inode_id < (int32_t) fs->inode_count; inode_id++) {
+        if (!state->reachable[inode_id]) {
+            dcache_invalidate_dir(&fs->dcache, inode_id);
+            dir_index_drop(&fs->dir_index, inode_id);
+            continue;
+        }
+        // 查找不等其他调用结束，可能正不加锁地读取这个 inode，见 fs_lookup_cached
+        inode *cur_inode = &fs->inode_table[inode_id];
+        fs_inode_change_begin(fs, inode_id);
+        if (cur_inode->tail >= fs->block_size) {
+            __atomic_store_n(&cur_inode->tail, 0, __ATOMIC_RELEASE);
+        }
+
+        // 间接 block 优先使用原来的，不够时另外分配，无法分配时只保留不需要间接 block 的部分
+        uint32_t *ids = state->blocks[inode_id];
+        uint32_t count = state->block_count[inode_id];
+        uint32_t index_ids[BMAP_MAX_INDEX_BLOCKS(MAX_BLOCK_SIZE)];
+        __atomic_store_n(&cur_inode->size, 0, __ATOMIC_RELEASE);
+        int need = bmap_index_blocks(&fs->mapping, cur_inode, ids, count);
+        for (int i = 0; i < need; i++) {
+            if (i < state->index_count[inode_id]) {
+                index_ids[i] = ids[count + i];
+                continue;
+            }
+            int32_t block_id = bitmap_find_zero(used, fs->block_count, fs->data_start);
+            if (block_id == -1) {
+                need = -1;
+                break;
+            }
+            bitmap_set(used, block_id);
+            index_ids[i] = block_id;
+        }
+        if (need < 0) {
+            unrepaired++;
+            count = count < INODE_BLOCKS ? count : INODE_BLOCKS;
+            while (bmap_index_blocks(&fs->mapping, cur_inode, ids, count) != 0) {
+                count--;
+            }
+            need = 0;
+        }
+        bmap_append(&fs->mapping, cur_inode, ids, count, index_ids);
+        fs_inode_change_end(fs, inode_id);
+        for (uint32_t i = 0; i < count + (uint32_t) need; i++) {
+            uint32_t block_id = i < count ? ids[i] : index_ids[i - count];
+            if (!bitmap_test(fs->block_map, block_id)) {
+                bitmap_set(fs->block_map, block_id);
+                used_blocks++;
+            }
+        }
+        bitmap_set(fs->inode_map, fs_inode_bit(fs, inode_id));
+        used_inodes++;
+        dirs += state->dirs[inode_id] != NULL;
+        fs->groups[inode_id / fs->inodes_per_group].free_inodes_count--;
+        fs->groups[inode_id / fs->inodes_per_group].used_dirs_count += state->dirs[inode_id] != NULL;
+    }
+    for (uint32_t block_id = 0; block_id < fs->block_count; block_id++) {
+        fs->groups[block_id / fs->blocks_per_group].free_blocks_count += !bitmap_test(fs->block_map, block_id);
+    }
+    spBlock->free_block_count = fs->block_count - used_blocks;
+    spBlock->free_inode_count = fs->inode_count - used_inodes;
+    spBlock->dir_inode_count = dirs;
+    memset(fs->meta_dirty, 1, fs->meta_blocks);    // 超级块、组描述符、位图和索引表全部重写
+    free(used);
+    return unrepaired;
+}
+
+void fsck_check(ext2emu *fs, int repair, fsck_log *log, ext2emu_fsckstat *st) {
+    memset(log, 0, sizeof(fsck_log));
+    st->problems = 0;
+    st->repaired = 0;
+
+    sp_block *spBlock = fs->spBlock;
+    int damaged = spBlock->journal_blocks > 0 && (spBlock->journal_start < fs->data_start
+                                                  || spBlock->journal_blocks > fs->block_count - spBlock->journal_start);
+    // 日志不能覆盖其他块组的位图和索引表
+    for (uint32_t i = 0; i < spBlock->journal_blocks && !damaged; i++) {
+        damaged = fs_is_meta_block(fs, spBlock->journal_start + i);
+    }
+    if (damaged) {
+        log_problem(log, "the journal region is damaged");
+        st->problems = log->count;
+        return;
+    }
+
+    fsck_state *state = calloc(1, sizeof(fsck_state));
+    state->fs = fs;
+    state->data_end = spBlock->journal_blocks > 0 ? spBlock->journal_start : fs->block_count;
+    state->log = log;
+    state->dirs = calloc(fs->inode_count, sizeof(fsck_dir *));
+    state->reachable = calloc(fs->inode_count, sizeof(uint8_t));
+    state->parent = calloc(fs->inode_count, sizeof(int32_t));
+    state->block_count = calloc(fs->inode_count, sizeof(int));
+    state->index_count = calloc(fs->inode_count, sizeof(int));
+    state->blocks = calloc(fs->inode_count, sizeof(uint32_t *));
+    state->file_logs = calloc(fs->inode_count, sizeof(fsck_log));
+    state->claims = calloc(fs->block_count, sizeof(uint32_t));
+    state->owner = malloc(sizeof(int32_t) * fs->block_count);
+    for (uint32_t i = 0; i < fs->block_count; i++) {
+        state->owner[i] = fs->inode_count;
+    }
+
+    for_each_inode(state, parse_dir);       // 并行读取所有目录
+    if (state->dirs[0] == NULL) {
+        log_problem(log, "the root directory is damaged");
+    } else {
+        walk_tree(state);
+        for_each_inode(state, claim_blocks);    // 并行扫描索引表
+        check_inodes(state);
+        check_bitmaps(state);
+    }
+    st->problems = log->count;
+
+    // 根目录损坏时无法修复
+    if (repair && st->problems > 0 && state->dirs[0] != NULL) {
+        // 修复不经过日志，之后由调用者写回
+        int journaling = fs->journaling;
+        fs->journaling = 0;
+        block_cache_hold_dirty(&fs->cache, 0);
+        st->repaired = st->problems - repair_fs(state);
+        fs_checkpoint(fs);
+        fs->journaling = journaling;
+        block_cache_hold_dirty(&fs->cache, journaling);
+    }
+
+    for (uint32_t i = 0; i < fs->inode_count; i++) {
+        if (state->dirs[i] != NULL) {
+            fsck_log_free(&state->dirs[i]->log);
+            free_dir(state->dirs[i]);
+        }
+        fsck_log_free(&state->file_logs[i]);
+        free(state->blocks[i]);
+    }
+    free(state->dirs);
+    free(state->reachable);
+    free(state->parent);
+    free(state->block_count);
+    free(state->index_count);
+    free(state->blocks);
+    free(state->file_logs);
+    free(state->claims);
+    free(state->owner);
+    free(state);
+}
@@ -0,0 +1,27 @@
+#ifndef EXT2_EMULATOR_FSCK_H
+#define EXT2_EMULATOR_FSCK_H
+
+#include "fs_operation.h"
+
+#define FSCK_THREADS 8
+// 并行扫描索引表和目录时最多使用的线程数，不超过 CPU 数
+
+typedef struct fsck_log {
+    char *text;
+    // 依次存放每条消息，以 '\0' 分隔
+    size_t length;
+    size_t capacity;
+    uint32_t count;
+    // 消息数
+} fsck_log;
+
+// 检查文件系统：从根目录遍历整棵树，核对 block 位图、inode 位图和超级块中的计数，
+// 检查每个目录的目录项链表，找出孤立的 inode、重复使用和越界的 block
+// repair 为 1 时修复：丢弃坏的目录项并重写目录，为重复使用的 block 复制一份，
+// 释放孤立的 inode 和 block，按遍历结果重建位图和计数
+// 修复不经过日志，完成后直接写回磁盘
+// 每个问题在 log 中记录一条消息，结果写入 st；调用者独占 ns_lock 并已写回内存中的修改
+void fsck_check(ext2emu *fs, int repair, fsck_log *log, ext2emu_fsckstat *st);
+void fsck_log_free(fsck_log *log);
+
+#endif //EXT2_EMULATOR_FSCK_H
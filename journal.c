@@ -0,0 +1,99 @@
+#include "journal.h"
+
+// FNV-1a
+static uint32_t checksum(uint32_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void journal_init(journal *j, disk_file *disk, uint32_t start, uint32_t blocks, uint32_t block_size) {
+    j->disk = disk;
+    j->start = start;
+    j->blocks = blocks;
+    j->block_size = block_size;
+    j->descriptor.magic = JOURNAL_MAGIC;
+    j->descriptor.sequence = 0;
+    j->descriptor.count = 0;
+}
+
+uint32_t journal_capacity(journal *j) {
+    uint32_t capacity = j->blocks - 1;
+    return capacity < JOURNAL_MAX_TRANSACTION ? capacity : JOURNAL_MAX_TRANSACTION;
+}
+
+void journal_replay(journal *j) {
+    disk_read(j->disk, j->start * j->block_size, &j->descriptor, sizeof(journal_descriptor));
+    if (j->descriptor.magic != JOURNAL_MAGIC) {
+        journal_init(j, j->disk, j->start, j->blocks, j->block_size);
+        return;
+    }
+    if (j->descriptor.count == 0 || j->descriptor.count > journal_capacity(j)) {
+        journal_begin(j);
+        return;
+    }
+
+    // 校验事务是否完整写入
+    uint32_t h = checksum(2166136261u, &j->descriptor.sequence, sizeof(uint32_t));
+    for (uint32_t i = 0; i < j->descriptor.count; i++) {
+        disk_read(j->disk, (j->start + 1 + i) * j->block_size, j->buffer, j->block_size);
+        h = checksum(h, &j->descriptor.block_id[i], sizeof(int32_t));
+        h = checksum(h, j->buffer, j->block_size);
+    }
+    if (h != j->descriptor.checksum) {
+        journal_begin(j);
+        return;
+    }
+
+    // 将事务中的 block 写回原位置
+    for (uint32_t i = 0; i < j->descriptor.count; i++) {
+        disk_read(j->disk, (j->start + 1 + i) * j->block_size, j->buffer, j->block_size);
+        disk_write(j->disk, j->descriptor.block_id[i] * j->block_size, j->buffer, j->block_size);
+    }
+    disk_sync(j->disk);
+    journal_clear(j);
+}
+
+void journal_begin(journal *j) {
+    j->descriptor.count = 0;
+    j->descriptor.checksum = checksum(2166136261u, &j->descriptor.sequence, sizeof(uint32_t));
+}
+
+int journal_log(journal *j, int32_t block_id, const void *data, size_t len) {
+    if (j->descriptor.count == journal_capacity(j)) {
+        return -1;
+    }
+    const void *block = data;
+    if (len < j->block_size) {
+        memcpy(j->buffer, data, len);
+        memset(j->buffer + len, 0, j->block_size - len);
+        block = j->buffer;
+    }
+    // 依次写入，日志是顺序写
+    disk_write(j->disk, (j->start + 1 + j->descriptor.count) * j->block_size, block, j->block_size);
+    j->descriptor.block_id[j->descriptor.count++] = block_id;
+    j->descriptor.checksum = checksum(j->descriptor.checksum, &block_id, sizeof(int32_t));
+    j->descriptor.checksum = checksum(j->descriptor.checksum, block, j->block_size);
+    return 0;
+}
+
+uint32_t journal_commit(journal *j) {
+    if (j->descriptor.count == 0) {
+        return 0;
+    }
+
+    disk_sync(j->disk);    // 先保证 block 内容落盘
+    disk_write(j->disk, j->start * j->block_size, &j->descriptor, sizeof(journal_descriptor));
+    disk_sync(j->disk);    // 描述块落盘，事务提交
+    return j->descriptor.count;
+}
+
+void journal_clear(journal *j) {
+    j->descriptor.sequence++;
+    j->descriptor.count = 0;
+    disk_write(j->disk, j->start * j->block_size, &j->descriptor, sizeof(journal_descriptor));
+    journal_begin(j);
+}
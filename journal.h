@@ -0,0 +1,67 @@
+#ifndef EXT2_EMULATOR_JOURNAL_H
+#define EXT2_EMULATOR_JOURNAL_H
+
+#include "fs_operation.h"
+#include "disk.h"
+
+#define JOURNAL_BLOCKS 192
+#define JOURNAL_MIN_BLOCKS 64
+// 格式化时在磁盘末尾为日志保留的 block 数，放得下 JOURNAL_MAX_COMMANDS 条命令的预留和已执行的命令的修改；
+// 较小的磁盘至多用 1/16 保留日志，但不少于 JOURNAL_MIN_BLOCKS，即之前格式化的磁盘文件的日志大小
+#define JOURNAL_GROUP_COMMANDS 16
+// SYNC_COMMAND 下一个事务最多包含的命令数
+#define JOURNAL_COMMAND_BLOCKS 16
+// 一条命令最多修改的索引表、目录和数据 block 数，剩余空间不足时提前提交
+#define JOURNAL_COMMAND_META 6
+// 一条命令最多修改的超级块、组描述符和位图 block 数：超级块、inode 位图、两个 block 位图和它们的组描述符
+#define JOURNAL_MAX_COMMANDS 8
+// 日志较大时可以同时执行的修改文件系统的命令数，block 缓存为它们留出 frame；更多的命令等待其中之一结束
+#define JOURNAL_DATA_BLOCKS 8
+// 写文件和整理目录时一条命令最多改写的 block 数，其余留给间接 block、目录和超级块，更大的改动分成多条命令
+#define JOURNAL_MAX_TRANSACTION 252
+// 描述块能记录的 block 数，即一个事务最多包含的 block 数
+#define JOURNAL_MAGIC 0x4C4E524A
+// "JRNL"
+
+typedef struct journal_descriptor {
+    // 日志的第一个 block，其后依次是事务中各 block 的内容
+    uint32_t magic;
+    uint32_t sequence;
+    // 事务序号
+    uint32_t count;
+    // 事务中的 block 数，0 表示日志中没有待写回的事务
+    uint32_t checksum;
+    // 覆盖序号、block 号和所有 block 内容，用于识别未写完的事务
+    int32_t block_id[JOURNAL_MAX_TRANSACTION];
+    // 每个 block 在磁盘上的位置
+} journal_descriptor;
+
+typedef struct journal {
+    disk_file *disk;
+    uint32_t start;
+    // 日志的第一个 block
+    uint32_t blocks;
+    // 日志占用的 block 数
+    uint32_t block_size;
+    journal_descriptor descriptor;
+    // 当前事务的描述块，位于日志第一个 block 的开头
+    uint8_t buffer[MAX_BLOCK_SIZE];
+} journal;
+
+// 设置日志区域的位置和大小，以 block 为单位
+void journal_init(journal *j, disk_file *disk, uint32_t start, uint32_t blocks, uint32_t block_size);
+// 一个事务最多包含的 block 数
+uint32_t journal_capacity(journal *j);
+// 重放已提交但未写回的事务，在 fs_init 加载超级块之后、加载索引表之前调用
+void journal_replay(journal *j);
+// 开始一个新事务
+void journal_begin(journal *j);
+// 将 block_id 的新内容写入日志，len 小于 block 大小时补 0
+// 事务已有 journal_capacity 个 block 时不写入，返回 -1
+int journal_log(journal *j, int32_t block_id, const void *data, size_t len);
+// 落盘日志内容后写入描述块，描述块落盘即为提交，返回事务中的 block 数
+uint32_t journal_commit(journal *j);
+// 事务中的 block 已全部写回原位置，清空日志
+void journal_clear(journal *j);
+
+#endif //EXT2_EMULATOR_JOURNAL_H
@@ -1,45 +1,350 @@
 #include <stdio.h>
 #include <pwd.h>
 #include <unistd.h>
-#include "fs_operation.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ext2emu.h"
 
 //#define debug
 
-int main() {
+const char disk[] = "./disk.os";    // 磁盘文件
+
+// 输出磁盘空间使用信息
+void print_information(ext2emu *fs) {
+    ext2emu_fsstat st;
+    ext2emu_statfs(fs, &st);
+    printf("In this FileSystem:\n"
+           "The maximum size of a single file is about %uMB;\n"
+           "A single folder can contain as many files and folders as there are free inodes;\n"
+           "The whole file system can contain mostly %u files and folders;\n"
+           "**It has %d folders and %d files in this system now;\n"
+           "**It has %dKB free space now;\n"
+           "**And it can accept another %d now files or folders.\n"
+           "--------------------------------------------------------------------\n"
+           "!!!!!!! **The instruction should be shorter than 400 bytes** !!!!!!!\n"
+           "--------------------------------------------------------------------\n",
+           st.max_file_size >> 20, st.inodes,
+           st.dirs, st.files, (uint32_t) ((uint64_t) st.free_blocks * st.block_size / 1024), st.free_inodes);
+}
+
+void print_help_info()
+{
+    printf("create:\n"
+           "Usage: create SIZE FILE\n"
+           "  or:  create OPTION DIRECTORY\n"
+           "Create the FILE or DIRECTORY, if it does not already exist.\n"
+           "  -d\tcreate directory\n\n"
+           "delete:\n"
+           "Usage: delete OPTION FILE\n"
+           "Delete the FILE\n"
+           "  -d\tdelete directory and its contents recursively.\n"
+           "  -f\tdelete file\n\n"
+           "df:\n"
+           "Usage: df\n"
+           "Show information about the file system.\n\n"
+           "ls:\n"
+           "Usage: ls FILE\n"
+           "List information about the FILEs.\n\n"
+           "cat:\n"
+           "Usage: cat FILE\n"
+           "Print the contents of the FILE.\n\n"
+           "write:\n"
+           "Usage: write OFFSET FILE TEXT\n"
+           "Write the TEXT, the rest of the line, into the FILE at byte OFFSET.\n\n"
+           "move:\n"
+           "Usage: move SOURCE DESTINATION\n"
+           "move SOURCE to DESTINATION.\n\n"
+           "compact:\n"
+           "Usage: compact DIRECTORY\n"
+           "Pack the entries of the DIRECTORY and release its empty blocks.\n\n"
+           "sync:\n"
+           "Usage: sync\n"
+           "Write all changes back to the disk.\n\n"
+           "shutdown:\n"
+           "Usage: shutdown\n"
+           "Shut down the file system.\n");
+}
+
+// 输出错误信息，action 为出错的动作，如 "cannot access"
+void print_error(const char *command, const char *action, int error) {
+    const char *path;
+    int length = ext2emu_error_path(&path);
+    if (error == EXT2EMU_EDOT || error == EXT2EMU_EROOT) {
+        printf("%s: %s: skipping \'%.*s\'\n", command, ext2emu_strerror(error), length, path);
+    } else {
+        printf("%s: %s \'%.*s\': %s\n", command, action, length, path, ext2emu_strerror(error));
+    }
+}
+
+// fsck 输出发现的每个问题
+void print_problem(void *arg, const char *message) {
+    printf("%s\n", message);
+}
+
+// 检查磁盘文件，返回退出码：0 没有问题，1 问题已全部修复，4 仍有问题
+int check(ext2emu *fs, int flags) {
+    ext2emu_fsckstat st;
+    ext2emu_fsck(fs, flags, print_problem, NULL, &st);
+    if (st.problems == 0) {
+        printf("%s: clean\n", disk);
+        return 0;
+    }
+    printf("%s: %u problems found, %u repaired\n", disk, st.problems, st.repaired);
+    return st.repaired == st.problems ? 1 : 4;
+}
+
+// 解析 "size[,block_size[,inodes]]"，数值可以带 K、M、G 后缀，省略的部分为 0 即默认值，格式有误时返回 -1
+int parse_geometry(const char *text, ext2emu_geometry *geometry) {
+    uint32_t *fields[3] = {&geometry->size, &geometry->block_size, &geometry->inodes};
+    memset(geometry, 0, sizeof(ext2emu_geometry));
+    for (int i = 0; i < 3; i++) {
+        char *end;
+        unsigned long long value = strtoull(text, &end, 10);
+        if (end == text || *text == '-') {
+            return -1;
+        }
+        if (*end == 'K' || *end == 'k') {
+            value <<= 10;
+            end++;
+        } else if (*end == 'M' || *end == 'm') {
+            value <<= 20;
+            end++;
+        } else if (*end == 'G' || *end == 'g') {
+            value <<= 30;
+            end++;
+        }
+        if (value > UINT32_MAX) {
+            return -1;
+        }
+        *fields[i] = value;
+        if (*end == '\0') {
+            return 0;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        text = end + 1;
+    }
+    return -1;
+}
+
+// 按 geometry 创建并格式化磁盘文件，输出其几何参数，返回退出码
+int make_fs(const ext2emu_geometry *geometry, int flags) {
+    int error = ext2emu_mkfs(disk, geometry, flags);
+    ext2emu *fs;
+    if (error == EXT2EMU_OK) {
+        error = ext2emu_open(disk, flags & EXT2EMU_MMAP, &fs);
+    }
+    if (error != EXT2EMU_OK) {
+        printf("Cannot format '%s': %s\n", disk, ext2emu_strerror(error));
+        return 1;
+    }
+    ext2emu_fsstat st;
+    ext2emu_statfs(fs, &st);
+    printf("%s: %u blocks of %u bytes in %u groups, %u inodes, %u blocks free\n",
+           disk, st.blocks, st.block_size, st.groups, st.inodes, st.free_blocks);
+    ext2emu_close(fs);
+    return 0;
+}
+
+// 路径本身有误时的错误
+int is_access_error(int error) {
+    return error == EXT2EMU_ENOENT || error == EXT2EMU_ENODIR || error == EXT2EMU_ENOTDIR;
+}
+
+// ls 输出目录中的每一项，文件夹前加 "*"
+int print_entry(void *arg, const ext2emu_dirent *entry) {
+    if (entry->type == 1) {
+        printf("*");
+    }
+    printf("%s  ", entry->name);
+    return 0;
+}
+
+// path 指向文件目录时，输出该目录下的所有文件；指向文件时，输出该文件的文件名
+void ls(ext2emu *fs, const char *path) {
+    ext2emu_stat st;
+    int error = ext2emu_lookup(fs, path, &st);
+    if (error == EXT2EMU_OK && st.type == 0) {
+        printf("%s\n", strrchr(path, '/') + 1);
+        return;
+    }
+    if (error == EXT2EMU_OK) {
+        error = ext2emu_readdir(fs, path, print_entry, NULL);
+    }
+    if (error != EXT2EMU_OK) {
+        print_error("ls", "cannot access", error);
+        return;
+    }
+    printf("\n");
+}
+
+// 分块读取文件并依次输出，顺序读取时后面的 block 已被预读
+void cat(ext2emu *fs, const char *path) {
+    char buffer[1024];
+    uint32_t offset = 0;
+    char last = '\n';
+    int count;
+    while ((count = ext2emu_read(fs, path, offset, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, count, stdout);
+        offset += count;
+        last = buffer[count - 1];
+    }
+    if (count < 0) {
+        print_error("cat", is_access_error(count) ? "cannot access" : "cannot read", count);
+        return;
+    }
+    // 保证提示符从新的一行开始
+    if (last != '\n') {
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
     char input_buffer[401];     // 输入缓冲区
     char *op = NULL;            // 记录指令操作符
     char *path = NULL;          // 记录路径
     char *arg = NULL;           // 记录参数
     char *errargs = NULL;       // 记录多余输入
 
-    struct passwd *pwd = getpwuid(getuid());    // 获取用户信息
+    // 解析命令行参数
+    int flags = 0;                              // 默认使用 stdio 访问磁盘文件
+    int sync_policy = -1;                       // 同步策略，-1 表示未指定
+    int alloc_mode = -1;
+    int compact_threshold = -1;
+    int fsck_flags = -1;                        // -1 表示不检查
+    int mkfs = 0;                               // 为 1 时格式化磁盘文件后退出
+    ext2emu_geometry geometry;
+    FILE *input = stdin;                        // 命令来源
+    int batch = !isatty(STDIN_FILENO);          // 标准输入不是终端时按脚本执行
+    int opt;
+    while ((opt = getopt(argc, argv, "mes:a:c:b:f:F:")) != -1) {
+        if (opt == 'm') {
+            flags |= EXT2EMU_MMAP;              // 将磁盘文件映射到内存
+        } else if (opt == 'e') {
+            flags |= EXT2EMU_EXTENTS;           // 格式化时用 extent 记录文件的 block
+        } else if (opt == 's' && strcmp(optarg, "always") == 0) {
+            sync_policy = SYNC_ALWAYS;          // 每次修改都写回超级块
+        } else if (opt == 's' && strcmp(optarg, "command") == 0) {
+            sync_policy = SYNC_COMMAND;         // 每条命令结束时写回超级块
+        } else if (opt == 's' && strcmp(optarg, "checkpoint") == 0) {
+            sync_policy = SYNC_CHECKPOINT;      // 仅在 sync 和 shutdown 时写回超级块
+        } else if (opt == 'a' && strcmp(optarg, "next") == 0) {
+            alloc_mode = ALLOC_NEXT_FIT;        // 逐个分配文件的 block
+        } else if (opt == 'a' && strcmp(optarg, "extent") == 0) {
+            alloc_mode = ALLOC_EXTENT;          // 尽量连续分配文件的 block
+        } else if (opt == 'c' && strspn(optarg, "0123456789") == strlen(optarg) && atoi(optarg) <= 100) {
+            compact_threshold = atoi(optarg);   // 自动整理目录的阈值，0 表示不自动整理
+        } else if (opt == 'f' && strcmp(optarg, "check") == 0) {
+            fsck_flags = 0;                     // 只检查磁盘文件
+        } else if (opt == 'f' && strcmp(optarg, "repair") == 0) {
+            fsck_flags = EXT2EMU_FSCK_REPAIR;   // 检查并修复
+        } else if (opt == 'F' && parse_geometry(optarg, &geometry) == 0) {
+            mkfs = 1;                           // 按指定的大小、block 大小和 inode 数格式化
+        } else if (opt == 'b') {
+            input = fopen(optarg, "r");         // 从脚本文件读取命令
+            if (input == NULL) {
+                printf("Cannot open file \'%s\'\n", optarg);
+                return 1;
+            }
+            batch = 1;
+        } else {
+            printf("Usage: %s [-m] [-e] [-s always|command|checkpoint] [-a next|extent] [-c percent] [-b script] [-f check|repair]"
+                   " [-F size[,block_size[,inodes]]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (mkfs) {
+        return make_fs(&geometry, flags);
+    }
+
+    // 脚本中的修改推迟到 sync 或脚本结束时写回
+    if (batch && sync_policy == -1) {
+        sync_policy = SYNC_CHECKPOINT;
+    }
+
+    // 交互方式下的提示符信息
+    struct passwd *pwd = NULL;
     char hostname[50];                          // 记录 hostname
-    gethostname(hostname, 50);                  // 获取 hostname
+    if (!batch) {
+        pwd = getpwuid(getuid());               // 获取用户信息
+        gethostname(hostname, 50);              // 获取 hostname
+    }
 
     // 初始化
-    spBlock = malloc(sizeof(sp_block));         // 初始化超级块
-    fs_init();                           // 文件系统初始化
+    ext2emu *fs;
+    if (ext2emu_open(disk, flags, &fs) != EXT2EMU_OK) {
+        printf("Cannot open file \'%s\'\n", disk);
+        return 1;
+    }
+    if (ext2emu_formatted(fs)) {
+        printf("File system does not exist.\nFormating...\n");
+    }
+    if (flags & EXT2EMU_MMAP) {
+        // mmap 方式下修改直接写在映射上，不经过日志
+        printf("Warning: '%s' is mapped into memory without the journal, a crash may leave it half updated.\n", disk);
+    }
+    if (sync_policy != -1) {
+        ext2emu_set_sync_policy(fs, sync_policy);
+    }
+    if (alloc_mode != -1) {
+        ext2emu_set_alloc_mode(fs, alloc_mode);
+    }
+    if (compact_threshold != -1) {
+        ext2emu_set_compact_threshold(fs, compact_threshold);
+    }
 
-    // 输出若干信息
-    printf("--------------------------------------------------------------------\n"
-           "----------------------------- WELCOME! -----------------------------\n"
-           "--------------------------------------------------------------------\n");
-    print_information();
+    // 检查完毕后直接退出
+    if (fsck_flags != -1) {
+        int status = check(fs, fsck_flags);
+        ext2emu_close(fs);
+        return status;
+    }
 
+    // 交互方式下输出若干信息，脚本只输出命令的结果
+    if (!batch) {
+        printf("--------------------------------------------------------------------\n"
+               "----------------------------- WELCOME! -----------------------------\n"
+               "--------------------------------------------------------------------\n");
+        print_information(fs);
+    }
+
+    int line = 0;               // 脚本的行号
     while (1) {
-        // 判断是否为 root 用户，如果是，提示符为 #，否则提示符为 $
-        if (pwd->pw_uid == 0) {
-            // \x1b[0m    : 默认
-            // \x1b[1;32m : 高亮、绿色
-            // \x1b[1;34m : 高亮、蓝色
-            printf("\x1b[1;32m%s@%s\x1b[0m:\x1b[1;34m/\x1b[0m# ", pwd->pw_name, hostname);
+        if (batch) {
+            // 脚本结束，写回所有修改后退出
+            if (fgets(input_buffer, sizeof(input_buffer), input) == NULL) {
+                ext2emu_close(fs);
+                break;
+            }
+            line++;
+            // 超过 400 个字符的行不执行，截断后可能作用于别的路径
+            size_t length = strcspn(input_buffer, "\n");
+            if (input_buffer[length] != '\n') {
+                int c = fgetc(input);
+                if (c != '\n' && c != EOF) {
+                    while ((c = fgetc(input)) != '\n' && c != EOF);
+                    printf("line %d: longer than 400 characters, skipped\n", line);
+                    continue;
+                }
+            }
+            input_buffer[strcspn(input_buffer, "\r\n")] = '\0';
         } else {
-            printf("\x1b[1;32m%s@%s\x1b[0m:\x1b[1;34m/\x1b[0m$ ", pwd->pw_name, hostname);
-        }
+            // 判断是否为 root 用户，如果是，提示符为 #，否则提示符为 $
+            if (pwd->pw_uid == 0) {
+                // \x1b[0m    : 默认
+                // \x1b[1;32m : 高亮、绿色
+                // \x1b[1;34m : 高亮、蓝色
+                printf("\x1b[1;32m%s@%s\x1b[0m:\x1b[1;34m/\x1b[0m# ", pwd->pw_name, hostname);
+            } else {
+                printf("\x1b[1;32m%s@%s\x1b[0m:\x1b[1;34m/\x1b[0m$ ", pwd->pw_name, hostname);
+            }
 
-        strcpy(input_buffer, "");       // 清空
-        scanf("%400[^\n]", input_buffer);   // 按格式读，每次读1行，最长为 399 个字符
-        setbuf(stdin, NULL);        // 清空输入缓冲区
+            strcpy(input_buffer, "");       // 清空
+            scanf("%400[^\n]", input_buffer);   // 按格式读，每次读1行，最长为 399 个字符
+            setbuf(stdin, NULL);        // 清空输入缓冲区
+        }
 
         op = strtok(input_buffer, " ");     // 分割命令
 
@@ -58,7 +363,7 @@ int main() {
                 continue;
             }
 
-            ls(path);
+            ls(fs, path);
         } else if (strcmp(op, "create") == 0) {         // create
             arg = strtok(NULL, " ");        // 参数
             path = strtok(NULL, " ");       // 路径
@@ -76,9 +381,15 @@ int main() {
             int file_size = (int)strtol(arg, NULL, 10);     // 将参数转成数字，如果无法转换则得到 0
 
             if (strcmp(arg, "-d") == 0) {
-                create_dir(path);
+                int error = ext2emu_mkdir(fs, path);
+                if (error != EXT2EMU_OK) {
+                    print_error("create", is_access_error(error) ? "cannot access" : "cannot create directory", error);
+                }
             } else if (file_size > 0) {
-                create_file(path, file_size);
+                int error = ext2emu_create(fs, path, file_size);
+                if (error != EXT2EMU_OK) {
+                    print_error("create", is_access_error(error) ? "cannot access" : "cannot create file", error);
+                }
             } else {
                 printf("create: invalid option -- \'%s\'\n", arg);
                 continue;
@@ -97,13 +408,57 @@ int main() {
             }
 
             if (strcmp(arg, "-d") == 0) {
-                delete_dir(path);
+                int error = ext2emu_rmdir(fs, path);
+                if (error == EXT2EMU_ENAMETOOLONG) {
+                    print_error("delete", "cannot access directory", error);
+                } else if (error != EXT2EMU_OK) {
+                    print_error("delete", is_access_error(error) ? "cannot access" : "cannot delete", error);
+                }
             } else if (strcmp(arg, "-f") == 0) {
-                delete_file(path);
+                int error = ext2emu_unlink(fs, path);
+                if (error == EXT2EMU_ENAMETOOLONG) {
+                    print_error("delete", "cannot access file", error);
+                } else if (error != EXT2EMU_OK) {
+                    print_error("delete", is_access_error(error) ? "cannot access" : "cannot delete", error);
+                }
             } else {
                 printf("delete: invalid option -- \'%s\'\n", arg);
                 continue;
             }
+        } else if (strcmp(op, "cat") == 0) {            // 输出文件内容
+            path = strtok(NULL, " ");
+            errargs = strtok(NULL, " ");
+
+            if (path == NULL) {
+                printf("cat: missing operand\n");
+                continue;
+            } else if (errargs != NULL) {
+                printf("cat: invalid option --\'%s\'\n", errargs);
+                continue;
+            }
+
+            cat(fs, path);
+        } else if (strcmp(op, "write") == 0) {          // 写入文件
+            arg = strtok(NULL, " ");        // 偏移
+            path = strtok(NULL, " ");
+            char *text = strtok(NULL, "");  // 行中剩余的部分
+
+            if (arg == NULL || path == NULL || text == NULL) {
+                printf("write: missing operand\n");
+                continue;
+            } else if (strspn(arg, "0123456789") != strlen(arg)) {
+                printf("write: invalid option -- \'%s\'\n", arg);
+                continue;
+            }
+
+            unsigned long offset = strtoul(arg, NULL, 10);
+            if (offset > UINT32_MAX) {      // 超出范围，由 ext2emu_write 报告文件过大
+                offset = UINT32_MAX;
+            }
+            int result = ext2emu_write(fs, path, offset, text, strlen(text));
+            if (result < 0) {
+                print_error("write", is_access_error(result) ? "cannot access" : "cannot write", result);
+            }
         } else if (strcmp(op, "move") == 0) {           // move
             char *src = strtok(NULL, " ");
             char *dst = strtok(NULL, " ");
@@ -117,7 +472,28 @@ int main() {
                 continue;
             }
 
-            move(src, dst);
+            int error = ext2emu_rename(fs, src, dst);
+            if (error == EXT2EMU_ENAMETOOLONG) {
+                print_error("move", "cannot access directory", error);
+            } else if (error != EXT2EMU_OK) {
+                print_error("move", is_access_error(error) ? "cannot access" : "cannot move file", error);
+            }
+        } else if (strcmp(op, "compact") == 0) {    // 整理目录
+            path = strtok(NULL, " ");
+            errargs = strtok(NULL, " ");
+
+            if (path == NULL) {
+                printf("compact: missing operand\n");
+                continue;
+            } else if (errargs != NULL) {
+                printf("compact: invalid option --\'%s\'\n", errargs);
+                continue;
+            }
+
+            int error = ext2emu_compact(fs, path);
+            if (error != EXT2EMU_OK) {
+                print_error("compact", error == EXT2EMU_ENOTDIR ? "cannot compact" : "cannot access", error);
+            }
         } else if (strcmp(op, "df") == 0) {         // 输出磁盘空间使用信息
             errargs = strtok(NULL, " ");
 
@@ -126,7 +502,7 @@ int main() {
                 continue;
             }
 
-            print_information();
+            print_information(fs);
         } else if (strcmp(op, "help") == 0) {
             errargs = strtok(NULL, " ");
 
@@ -136,6 +512,15 @@ int main() {
             }
 
             print_help_info();
+        } else if (strcmp(op, "sync") == 0) {       // 将修改写回磁盘
+            errargs = strtok(NULL, " ");
+
+            if (errargs != NULL) {
+                printf("sync: invalid option --\'%s\'\n", errargs);
+                continue;
+            }
+
+            ext2emu_sync(fs);
         } else if (strcmp(op, "shutdown") == 0) {   // shutdown
             errargs = strtok(NULL, " ");
 
@@ -144,25 +529,26 @@ int main() {
                 continue;
             }
 
-            shutdown();
+            ext2emu_close(fs);
+            if (!batch) {
+                printf("############################# GOODBYE! #############################\n");
+            }
             break;
 
 // 仅在开发过程可用，用于格式化磁盘
 #ifdef debug
         } else if (strcmp(op, "format") == 0) {     // format
-            spBlock->system_mod = 0;
-            fseek(fp, 0, SEEK_SET);
-            fwrite(spBlock, sizeof(sp_block), 1, fp);
-            fclose(fp);
-            fs_init();
+            ext2emu_close(fs);
+            ext2emu_open(disk, flags | EXT2EMU_FORMAT, &fs);
+            printf("File system does not exist.\nFormating...\n");
 #endif
         } else {
             printf("%s: command not found\n", op);
         }
     }
 
-    free(spBlock);  // 释放空间
-    fclose(fp);
-
+    if (input != stdin) {
+        fclose(input);
+    }
     return 0;
 }
@@ -0,0 +1,69 @@
+#include "scratch.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// 分配一个新的 chunk
+static scratch_chunk *new_chunk(size_t size) {
+    if (size < SCRATCH_CHUNK_SIZE) {
+        size = SCRATCH_CHUNK_SIZE;
+    }
+    scratch_chunk *chunk = malloc(sizeof(scratch_chunk) + size);
+    if (chunk == NULL) {
+        printf("scratch: out of memory\n");
+        exit(1);
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void *scratch_alloc(scratch_arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t) 7;    // 按 8 字节对齐
+    if (arena->current == NULL) {
+        arena->head = arena->current = new_chunk(size);
+    }
+    // 当前 chunk 不够时使用下一个，没有足够大的则新建
+    while (arena->current->size - arena->current->used < size) {
+        if (arena->current->next == NULL || arena->current->next->size < size) {
+            scratch_chunk *chunk = new_chunk(size);
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        }
+        arena->current = arena->current->next;
+        arena->current->used = 0;
+    }
+    void *p = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return p;
+}
+
+scratch_mark scratch_save(scratch_arena *arena) {
+    scratch_mark mark = {arena->current, arena->current == NULL ? 0 : arena->current->used};
+    return mark;
+}
+
+void scratch_restore(scratch_arena *arena, scratch_mark mark) {
+    if (mark.chunk == NULL) {
+        scratch_reset(arena);
+        return;
+    }
+    arena->current = mark.chunk;
+    arena->current->used = mark.used;
+}
+
+void scratch_reset(scratch_arena *arena) {
+    arena->current = arena->head;
+    if (arena->current != NULL) {
+        arena->current->used = 0;
+    }
+}
+
+void scratch_free(scratch_arena *arena) {
+    while (arena->head != NULL) {
+        scratch_chunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->current = NULL;
+}
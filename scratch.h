@@ -0,0 +1,43 @@
+#ifndef EXT2_EMULATOR_SCRATCH_H
+#define EXT2_EMULATOR_SCRATCH_H
+
+#include <stddef.h>
+
+#define SCRATCH_CHUNK_SIZE 65536
+// 每个 chunk 的最小容量，64KB
+
+typedef struct scratch_chunk {
+    struct scratch_chunk *next;
+    // 下一个 chunk，NULL 表示末尾
+    size_t size;
+    // data 的容量
+    size_t used;
+    // 已分配的字节数
+    char data[];
+} scratch_chunk;
+
+typedef struct scratch_mark {
+    scratch_chunk *chunk;
+    size_t used;
+} scratch_mark;
+
+typedef struct scratch_arena {
+    scratch_chunk *head;
+    // 第一个 chunk
+    scratch_chunk *current;
+    // 正在分配的 chunk
+} scratch_arena;
+
+// 每条命令使用的临时内存，在命令结束时整体释放
+// 分配只移动指针，chunk 用完后保留复用，不归还给系统
+void *scratch_alloc(scratch_arena *arena, size_t size);
+// 记录当前的分配位置
+scratch_mark scratch_save(scratch_arena *arena);
+// 释放 mark 之后分配的内存
+void scratch_restore(scratch_arena *arena, scratch_mark mark);
+// 释放全部内存，在每条命令结束时调用
+void scratch_reset(scratch_arena *arena);
+// 将所有 chunk 归还给系统，在关闭磁盘文件时调用
+void scratch_free(scratch_arena *arena);
+
+#endif //EXT2_EMULATOR_SCRATCH_H
@@ -0,0 +1,37 @@
+#!/bin/sh
+# 删除含有许多碎片化 extent 文件的目录：被释放的 extent block 不应标记为脏，否则一条命令的脏 block 超出日志预留的 frame
+# 用法：delete_fragmented_extents.sh path/to/ext2_emu
+set -e
+emu=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+"$emu" -e -F 64M,1024,16384 > /dev/null
+
+# 400 个文件轮流写入，每个文件的 block 互相交错，各有 8 段
+{
+    echo "create -d /d"
+    i=0
+    while [ $i -lt 400 ]; do
+        echo "create 1 /d/f$i"
+        i=$((i + 1))
+    done
+    round=1
+    while [ $round -lt 8 ]; do
+        i=0
+        while [ $i -lt 400 ]; do
+            echo "write $((round * 1024)) /d/f$i x"
+            i=$((i + 1))
+        done
+        round=$((round + 1))
+    done
+    echo "sync"
+    echo "delete -d /d"
+} > script.txt
+
+if ! "$emu" -b script.txt > output.txt || grep -q "block cache\|journal:" output.txt; then
+    tail -n 3 output.txt
+    exit 1
+fi
+"$emu" -f check